@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<batch.hpp>
+#include<util.hpp>
+#include<cstdio>
+#include<cstring>
+#include<memory>
+
+static const constexpr char *BATCH_USAGE =
+    "[user@]host [command]\n\n"
+    "Commands, given on the command line or one per line with --file:\n"
+    "  get [-r] REMOTE [LOCAL]\n"
+    "  put [-r] LOCAL [REMOTE]\n"
+    "  mkdir REMOTE\n"
+    "  cp REMOTE REMOTE\n"
+    "  mv REMOTE REMOTE\n\n"
+    "Every command runs even if an earlier one failed, the exit status\n"
+    "tells whether all succeeded. Files whose transfer was interrupted\n"
+    "are continued first by the next run to the same host.";
+
+bool is_batch_mode(int argc, char **argv) {
+    for(int i=1; i<argc; i++) {
+        if(strcmp(argv[i], "--batch") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_command(const std::vector<std::string> &args, const std::string &where, BatchCommand &cmd) {
+    cmd.where = where;
+    cmd.recursive = false;
+    if(args[0] == "get") {
+        cmd.op = BATCH_GET;
+    } else if(args[0] == "put") {
+        cmd.op = BATCH_PUT;
+    } else if(args[0] == "mkdir") {
+        cmd.op = BATCH_MKDIR;
+    } else if(args[0] == "cp") {
+        cmd.op = BATCH_CP;
+    } else if(args[0] == "mv") {
+        cmd.op = BATCH_MV;
+    } else {
+        printf("%s: unknown command %s.\n", where.c_str(), args[0].c_str());
+        return false;
+    }
+    size_t first = 1;
+    if((cmd.op == BATCH_GET || cmd.op == BATCH_PUT) && args.size() > 1 && args[1] == "-r") {
+        cmd.recursive = true;
+        first = 2;
+    }
+    size_t max_args = cmd.op == BATCH_MKDIR ? 1 : 2;
+    if(args.size() <= first || args.size() - first > max_args) {
+        printf("%s: wrong number of arguments to %s.\n", where.c_str(), args[0].c_str());
+        return false;
+    }
+    cmd.from = args[first];
+    if(cmd.op == BATCH_MKDIR) {
+        return true;
+    }
+    // Copies on the server have no sensible default destination.
+    if((cmd.op == BATCH_CP || cmd.op == BATCH_MV) && args.size() - first != 2) {
+        printf("%s: %s needs a destination.\n", where.c_str(), args[0].c_str());
+        return false;
+    }
+    cmd.to = args.size() - first == 2 ? args[first+1] : split_filename(cmd.from.c_str());
+    if(cmd.to.empty()) {
+        printf("%s: %s needs a destination.\n", where.c_str(), cmd.from.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool parse_line(Batch &b, const char *line, const std::string &where) {
+    gint argc;
+    gchar **argv = nullptr;
+    GError *err = nullptr;
+    if(!g_shell_parse_argv(line, &argc, &argv, &err)) {
+        printf("%s: %s\n", where.c_str(), err->message);
+        g_error_free(err);
+        return false;
+    }
+    std::vector<std::string> args(argv, argv + argc);
+    g_strfreev(argv);
+    BatchCommand cmd;
+    if(!parse_command(args, where, cmd)) {
+        return false;
+    }
+    b.commands.push_back(std::move(cmd));
+    return true;
+}
+
+static bool read_commands(Batch &b, const char *fname) {
+    gchar *contents = nullptr;
+    GError *err = nullptr;
+    if(!g_file_get_contents(fname, &contents, nullptr, &err)) {
+        printf("Could not read %s: %s\n", fname, err->message);
+        g_error_free(err);
+        return false;
+    }
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    bool ok = true;
+    for(int i=0; lines[i]; i++) {
+        const char *line = lines[i] + strspn(lines[i], " \t\r");
+        if(line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        std::string where = std::string(fname) + ":" + std::to_string(i+1);
+        ok = parse_line(b, line, where) && ok;
+    }
+    g_strfreev(lines);
+    return ok;
+}
+
+static void run_command(Batch &b, const BatchCommand &cmd) {
+    const char *from = cmd.from.c_str();
+    const char *to = cmd.to.c_str();
+    bool is_dir;
+    switch(cmd.op) {
+    case BATCH_MKDIR:
+        if(sftp_mkdir(b.sftp, from, 0755) != 0) {
+            printf("%s: could not create %s: %s\n", cmd.where.c_str(), from, ssh_get_error(b.session));
+            b.failures++;
+        }
+        return;
+    case BATCH_CP:
+        queue_remote_copy(b.transfers, from, to);
+        return;
+    case BATCH_MV:
+        queue_remote_move(b.transfers, from, to);
+        return;
+    case BATCH_GET: {
+        sftp_attributes attr = sftp_stat(b.sftp, from);
+        if(!attr) {
+            printf("%s: %s: %s\n", cmd.where.c_str(), from, ssh_get_error(b.session));
+            b.failures++;
+            return;
+        }
+        is_dir = attr->type == SSH_FILEXFER_TYPE_DIRECTORY;
+        uint64_t size = attr->size;
+        sftp_attributes_free(attr);
+        if(is_dir == cmd.recursive) {
+            if(is_dir) {
+                queue_download_tree(b.transfers, from, to);
+            } else {
+                queue_download(b.transfers, from, to, size);
+            }
+            return;
+        }
+        break;
+    }
+    case BATCH_PUT:
+        if(!g_file_test(from, G_FILE_TEST_EXISTS)) {
+            printf("%s: %s does not exist.\n", cmd.where.c_str(), from);
+            b.failures++;
+            return;
+        }
+        is_dir = g_file_test(from, G_FILE_TEST_IS_DIR);
+        if(is_dir == cmd.recursive) {
+            if(is_dir) {
+                queue_upload_tree(b.transfers, from, to);
+            } else {
+                queue_upload(b.transfers, from, to);
+            }
+            return;
+        }
+        break;
+    }
+    printf("%s: %s %s.\n", cmd.where.c_str(), from, is_dir ? "is a directory, use -r" : "is not a directory");
+    b.failures++;
+}
+
+// Starts the next command whenever the previous one's files are done.
+static void advance(Batch &b) {
+    feed_transfers(b.transfers);
+    while(!transfers_pending(b.transfers)) {
+        if(b.next_command >= b.commands.size()) {
+            g_main_loop_quit(b.loop);
+            return;
+        }
+        run_command(b, b.commands[b.next_command++]);
+        feed_transfers(b.transfers);
+    }
+}
+
+static gboolean batch_session_has_data(GIOChannel *, GIOCondition, gpointer data) {
+    Batch &b = *reinterpret_cast<Batch*>(data);
+    // Takes the data off the socket even if no transfer wants it yet.
+    ssh_event_dopoll(b.event, 0);
+    advance(b);
+    return TRUE;
+}
+
+static void batch_disk_done(void *data) {
+    Batch &b = *reinterpret_cast<Batch*>(data);
+    if(b.session_watch) {
+        advance(b);
+    }
+}
+
+static const char* job_command(const TransferJob &job) {
+    switch(job.direction) {
+    case TRANSFER_DOWNLOAD: return "get";
+    case TRANSFER_UPLOAD: return "put";
+    case TRANSFER_REMOTE_COPY: return "cp";
+    case TRANSFER_REMOTE_MOVE: return "mv";
+    }
+    return "";
+}
+
+static void batch_job_changed(const TransferJob &job, void *data) {
+    Batch &b = *reinterpret_cast<Batch*>(data);
+    const char *from = job.source_path.c_str();
+    const char *to = job.remote_path.c_str();
+    if(job.direction == TRANSFER_DOWNLOAD) {
+        from = job.remote_path.c_str();
+        to = job.local_path.c_str();
+    } else if(job.direction == TRANSFER_UPLOAD) {
+        from = job.local_path.c_str();
+    }
+    if(job.status == TRANSFER_FAILED) {
+        printf("%s %s -> %s failed.\n", job_command(job), from, to);
+        b.failures++;
+        return;
+    }
+    if(job.status != TRANSFER_DONE) {
+        return;
+    }
+    double secs = (g_get_monotonic_time() - job.started)/1e6;
+    if(!job_moves_data(job)) {
+        printf("%s %s -> %s: done in %.2f s\n", job_command(job), from, to, secs);
+        return;
+    }
+    printf("%s %s -> %s: %llu bytes in %.2f s, %.1f MB/s\n", job_command(job), from, to,
+           (unsigned long long)job.size, secs, secs > 0 ? job.size/secs/1e6 : 0.0);
+    b.files++;
+    b.bytes += job.size;
+}
+
+static void batch_connected(Connector &c, bool ok, void *data) {
+    Batch &b = *reinterpret_cast<Batch*>(data);
+    if(!ok) {
+        printf("Could not connect to %s: %s failed: %s\n", c.host.c_str(), connect_phase_name(c.failed_phase), c.error.c_str());
+        b.failures++;
+        g_main_loop_quit(b.loop);
+        return;
+    }
+    b.sftp = b.session.open_sftp_session();
+    if(b.sftp == nullptr) {
+        b.failures++;
+        g_main_loop_quit(b.loop);
+        return;
+    }
+    init_transfer_manager(b.transfers, b.disk, &b.journal, b.session, b.sftp, batch_job_changed, &b);
+    b.transfers.delta = b.delta;
+    if(transfers_pending(b.transfers)) {
+        printf("Continuing unfinished transfers first.\n");
+    }
+    b.event = ssh_event_new();
+    ssh_event_add_session(b.event, b.session);
+    b.session_channel = g_io_channel_unix_new(ssh_get_fd(b.session));
+    b.session_watch = thread_io_add_watch(b.session_channel, G_IO_IN, batch_session_has_data, &b);
+    b.start = g_get_monotonic_time();
+    advance(b);
+}
+
+static void close_batch(Batch &b) {
+    cancel_connect(b.connector);
+    // Unfinished jobs stay in the journal.
+    cancel_transfers(b.transfers);
+    close_journal(b.journal);
+    if(b.session_watch) {
+        thread_source_remove(b.session_watch);
+        b.session_watch = 0;
+        g_io_channel_unref(b.session_channel);
+    }
+    if(b.event) {
+        ssh_event_free(b.event);
+        b.event = nullptr;
+    }
+    b.sftp = SftpSession();
+    ssh_disconnect(b.session);
+    close_disk_io(b.disk);
+}
+
+int run_batch(int argc, char **argv) {
+    gboolean batch = FALSE;
+    gboolean delta = FALSE;
+    gchar *command_file = nullptr;
+    gint port = 22;
+    GOptionEntry entries[] = {
+        {"batch", 0, 0, G_OPTION_ARG_NONE, &batch, "Transfer files without the GUI", nullptr},
+        {"file", 'f', 0, G_OPTION_ARG_FILENAME, &command_file, "Read commands from FILE", "FILE"},
+        {"port", 'p', 0, G_OPTION_ARG_INT, &port, "Port to connect to", "PORT"},
+        {"delta", 0, 0, G_OPTION_ARG_NONE, &delta, "Send only changed blocks of files that exist on both sides", nullptr},
+        {nullptr, 0, 0, G_OPTION_ARG_NONE, nullptr, nullptr, nullptr},
+    };
+    GOptionContext *ctx = g_option_context_new(BATCH_USAGE);
+    g_option_context_add_main_entries(ctx, entries, nullptr);
+    GError *err = nullptr;
+    bool parsed = g_option_context_parse(ctx, &argc, &argv, &err);
+    g_option_context_free(ctx);
+    if(!parsed) {
+        printf("%s\n", err->message);
+        g_error_free(err);
+        return 2;
+    }
+    if(argc < 2) {
+        printf("No host given.\n");
+        return 2;
+    }
+    std::unique_ptr<Batch> b(new Batch());
+    b->delta = delta;
+    bool ok = true;
+    if(command_file) {
+        ok = read_commands(*b, command_file);
+        g_free(command_file);
+    }
+    if(argc > 2) {
+        // The shell has split the arguments already, quote them again.
+        std::string line;
+        for(int i=2; i<argc; i++) {
+            gchar *quoted = g_shell_quote(argv[i]);
+            line += std::string(line.empty() ? "" : " ") + quoted;
+            g_free(quoted);
+        }
+        ok = parse_line(*b, line.c_str(), "command line") && ok;
+    }
+    if(!ok) {
+        return 2;
+    }
+    std::string target(argv[1]);
+    auto at = target.rfind('@');
+    std::string user = at == std::string::npos ? g_get_user_name() : target.substr(0, at);
+    std::string host = at == std::string::npos ? target : target.substr(at+1);
+
+    b->loop = g_main_loop_new(nullptr, FALSE);
+    if(!init_disk_io(b->disk, batch_disk_done, b.get())) {
+        printf("Could not set up file I/O.\n");
+        return 1;
+    }
+    open_journal(b->journal, b->disk);
+    b->connector.no_shell = true;
+    start_connect(b->connector, b->dns, b->session, host.c_str(), port, user.c_str(), "", 1, batch_connected, b.get());
+    g_main_loop_run(b->loop);
+    gint64 elapsed = g_get_monotonic_time() - b->start;
+    if(b->files > 0 && elapsed > 0) {
+        printf("%d files, %llu bytes in %.2f s, %.1f MB/s\n", b->files, (unsigned long long)b->bytes,
+               elapsed/1e6, b->bytes/(elapsed/1e6)/1e6);
+    }
+    close_batch(*b);
+    g_main_loop_unref(b->loop);
+    return b->failures > 0 ? 1 : 0;
+}
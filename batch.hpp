@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<connector.hpp>
+#include<transfer.hpp>
+#include<diskio.hpp>
+#include<glib.h>
+#include<string>
+#include<vector>
+
+enum BatchOp {
+    BATCH_GET,
+    BATCH_PUT,
+    BATCH_MKDIR,
+    BATCH_CP, // On the server.
+    BATCH_MV,
+};
+
+struct BatchCommand {
+    BatchOp op;
+    bool recursive;
+    std::string from;
+    std::string to;
+    std::string where; // File and line, for messages.
+};
+
+/*
+ * Runs file transfers without any GUI. The commands run one after
+ * the other, each one's files through the same transfer manager the
+ * SFTP window uses, on a plain main loop in the calling thread.
+ * Authentication is by key or agent only.
+ */
+struct Batch {
+    std::vector<BatchCommand> commands;
+    size_t next_command;
+    bool delta;
+
+    SshSession session;
+    Connector connector;
+    DnsCache dns;
+    DiskIo disk;
+    TransferJournal journal;
+    SftpSession sftp;
+    TransferManager transfers;
+    ssh_event event;
+    GIOChannel *session_channel;
+    guint session_watch;
+    GMainLoop *loop;
+
+    int failures;
+    int files;
+    uint64_t bytes;
+    gint64 start;
+};
+
+// True if the arguments ask for batch mode, checked before GTK is
+// initialised.
+bool is_batch_mode(int argc, char **argv);
+// Returns the exit status.
+int run_batch(int argc, char **argv);
@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<cipherbench.hpp>
+#include<algorithm>
+#include<cstring>
+#ifdef HAVE_LIBCRYPTO
+#include<openssl/crypto.h>
+#include<openssl/evp.h>
+#include<openssl/hmac.h>
+#endif
+
+static const constexpr char *CACHE_FILE = "algorithms.ini";
+
+#ifdef HAVE_LIBCRYPTO
+
+struct CipherCandidate {
+    const char *name;
+    const EVP_CIPHER* (*cipher)();
+    bool aead; // Needs no separate MAC.
+};
+
+struct MacCandidate {
+    const char *name;
+    const EVP_MD* (*digest)();
+};
+
+// The OpenSSL chacha20-poly1305 is the IETF one rather than OpenSSH's
+// construction but the cost is the same.
+static const CipherCandidate cipher_candidates[] = {
+    {"aes128-gcm@openssh.com", EVP_aes_128_gcm, true},
+    {"aes256-gcm@openssh.com", EVP_aes_256_gcm, true},
+    {"chacha20-poly1305@openssh.com", EVP_chacha20_poly1305, true},
+    {"aes128-ctr", EVP_aes_128_ctr, false},
+    {"aes256-ctr", EVP_aes_256_ctr, false},
+};
+
+// Encrypt-then-MAC first, it costs the same and is the safer one.
+static const MacCandidate mac_candidates[] = {
+    {"hmac-sha2-256-etm@openssh.com", EVP_sha256},
+    {"hmac-sha2-512-etm@openssh.com", EVP_sha512},
+    {"hmac-sha2-256", EVP_sha256},
+    {"hmac-sha2-512", EVP_sha512},
+};
+
+static double cipher_speed(const EVP_CIPHER *cipher) {
+    unsigned char key[64] = {0};
+    unsigned char iv[32] = {0};
+    std::vector<unsigned char> in(BENCH_BLOCK, 'x');
+    std::vector<unsigned char> out(BENCH_BLOCK + EVP_MAX_BLOCK_LENGTH);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if(!ctx || EVP_EncryptInit_ex(ctx, cipher, nullptr, key, iv) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return 0;
+    }
+    uint64_t bytes = 0;
+    gint64 start = g_get_monotonic_time();
+    gint64 elapsed;
+    do {
+        int len;
+        if(EVP_EncryptUpdate(ctx, out.data(), &len, in.data(), (int)in.size()) != 1) {
+            EVP_CIPHER_CTX_free(ctx);
+            return 0;
+        }
+        bytes += in.size();
+        elapsed = g_get_monotonic_time() - start;
+    } while(elapsed < BENCH_TIME_US);
+    EVP_CIPHER_CTX_free(ctx);
+    return bytes*1e6/elapsed;
+}
+
+static double mac_speed(const EVP_MD *digest) {
+    unsigned char key[64] = {0};
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    std::vector<unsigned char> in(BENCH_BLOCK, 'x');
+    uint64_t bytes = 0;
+    gint64 start = g_get_monotonic_time();
+    gint64 elapsed;
+    do {
+        // One MAC per packet, as the transport does.
+        if(!HMAC(digest, key, EVP_MD_size(digest), in.data(), in.size(), md, &md_len)) {
+            return 0;
+        }
+        bytes += in.size();
+        elapsed = g_get_monotonic_time() - start;
+    } while(elapsed < BENCH_TIME_US);
+    return bytes*1e6/elapsed;
+}
+
+static void run_benchmark(GKeyFile *kf) {
+    // Each digest is timed once so that noise can not put a plain MAC
+    // ahead of its encrypt-then-MAC twin.
+    std::vector<std::pair<const EVP_MD*, double>> digests;
+    for(const auto &c : mac_candidates) {
+        const EVP_MD *digest = c.digest();
+        auto it = std::find_if(digests.begin(), digests.end(),
+                               [digest](const std::pair<const EVP_MD*, double> &d) { return d.first == digest; });
+        if(it == digests.end()) {
+            digests.emplace_back(digest, mac_speed(digest));
+            it = digests.end() - 1;
+        }
+        g_key_file_set_double(kf, "macs", c.name, it->second);
+    }
+    for(const auto &c : cipher_candidates) {
+        const EVP_CIPHER *cipher = c.cipher();
+        // Zero marks one that this libcrypto does not have.
+        g_key_file_set_double(kf, "ciphers", c.name, cipher ? cipher_speed(cipher) : 0);
+    }
+}
+
+static std::string machine_id() {
+    std::string id;
+    gchar *cpuinfo = nullptr;
+    if(g_file_get_contents("/proc/cpuinfo", &cpuinfo, nullptr, nullptr)) {
+        const char *model = strstr(cpuinfo, "model name");
+        if(model && strchr(model, ':')) {
+            model = strchr(model, ':') + 1;
+            model += strspn(model, " \t");
+            id = std::string(model, strcspn(model, "\n"));
+        }
+        g_free(cpuinfo);
+    }
+    // A libcrypto upgrade may bring faster implementations.
+    return id + " / " + OpenSSL_version(OPENSSL_VERSION);
+}
+
+#endif
+
+static std::string cache_path() {
+    gchar *fname = g_build_filename(g_get_user_cache_dir(), "sshprog", CACHE_FILE, nullptr);
+    std::string result(fname);
+    g_free(fname);
+    return result;
+}
+
+static GKeyFile* load_cache() {
+    GKeyFile *kf = g_key_file_new();
+    // A missing file just means that nothing has been measured.
+    g_key_file_load_from_file(kf, cache_path().c_str(), G_KEY_FILE_NONE, nullptr);
+    return kf;
+}
+
+static void save_cache(GKeyFile *kf) {
+    std::string path = cache_path();
+    gchar *dir = g_path_get_dirname(path.c_str());
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    GError *err = nullptr;
+    if(!g_key_file_save_to_file(kf, path.c_str(), &err)) {
+        printf("Could not write algorithm cache: %s\n", err->message);
+        g_error_free(err);
+    }
+}
+
+static std::vector<AlgorithmSpeed> read_speeds(GKeyFile *kf, const char *group) {
+    std::vector<AlgorithmSpeed> speeds;
+    gchar **keys = g_key_file_get_keys(kf, group, nullptr, nullptr);
+    if(!keys) {
+        return speeds;
+    }
+    for(gchar **key = keys; *key; ++key) {
+        double speed = g_key_file_get_double(kf, group, *key, nullptr);
+        if(speed > 0) {
+            speeds.push_back(AlgorithmSpeed{*key, speed});
+        }
+    }
+    g_strfreev(keys);
+    return speeds;
+}
+
+static void sort_fastest_first(std::vector<AlgorithmSpeed> &speeds) {
+    std::stable_sort(speeds.begin(), speeds.end(), [](const AlgorithmSpeed &a, const AlgorithmSpeed &b) {
+        return a.bytes_per_sec > b.bytes_per_sec;
+    });
+}
+
+bool choose_algorithms(AlgorithmChoice &choice) {
+#ifdef HAVE_LIBCRYPTO
+    GKeyFile *kf = load_cache();
+    std::string id = machine_id();
+    gchar *cached_id = g_key_file_get_string(kf, "machine", "id", nullptr);
+    bool fresh = cached_id && id == cached_id;
+    g_free(cached_id);
+    if(!fresh) {
+        g_key_file_remove_group(kf, "ciphers", nullptr);
+        g_key_file_remove_group(kf, "macs", nullptr);
+        run_benchmark(kf);
+        g_key_file_set_string(kf, "machine", "id", id.c_str());
+        save_cache(kf);
+    }
+    choice.macs = read_speeds(kf, "macs");
+    choice.ciphers = read_speeds(kf, "ciphers");
+    g_key_file_free(kf);
+    sort_fastest_first(choice.macs);
+    if(choice.macs.empty() || choice.ciphers.empty()) {
+        return false;
+    }
+    // A plain cipher is used together with the fastest MAC, compare the
+    // pair against the AEAD ciphers.
+    double mac = choice.macs.front().bytes_per_sec;
+    for(auto &c : choice.ciphers) {
+        auto candidate = std::find_if(std::begin(cipher_candidates), std::end(cipher_candidates),
+                                      [&c](const CipherCandidate &cc) { return c.name == cc.name; });
+        if(candidate != std::end(cipher_candidates) && !candidate->aead) {
+            c.bytes_per_sec = 1/(1/c.bytes_per_sec + 1/mac);
+        }
+    }
+    sort_fastest_first(choice.ciphers);
+    return true;
+#else
+    (void)choice;
+    return false;
+#endif
+}
+
+std::string algorithm_list(const std::vector<AlgorithmSpeed> &speeds, const char *defaults) {
+    std::vector<std::string> names;
+    for(const auto &s : speeds) {
+        names.push_back(s.name);
+    }
+    gchar **extra = g_strsplit(defaults, ",", -1);
+    for(gchar **name = extra; *name; ++name) {
+        if(std::find(names.begin(), names.end(), *name) == names.end()) {
+            names.push_back(*name);
+        }
+    }
+    g_strfreev(extra);
+    std::string result;
+    for(const auto &name : names) {
+        if(!result.empty()) {
+            result += ",";
+        }
+        result += name;
+    }
+    return result;
+}
+
+static void save_links(const std::unordered_map<std::string, double> &links) {
+    GKeyFile *kf = load_cache();
+    for(const auto &l : links) {
+        g_key_file_set_double(kf, "links", l.first.c_str(), l.second);
+    }
+    save_cache(kf);
+    g_key_file_free(kf);
+}
+
+static gpointer tuner_thread(gpointer data) {
+    AlgorithmTuner &t = *reinterpret_cast<AlgorithmTuner*>(data);
+    AlgorithmChoice choice;
+    bool ok = choose_algorithms(choice);
+    GKeyFile *kf = load_cache();
+    gchar **hosts = g_key_file_get_keys(kf, "links", nullptr, nullptr);
+    g_mutex_lock(&t.lock);
+    t.choice = choice;
+    t.have_choice = ok;
+    // Transfers that finished meanwhile are newer than the file.
+    for(gchar **host = hosts; host && *host; ++host) {
+        if(t.links.find(*host) == t.links.end()) {
+            t.links[*host] = g_key_file_get_double(kf, "links", *host, nullptr);
+        }
+    }
+    g_strfreev(hosts);
+    g_key_file_free(kf);
+    while(true) {
+        while(!t.save_pending && !t.stopping) {
+            g_cond_wait(&t.wake, &t.lock);
+        }
+        if(!t.save_pending) {
+            break;
+        }
+        t.save_pending = false;
+        auto links = t.links;
+        g_mutex_unlock(&t.lock);
+        save_links(links);
+        g_mutex_lock(&t.lock);
+    }
+    g_mutex_unlock(&t.lock);
+    return nullptr;
+}
+
+void start_algorithm_tuner(AlgorithmTuner &t) {
+    g_mutex_init(&t.lock);
+    g_cond_init(&t.wake);
+    t.have_choice = false;
+    t.save_pending = false;
+    t.stopping = false;
+    t.thread = g_thread_new("algorithm-tuner", tuner_thread, &t);
+}
+
+void stop_algorithm_tuner(AlgorithmTuner &t) {
+    if(!t.thread) {
+        return;
+    }
+    g_mutex_lock(&t.lock);
+    t.stopping = true;
+    g_cond_signal(&t.wake);
+    g_mutex_unlock(&t.lock);
+    g_thread_join(t.thread);
+    t.thread = nullptr;
+    g_cond_clear(&t.wake);
+    g_mutex_clear(&t.lock);
+}
+
+void record_link_speed(AlgorithmTuner &t, const char *host, double bytes_per_sec) {
+    g_mutex_lock(&t.lock);
+    auto old = t.links.find(host);
+    if(old != t.links.end()) {
+        // FIXME, parallel transfers share the link so each one sees only
+        // part of it. Smoothing keeps one odd sample from flipping the
+        // compression choice.
+        bytes_per_sec = (old->second + bytes_per_sec)/2;
+    }
+    t.links[host] = bytes_per_sec;
+    t.save_pending = true;
+    g_cond_signal(&t.wake);
+    g_mutex_unlock(&t.lock);
+}
+
+bool compression_helps(AlgorithmTuner &t, const char *host) {
+    g_mutex_lock(&t.lock);
+    auto speed = t.links.find(host);
+    bool slow = speed != t.links.end() && speed->second < COMPRESSION_BELOW;
+    g_mutex_unlock(&t.lock);
+    return slow;
+}
+
+void tune_session(AlgorithmTuner &t, ssh_session session, const char *host) {
+    g_mutex_lock(&t.lock);
+    bool have_choice = t.have_choice;
+    AlgorithmChoice choice = t.choice;
+    g_mutex_unlock(&t.lock);
+    if(have_choice) {
+        std::string ciphers = algorithm_list(choice.ciphers, LIBSSH_DEFAULT_CIPHERS);
+        std::string macs = algorithm_list(choice.macs, LIBSSH_DEFAULT_MACS);
+        ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, ciphers.c_str());
+        ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, ciphers.c_str());
+        ssh_options_set(session, SSH_OPTIONS_HMAC_C_S, macs.c_str());
+        ssh_options_set(session, SSH_OPTIONS_HMAC_S_C, macs.c_str());
+    }
+    ssh_options_set(session, SSH_OPTIONS_COMPRESSION, compression_helps(t, host) ? "yes" : "no");
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<libssh/libssh.h>
+#include<glib.h>
+#include<string>
+#include<unordered_map>
+#include<vector>
+
+// Each algorithm is run for this long.
+static const constexpr gint64 BENCH_TIME_US = 20000;
+// The size of one packet's payload, roughly what bulk transfers send.
+static const constexpr size_t BENCH_BLOCK = 32*1024;
+// Below this many bytes per second compressing costs less than sending.
+static const constexpr double COMPRESSION_BELOW = 1024*1024;
+// Shorter transfers are dominated by latency and say nothing of bandwidth.
+static const constexpr uint64_t LINK_SAMPLE_MIN = 4*1024*1024;
+// What libssh offers when left alone. These go after the measured ones
+// so that a server with none of those still gets something it knows.
+// libssh drops the names it was built without.
+static const constexpr char *LIBSSH_DEFAULT_CIPHERS =
+    "chacha20-poly1305@openssh.com,aes256-gcm@openssh.com,aes128-gcm@openssh.com,aes256-ctr,aes192-ctr,aes128-ctr";
+static const constexpr char *LIBSSH_DEFAULT_MACS =
+    "hmac-sha2-256-etm@openssh.com,hmac-sha2-512-etm@openssh.com,hmac-sha1-etm@openssh.com,"
+    "hmac-sha2-256,hmac-sha2-512,hmac-sha1";
+
+struct AlgorithmSpeed {
+    std::string name;
+    double bytes_per_sec;
+};
+
+// The measured ciphers and MACs, fastest first.
+struct AlgorithmChoice {
+    std::vector<AlgorithmSpeed> ciphers;
+    std::vector<AlgorithmSpeed> macs;
+};
+
+// Loads the result for this machine from the cache or, the first time,
+// measures it and stores it. False if neither was possible. Takes a
+// fraction of a second the first time, so not for the I/O thread.
+bool choose_algorithms(AlgorithmChoice &choice);
+// The names in order, followed by those of defaults they do not have.
+std::string algorithm_list(const std::vector<AlgorithmSpeed> &speeds, const char *defaults);
+
+/*
+ * Keeps the algorithm choice and link speeds in memory so that
+ * connecting never waits for the benchmark or the disk. The benchmark
+ * runs once at startup on a thread of its own, sessions that connect
+ * before it is done get libssh's defaults. The same thread writes link
+ * speeds to the cache.
+ */
+struct AlgorithmTuner {
+    GThread *thread;
+    GMutex lock;
+    GCond wake;
+    bool have_choice;
+    AlgorithmChoice choice;
+    std::unordered_map<std::string, double> links; // Bytes per second by host.
+    bool save_pending;
+    bool stopping;
+};
+
+void start_algorithm_tuner(AlgorithmTuner &t);
+// Writes out what has not been saved yet.
+void stop_algorithm_tuner(AlgorithmTuner &t);
+
+// Remembers how fast a transfer to the host went.
+void record_link_speed(AlgorithmTuner &t, const char *host, double bytes_per_sec);
+// True if the link to the host has been measured and is slow.
+bool compression_helps(AlgorithmTuner &t, const char *host);
+
+// Sets the algorithm and compression options before connecting.
+void tune_session(AlgorithmTuner &t, ssh_session session, const char *host);
@@ -0,0 +1,499 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<connector.hpp>
+#include<util.hpp>
+#include<unistd.h>
+#include<algorithm>
+#include<cstdio>
+
+static const char *phase_names[] = {
+    "DNS lookup",
+    "TCP connect",
+    "Key exchange",
+    "Host key check",
+    "Authentication",
+    "Channel open",
+    "PTY request",
+    "Shell request",
+};
+
+const char* connect_phase_name(ConnectPhase phase) {
+    if(phase < CONNECT_DONE) {
+        return phase_names[phase];
+    }
+    return phase == CONNECT_DONE ? "Connected" : "Failed";
+}
+
+std::string describe_timings(const ConnectTimings &timings, ConnectPhase reached) {
+    std::string result;
+    char line[128];
+    gint64 total = 0;
+    for(int i=0; i<CONNECT_DONE && i<=reached; i++) {
+        snprintf(line, sizeof(line), "%-16s %9.1f ms\n", phase_names[i], timings.phase_us[i]/1000.0);
+        result += line;
+        total += timings.phase_us[i];
+    }
+    snprintf(line, sizeof(line), "%-16s %9.1f ms", "Total", total/1000.0);
+    result += line;
+    return result;
+}
+
+static void clear_watch(Connector &c) {
+    if(c.watch) {
+        thread_source_remove(c.watch);
+        c.watch = 0;
+    }
+}
+
+static void free_addresses(std::vector<GInetAddress*> &addresses) {
+    for(auto a : addresses) {
+        g_object_unref(G_OBJECT(a));
+    }
+    addresses.clear();
+}
+
+static const DnsEntry* dns_lookup(DnsCache &dns, const std::string &host) {
+    auto it = dns.entries.find(host);
+    if(it == dns.entries.end()) {
+        return nullptr;
+    }
+    if(g_get_monotonic_time() - it->second.fetched > DNS_CACHE_TTL*G_USEC_PER_SEC) {
+        free_addresses(it->second.addresses);
+        dns.entries.erase(it);
+        return nullptr;
+    }
+    return &it->second;
+}
+
+static void dns_forget(DnsCache &dns, const std::string &host) {
+    auto it = dns.entries.find(host);
+    if(it != dns.entries.end()) {
+        free_addresses(it->second.addresses);
+        dns.entries.erase(it);
+    }
+}
+
+static void dns_store(DnsCache &dns, const std::string &host, const std::vector<GInetAddress*> &addresses) {
+    dns_forget(dns, host);
+    if(dns.entries.size() >= DNS_CACHE_MAX) {
+        auto oldest = dns.entries.begin();
+        for(auto it = dns.entries.begin(); it != dns.entries.end(); ++it) {
+            if(it->second.fetched < oldest->second.fetched) {
+                oldest = it;
+            }
+        }
+        dns_forget(dns, oldest->first);
+    }
+    DnsEntry &e = dns.entries[host];
+    for(auto a : addresses) {
+        e.addresses.push_back(G_INET_ADDRESS(g_object_ref(a)));
+    }
+    e.fetched = g_get_monotonic_time();
+}
+
+static void drop_attempt(ConnectAttempt *a) {
+    auto &attempts = a->parent->attempts;
+    if(a->watch) {
+        thread_source_remove(a->watch);
+    }
+    g_io_channel_unref(a->channel);
+    g_object_unref(G_OBJECT(a->socket));
+    for(auto it = attempts.begin(); it != attempts.end(); ++it) {
+        if(it->get() == a) {
+            attempts.erase(it);
+            return;
+        }
+    }
+}
+
+static void drop_attempts(Connector &c) {
+    while(!c.attempts.empty()) {
+        drop_attempt(c.attempts.back().get());
+    }
+    if(c.attempt_timer) {
+        thread_source_remove(c.attempt_timer);
+        c.attempt_timer = 0;
+    }
+}
+
+// Frees everything that is only needed while connecting.
+static void release(Connector &c) {
+    drop_attempts(c);
+    clear_watch(c);
+    if(c.channel) {
+        g_io_channel_unref(c.channel);
+        c.channel = nullptr;
+    }
+    if(c.timeout) {
+        thread_source_remove(c.timeout);
+        c.timeout = 0;
+    }
+    if(c.cancel) {
+        g_cancellable_cancel(c.cancel);
+        g_object_unref(G_OBJECT(c.cancel));
+        c.cancel = nullptr;
+    }
+    free_addresses(c.addresses);
+    c.passphrase.assign(c.passphrase.size(), '\0');
+    c.passphrase.clear();
+}
+
+static void end_phase(Connector &c) {
+    gint64 now = g_get_monotonic_time();
+    c.timings.phase_us[c.phase] = now - c.phase_start;
+    c.phase_start = now;
+}
+
+static void next_phase(Connector &c, ConnectPhase phase) {
+    end_phase(c);
+    c.phase = phase;
+}
+
+static void finish(Connector &c, bool ok) {
+    end_phase(c);
+    release(c);
+    if(ok) {
+        // The rest of the program expects blocking calls to wait.
+        ssh_set_blocking(c.session, 1);
+        c.phase = CONNECT_DONE;
+    } else {
+        c.failed_phase = c.phase;
+        c.phase = CONNECT_FAILED;
+        c.pty = SshChannel();
+    }
+    c.done(c, ok, c.callback_data);
+}
+
+static void fail(Connector &c, const std::string &error) {
+    c.error = error;
+    finish(c, false);
+}
+
+static void step(Connector &c);
+
+static gboolean fd_ready(GIOChannel *, GIOCondition, gpointer data) {
+    Connector &c = *reinterpret_cast<Connector*>(data);
+    // Every wait adds a new watch for what it needs.
+    c.watch = 0;
+    step(c);
+    return FALSE;
+}
+
+static void wait_for(Connector &c, GIOCondition cond) {
+    clear_watch(c);
+    c.watch = thread_io_add_watch(c.channel, (GIOCondition)(cond | G_IO_HUP | G_IO_ERR), fd_ready, &c);
+}
+
+// libssh says whether it still has output to send.
+static void wait_for_ssh(Connector &c) {
+    int cond = G_IO_IN;
+    if(ssh_get_poll_flags(c.session) & SSH_WRITE_PENDING) {
+        cond |= G_IO_OUT;
+    }
+    wait_for(c, (GIOCondition)cond);
+}
+
+// Alternates between address families, keeping the resolver's order
+// within each, so that a broken IPv6 setup does not hold up IPv4.
+static void order_addresses(std::vector<GInetAddress*> &addresses) {
+    if(addresses.empty()) {
+        return;
+    }
+    GSocketFamily first = g_inet_address_get_family(addresses[0]);
+    std::vector<GInetAddress*> preferred, other;
+    for(auto a : addresses) {
+        (g_inet_address_get_family(a) == first ? preferred : other).push_back(a);
+    }
+    addresses.clear();
+    for(size_t i=0; i<std::max(preferred.size(), other.size()); i++) {
+        if(i < preferred.size()) {
+            addresses.push_back(preferred[i]);
+        }
+        if(i < other.size()) {
+            addresses.push_back(other[i]);
+        }
+    }
+}
+
+static gboolean attempt_ready(GIOChannel *, GIOCondition, gpointer data);
+static gboolean attempt_timer_fired(gpointer data);
+
+// Starts a connect to the next address that gets one under way. Fails
+// the connector if there are none left and nothing is pending.
+static void start_attempt(Connector &c) {
+    if(c.attempt_timer) {
+        thread_source_remove(c.attempt_timer);
+        c.attempt_timer = 0;
+    }
+    while(c.next_address < c.addresses.size()) {
+        GInetAddress *address = c.addresses[c.next_address++];
+        GError *err = nullptr;
+        GSocket *sock = g_socket_new(g_inet_address_get_family(address), G_SOCKET_TYPE_STREAM,
+                                     G_SOCKET_PROTOCOL_TCP, &err);
+        if(!sock) {
+            c.error = err->message;
+            g_error_free(err);
+            continue;
+        }
+        g_socket_set_blocking(sock, FALSE);
+        GSocketAddress *sa = g_inet_socket_address_new(address, c.port);
+        bool ok = g_socket_connect(sock, sa, nullptr, &err);
+        g_object_unref(G_OBJECT(sa));
+        if(!ok && !g_error_matches(err, G_IO_ERROR, G_IO_ERROR_PENDING)) {
+            c.error = err->message;
+            g_error_free(err);
+            g_object_unref(G_OBJECT(sock));
+            continue;
+        }
+        if(err) {
+            g_error_free(err);
+        }
+        c.attempts.emplace_back(new ConnectAttempt());
+        ConnectAttempt *a = c.attempts.back().get();
+        a->parent = &c;
+        a->socket = sock;
+        a->channel = g_io_channel_unix_new(g_socket_get_fd(sock));
+        a->watch = thread_io_add_watch(a->channel, (GIOCondition)(G_IO_OUT | G_IO_HUP | G_IO_ERR), attempt_ready, a);
+        if(c.next_address < c.addresses.size()) {
+            c.attempt_timer = thread_timeout_add(CONNECT_ATTEMPT_DELAY_MS, attempt_timer_fired, &c);
+        }
+        return;
+    }
+    if(c.attempts.empty()) {
+        // What was cached may have gone stale.
+        dns_forget(*c.dns, c.host);
+        fail(c, c.error.empty() ? std::string("No addresses for ") + c.host + "." : c.error);
+    }
+}
+
+static gboolean attempt_timer_fired(gpointer data) {
+    Connector &c = *reinterpret_cast<Connector*>(data);
+    c.attempt_timer = 0;
+    start_attempt(c);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean attempt_ready(GIOChannel *, GIOCondition, gpointer data) {
+    ConnectAttempt *a = reinterpret_cast<ConnectAttempt*>(data);
+    Connector &c = *a->parent;
+    // Returning FALSE removes the watch.
+    a->watch = 0;
+    GError *err = nullptr;
+    if(!g_socket_check_connect_result(a->socket, &err)) {
+        c.error = err->message;
+        g_error_free(err);
+        drop_attempt(a);
+        // No point waiting for the timer.
+        start_attempt(c);
+        return FALSE;
+    }
+    // libssh closes its descriptor when the session is disconnected,
+    // the socket object closes the original.
+    int fd = dup(g_socket_get_fd(a->socket));
+    drop_attempts(c);
+    if(fd < 0) {
+        fail(c, "Could not duplicate socket.");
+        return FALSE;
+    }
+    ssh_options_set(c.session, SSH_OPTIONS_FD, &fd);
+    c.channel = g_io_channel_unix_new(fd);
+    next_phase(c, CONNECT_KEX);
+    step(c);
+    return FALSE;
+}
+
+static void start_tcp(Connector &c) {
+    next_phase(c, CONNECT_TCP);
+    order_addresses(c.addresses);
+    c.next_address = 0;
+    start_attempt(c);
+}
+
+static void step(Connector &c) {
+    int rc;
+    while(true) {
+        switch(c.phase) {
+        case CONNECT_KEX:
+            rc = ssh_connect(c.session);
+            if(rc == SSH_AGAIN) {
+                wait_for_ssh(c);
+                return;
+            }
+            if(rc != SSH_OK) {
+                fail(c, ssh_get_error(c.session));
+                return;
+            }
+            next_phase(c, CONNECT_HOSTKEY);
+            break;
+        case CONNECT_HOSTKEY:
+            // Only reads the known hosts file.
+            if(ssh_is_server_known(c.session) != SSH_SERVER_KNOWN_OK) {
+                fail(c, "Server is not previously known.");
+                return;
+            }
+            next_phase(c, CONNECT_AUTH);
+            break;
+        case CONNECT_AUTH:
+            if(c.auth_type == 0) {
+                rc = ssh_userauth_password(c.session, nullptr, c.passphrase.c_str());
+            } else {
+                rc = ssh_userauth_publickey_auto(c.session, nullptr,
+                                                 c.passphrase.empty() ? nullptr : c.passphrase.c_str());
+            }
+            if(rc == SSH_AUTH_AGAIN) {
+                wait_for_ssh(c);
+                return;
+            }
+            if(rc != SSH_AUTH_SUCCESS) {
+                fail(c, rc == SSH_AUTH_ERROR ? ssh_get_error(c.session) : "Authentication denied.");
+                return;
+            }
+            if(c.no_shell) {
+                finish(c, true);
+                return;
+            }
+            c.pty = SshChannel(c.session, ssh_channel_new(c.session));
+            if(c.pty == nullptr) {
+                fail(c, ssh_get_error(c.session));
+                return;
+            }
+            next_phase(c, CONNECT_CHANNEL);
+            break;
+        case CONNECT_CHANNEL:
+            rc = ssh_channel_open_session(c.pty);
+            if(rc == SSH_AGAIN) {
+                wait_for_ssh(c);
+                return;
+            }
+            if(rc != SSH_OK) {
+                fail(c, ssh_get_error(c.session));
+                return;
+            }
+            next_phase(c, CONNECT_PTY);
+            break;
+        case CONNECT_PTY:
+            rc = ssh_channel_request_pty_size(c.pty, "xterm", 80, 25);
+            if(rc == SSH_AGAIN) {
+                wait_for_ssh(c);
+                return;
+            }
+            if(rc != SSH_OK) {
+                fail(c, ssh_get_error(c.session));
+                return;
+            }
+            next_phase(c, CONNECT_SHELL);
+            break;
+        case CONNECT_SHELL:
+            rc = ssh_channel_request_shell(c.pty);
+            if(rc == SSH_AGAIN) {
+                wait_for_ssh(c);
+                return;
+            }
+            if(rc != SSH_OK) {
+                fail(c, ssh_get_error(c.session));
+                return;
+            }
+            finish(c, true);
+            return;
+        default:
+            return;
+        }
+    }
+}
+
+static void resolved(GObject *source, GAsyncResult *res, gpointer data) {
+    GError *err = nullptr;
+    GList *list = g_resolver_lookup_by_name_finish(G_RESOLVER(source), res, &err);
+    if(!list) {
+        // The connector may be gone already.
+        if(g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_error_free(err);
+            return;
+        }
+        Connector &c = *reinterpret_cast<Connector*>(data);
+        std::string error(err->message);
+        g_error_free(err);
+        fail(c, error);
+        return;
+    }
+    Connector &c = *reinterpret_cast<Connector*>(data);
+    for(GList *l = list; l; l = l->next) {
+        c.addresses.push_back(G_INET_ADDRESS(g_object_ref(l->data)));
+    }
+    g_resolver_free_addresses(list);
+    dns_store(*c.dns, c.host, c.addresses);
+    start_tcp(c);
+}
+
+static gboolean connect_timed_out(gpointer data) {
+    Connector &c = *reinterpret_cast<Connector*>(data);
+    c.timeout = 0;
+    fail(c, std::string("Timed out during ") + connect_phase_name(c.phase) + ".");
+    return G_SOURCE_REMOVE;
+}
+
+void start_connect(Connector &c, DnsCache &dns, ssh_session session, const char *host, unsigned int port,
+                   const char *username, const char *passphrase, int auth_type,
+                   ConnectCallback done, void *callback_data) {
+    c.session = session;
+    c.host = host;
+    c.port = port;
+    c.username = username;
+    c.passphrase = passphrase;
+    c.auth_type = auth_type;
+    c.dns = &dns;
+    c.done = done;
+    c.callback_data = callback_data;
+    c.error.clear();
+    c.timings = ConnectTimings();
+    c.phase = CONNECT_DNS;
+    c.phase_start = g_get_monotonic_time();
+    // The host name is still needed for the known hosts check.
+    ssh_options_set(session, SSH_OPTIONS_HOST, host);
+    ssh_options_set(session, SSH_OPTIONS_PORT, &port);
+    ssh_options_set(session, SSH_OPTIONS_USER, username);
+    ssh_set_blocking(session, 0);
+    c.timeout = thread_timeout_add(CONNECT_TIMEOUT_MS, connect_timed_out, &c);
+    c.cancel = g_cancellable_new();
+    const DnsEntry *cached = dns_lookup(dns, c.host);
+    if(cached) {
+        for(auto a : cached->addresses) {
+            c.addresses.push_back(G_INET_ADDRESS(g_object_ref(a)));
+        }
+        start_tcp(c);
+        return;
+    }
+    GResolver *resolver = g_resolver_get_default();
+    g_resolver_lookup_by_name_async(resolver, host, c.cancel, resolved, &c);
+    g_object_unref(G_OBJECT(resolver));
+}
+
+void cancel_connect(Connector &c) {
+    if(!connect_in_progress(c)) {
+        return;
+    }
+    release(c);
+    c.pty = SshChannel();
+    c.failed_phase = c.phase;
+    c.phase = CONNECT_FAILED;
+    c.error = "Cancelled.";
+}
+
+bool connect_in_progress(const Connector &c) {
+    return c.cancel != nullptr;
+}
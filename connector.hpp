@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<ssh_util.hpp>
+#include<gio/gio.h>
+#include<map>
+#include<memory>
+#include<string>
+#include<vector>
+
+// The whole handshake must be done in this time.
+static const constexpr guint CONNECT_TIMEOUT_MS = 30000;
+// If an address has not answered in this time the next one is tried
+// alongside it, as in RFC 8305.
+static const constexpr guint CONNECT_ATTEMPT_DELAY_MS = 250;
+// Resolved addresses younger than this many seconds are used again.
+static const constexpr gint64 DNS_CACHE_TTL = 300;
+// How many host names are remembered.
+static const constexpr size_t DNS_CACHE_MAX = 64;
+
+enum ConnectPhase {
+    CONNECT_DNS,
+    CONNECT_TCP,
+    CONNECT_KEX,
+    CONNECT_HOSTKEY,
+    CONNECT_AUTH,
+    CONNECT_CHANNEL,
+    CONNECT_PTY,
+    CONNECT_SHELL,
+    CONNECT_DONE,
+    CONNECT_FAILED,
+};
+
+// How long each phase took, in microseconds.
+struct ConnectTimings {
+    gint64 phase_us[CONNECT_DONE];
+};
+
+struct DnsEntry {
+    std::vector<GInetAddress*> addresses; // Owns a reference to each.
+    gint64 fetched; // Monotonic time.
+};
+
+// Shared by all connectors, lives on the I/O thread.
+struct DnsCache {
+    std::map<std::string, DnsEntry> entries;
+};
+
+struct Connector;
+
+// A TCP connect to one of the addresses, several may be under way.
+struct ConnectAttempt {
+    Connector *parent;
+    GSocket *socket;
+    GIOChannel *channel;
+    guint watch;
+};
+
+// Called on the I/O thread once the shell is up or connecting failed.
+typedef void (*ConnectCallback)(Connector &c, bool ok, void *data);
+
+/*
+ * Takes a session from a host name to a running shell without ever
+ * blocking the I/O thread. Each phase is started and then continued
+ * whenever the socket is ready, the session is in non-blocking mode
+ * until the shell is up.
+ *
+ * Addresses are tried alternating between IPv6 and IPv4, a new one
+ * whenever the previous has failed or been silent for a while. The
+ * first to connect wins and the rest are dropped, so a dead address
+ * costs a fraction of a second rather than a full TCP timeout.
+ */
+struct Connector {
+    ssh_session session; // A non-owning pointer.
+    std::string host;
+    unsigned int port;
+    std::string username;
+    std::string passphrase;
+    int auth_type; // 0 for password, 1 for keys.
+    bool no_shell; // Done once authenticated, for batch transfers.
+
+    ConnectPhase phase;
+    ConnectPhase failed_phase;
+    gint64 phase_start;
+    ConnectTimings timings;
+    std::string error;
+
+    DnsCache *dns;
+    GCancellable *cancel;
+    std::vector<GInetAddress*> addresses;
+    size_t next_address;
+    std::vector<std::unique_ptr<ConnectAttempt>> attempts;
+    guint attempt_timer;
+    GIOChannel *channel; // Of the socket libssh got.
+    guint watch;
+    guint timeout;
+    SshChannel pty;
+
+    ConnectCallback done;
+    void *callback_data;
+};
+
+const char* connect_phase_name(ConnectPhase phase);
+std::string describe_timings(const ConnectTimings &timings, ConnectPhase reached);
+
+// Called on the I/O thread.
+void start_connect(Connector &c, DnsCache &dns, ssh_session session, const char *host, unsigned int port,
+                   const char *username, const char *passphrase, int auth_type,
+                   ConnectCallback done, void *callback_data);
+// Stops a connect in progress without calling the callback.
+void cancel_connect(Connector &c);
+bool connect_in_progress(const Connector &c);
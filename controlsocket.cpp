@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<controlsocket.hpp>
+#include<ssh_util.hpp>
+#include<util.hpp>
+#include<gio/gunixsocketaddress.h>
+#include<glib/gstdio.h>
+#include<cstdlib>
+
+std::string control_socket_path(const char *username, const char *host, unsigned int port) {
+    std::string name = std::string(username) + "@" + host + ":" + std::to_string(port);
+    gchar *path = g_build_filename(g_get_user_runtime_dir(), "sshprog", name.c_str(), nullptr);
+    std::string result(path);
+    g_free(path);
+    return result;
+}
+
+static void drop_request(ControlRequest *req) {
+    auto &requests = req->parent->requests;
+    if(req->watch) {
+        thread_source_remove(req->watch);
+    }
+    // Does not close the socket, the relay may still be using it.
+    g_io_channel_unref(req->channel);
+    g_object_unref(G_OBJECT(req->connection));
+    for(auto it = requests.begin(); it != requests.end(); ++it) {
+        if(it->get() == req) {
+            requests.erase(it);
+            return;
+        }
+    }
+}
+
+static void reply(ControlRequest &req, const std::string &line) {
+    std::string msg = line + "\n";
+    GOutputStream *ostream = g_io_stream_get_output_stream(G_IO_STREAM(req.connection));
+    // A fresh socket has plenty of room for this.
+    GError *err = nullptr;
+    if(!g_output_stream_write_all(ostream, msg.data(), msg.size(), nullptr, nullptr, &err)) {
+        printf("Could not reply to control client: %s\n", err->message);
+        g_error_free(err);
+    }
+}
+
+static SshChannel open_requested_channel(ControlSocket &cs, const std::string &line, std::string &error) {
+    PortForwardings &pf = *cs.rule.parent;
+    auto space = line.find(' ');
+    std::string kind = line.substr(0, space);
+    std::string arg = space == std::string::npos ? std::string() : line.substr(space+1);
+    SshChannel channel;
+    if(kind == "exec" && !arg.empty()) {
+        // FIXME, the exit status of the command is not passed on.
+        channel = open_exec_channel(pf.session, arg.c_str());
+    } else if(kind == "shell" && arg.empty()) {
+        channel = open_shell_channel(pf.session);
+    } else if(kind == "subsystem" && !arg.empty()) {
+        channel = open_subsystem_channel(pf.session, arg.c_str());
+    } else if(kind == "direct-tcpip") {
+        auto port_start = arg.rfind(' ');
+        char *end = nullptr;
+        long port = port_start == std::string::npos ? 0 : strtol(arg.c_str() + port_start + 1, &end, 10);
+        if(port <= 0 || port > 65535 || *end != '\0') {
+            error = "bad direct-tcpip request";
+            return SshChannel();
+        }
+        channel = open_forward_channel(pf, 0, (int)port, "127.0.0.1", arg.substr(0, port_start).c_str());
+    } else {
+        error = "unknown request";
+        return SshChannel();
+    }
+    if(channel == nullptr) {
+        error = ssh_get_error(pf.session);
+    }
+    return channel;
+}
+
+static void handle_request(ControlRequest *req) {
+    ControlSocket &cs = *req->parent;
+    std::string error;
+    auto channel = open_requested_channel(cs, req->line, error);
+    if(channel == nullptr) {
+        reply(*req, "error " + error);
+        drop_request(req);
+        return;
+    }
+    reply(*req, "ok");
+    relay_connection(cs.rule, req->connection, std::move(channel));
+    drop_request(req);
+}
+
+static gboolean request_readable(GIOChannel *, GIOCondition, gpointer data) {
+    ControlRequest *req = reinterpret_cast<ControlRequest*>(data);
+    // Read a byte at a time so that nothing meant for the channel is
+    // taken along with the request.
+    while(true) {
+        char c;
+        GError *err = nullptr;
+        gssize r = g_pollable_input_stream_read_nonblocking(G_POLLABLE_INPUT_STREAM(req->istream),
+                                                           &c, 1, nullptr, &err);
+        if(r < 0) {
+            bool again = g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+            if(!again) {
+                printf("Error reading control request: %s\n", err->message);
+            }
+            g_error_free(err);
+            if(again) {
+                return TRUE;
+            }
+            break;
+        }
+        if(r == 0) {
+            break;
+        }
+        if(c == '\n') {
+            if(!req->line.empty() && req->line.back() == '\r') {
+                req->line.pop_back();
+            }
+            req->watch = 0;
+            handle_request(req);
+            return FALSE;
+        }
+        if(req->line.size() >= CONTROL_MAX_REQUEST) {
+            reply(*req, "error request too long");
+            break;
+        }
+        req->line.push_back(c);
+    }
+    // Returning FALSE removes the watch.
+    req->watch = 0;
+    drop_request(req);
+    return FALSE;
+}
+
+static gboolean control_incoming(GSocketService *, GSocketConnection *connection, GObject *, gpointer user_data) {
+    ControlSocket &cs = *reinterpret_cast<ControlSocket*>(user_data);
+    cs.requests.emplace_back(new ControlRequest());
+    ControlRequest *req = cs.requests.back().get();
+    req->parent = &cs;
+    req->connection = connection;
+    g_object_ref(G_OBJECT(connection));
+    req->istream = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    req->channel = g_io_channel_unix_new(g_socket_get_fd(g_socket_connection_get_socket(connection)));
+    req->watch = thread_io_add_watch(req->channel, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), request_readable, req);
+    return TRUE;
+}
+
+// True if another process is serving the socket.
+static bool socket_in_use(GSocketAddress *address) {
+    GSocket *probe = g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, nullptr);
+    if(!probe) {
+        return false;
+    }
+    bool in_use = g_socket_connect(probe, address, nullptr, nullptr);
+    g_object_unref(G_OBJECT(probe));
+    return in_use;
+}
+
+bool open_control_socket(ControlSocket &cs, PortForwardings &pf, const char *path) {
+    gchar *dir = g_path_get_dirname(path);
+    int rc = g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    if(rc != 0) {
+        printf("Could not create directory for %s.\n", path);
+        return false;
+    }
+    GSocketAddress *address = g_unix_socket_address_new(path);
+    if(socket_in_use(address)) {
+        // The first session to a host keeps serving it.
+        printf("Control socket %s is used by another session.\n", path);
+        g_object_unref(G_OBJECT(address));
+        return false;
+    }
+    // Left behind by a process that did not exit cleanly.
+    g_unlink(path);
+    cs.rule.parent = &pf;
+    cs.rule.local_port = 0;
+    cs.rule.remote_port = 0;
+    cs.rule.listener = g_socket_service_new();
+    GError *err = nullptr;
+    bool ok = g_socket_listener_add_address(G_SOCKET_LISTENER(cs.rule.listener), address, G_SOCKET_TYPE_STREAM,
+                                            G_SOCKET_PROTOCOL_DEFAULT, nullptr, nullptr, &err);
+    g_object_unref(G_OBJECT(address));
+    if(!ok) {
+        printf("Could not listen on %s: %s\n", path, err->message);
+        g_error_free(err);
+        g_object_unref(G_OBJECT(cs.rule.listener));
+        cs.rule.listener = nullptr;
+        return false;
+    }
+    // The directory is private already, this covers a shared one.
+    g_chmod(path, 0600);
+    cs.path = path;
+    g_signal_connect(G_OBJECT(cs.rule.listener), "incoming", G_CALLBACK(control_incoming), &cs);
+    return true;
+}
+
+void close_control_socket(ControlSocket &cs) {
+    if(!cs.rule.listener) {
+        return;
+    }
+    g_socket_service_stop(cs.rule.listener);
+    g_socket_listener_close(G_SOCKET_LISTENER(cs.rule.listener));
+    g_object_unref(G_OBJECT(cs.rule.listener));
+    cs.rule.listener = nullptr;
+    g_unlink(cs.path.c_str());
+    while(!cs.requests.empty()) {
+        drop_request(cs.requests.back().get());
+    }
+    std::vector<ForwardState*> connections(cs.rule.connections.begin(), cs.rule.connections.end());
+    for(auto fs : connections) {
+        close_forwarded_connection(fs);
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<forwards.hpp>
+#include<gio/gio.h>
+#include<memory>
+#include<string>
+#include<vector>
+
+// Longest request line a client may send.
+static const constexpr size_t CONTROL_MAX_REQUEST = 4096;
+
+struct ControlSocket;
+
+// A client that has connected but not yet said what it wants.
+struct ControlRequest {
+    ControlSocket *parent;
+    GSocketConnection *connection;
+    GInputStream *istream;
+    GIOChannel *channel;
+    guint watch;
+    std::string line;
+};
+
+/*
+ * A Unix socket through which other programs get channels on an
+ * already authenticated session, without a handshake of their own.
+ *
+ * A client connects and sends one line:
+ *
+ *   exec <command>
+ *   shell
+ *   subsystem <name>
+ *   direct-tcpip <host> <port>
+ *
+ * It gets back "ok" or "error <message>" on a line of its own. After
+ * an ok the socket carries the channel's data in both directions, the
+ * same way a port forward does, until either side closes.
+ *
+ * Lives on the I/O thread.
+ */
+struct ControlSocket {
+    // Relays are kept with the port forwards and tracked through this
+    // rule, its listener is the Unix socket.
+    ForwardRule rule;
+    std::string path;
+    std::vector<std::unique_ptr<ControlRequest>> requests;
+};
+
+// $XDG_RUNTIME_DIR/sshprog/user@host:port
+std::string control_socket_path(const char *username, const char *host, unsigned int port);
+
+bool open_control_socket(ControlSocket &cs, PortForwardings &pf, const char *path);
+void close_control_socket(ControlSocket &cs);
@@ -0,0 +1,515 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<delta.hpp>
+
+#include<fcntl.h>
+#include<unistd.h>
+#include<cmath>
+#include<cstdio>
+#include<cstdlib>
+#include<algorithm>
+
+// How much of the local file one feed call rolls through.
+static const constexpr uint64_t DELTA_STEP = 4*1024*1024;
+// Matching pauses while this much output waits for the channel window.
+static const constexpr size_t DELTA_MAX_PENDING = 1024*1024;
+// Literal data is sent in pieces of at most this size.
+static const constexpr uint64_t DELTA_MAX_LITERAL = 64*1024;
+static const constexpr uint32_t ADLER_MOD = 65521;
+
+/*
+ * Runs on the remote host as "python3 -c HELPER mode block_size path [temp_path]".
+ *
+ * sums:  print the file size, then "adler32 md5 length" for each block.
+ * get:   read block numbers from stdin, print the contents of each.
+ * patch: build temp_path from stdin, where "C n" copies block n of the
+ *        old file, "D len" is followed by len bytes of new data and "E"
+ *        ends the file. Prints OK once it is on disk.
+ *
+ * It must not contain single quotes as it is passed quoted to the shell.
+ */
+static const char DELTA_HELPER[] = R"(
+import sys, os, zlib, hashlib
+mode, bs, path = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+inp, out = sys.stdin.buffer, sys.stdout.buffer
+if mode == "sums":
+    with open(path, "rb") as f:
+        out.write(b"%d\n" % os.fstat(f.fileno()).st_size)
+        while True:
+            b = f.read(bs)
+            if not b:
+                break
+            out.write(b"%d %s %d\n" % (zlib.adler32(b), hashlib.md5(b).hexdigest().encode(), len(b)))
+elif mode == "get":
+    with open(path, "rb") as f:
+        for line in inp:
+            f.seek(int(line) * bs)
+            out.write(f.read(bs))
+elif mode == "patch":
+    tmp = sys.argv[4]
+    with open(path, "rb") as old, open(tmp, "wb") as new:
+        while True:
+            h = inp.readline().split()
+            if not h:
+                sys.exit(1)
+            if h[0] == b"C":
+                old.seek(int(h[1]) * bs)
+                new.write(old.read(bs))
+            elif h[0] == b"D":
+                n = int(h[1])
+                while n > 0:
+                    d = inp.read(min(n, 1 << 20))
+                    if not d:
+                        sys.exit(1)
+                    new.write(d)
+                    n -= len(d)
+            else:
+                break
+        new.flush()
+        os.fsync(new.fileno())
+    os.chmod(tmp, os.stat(path).st_mode & 0o7777)
+    out.write(b"OK\n")
+out.flush()
+)";
+
+static std::string helper_command(const char *mode, uint32_t block_size, const std::string &path, const std::string &extra) {
+    std::string cmd = std::string("python3 -c '") + DELTA_HELPER + "' " + mode + " " + std::to_string(block_size);
+    gchar *quoted = g_shell_quote(path.c_str());
+    cmd += std::string(" ") + quoted;
+    g_free(quoted);
+    if(!extra.empty()) {
+        quoted = g_shell_quote(extra.c_str());
+        cmd += std::string(" ") + quoted;
+        g_free(quoted);
+    }
+    return cmd;
+}
+
+// Roughly the square root of the file size, like rsync does.
+static uint32_t choose_block_size(uint64_t size) {
+    uint64_t bs = (uint64_t) std::sqrt((double) size);
+    bs = (bs + 1023) & ~(uint64_t)1023;
+    return (uint32_t) std::min<uint64_t>(std::max<uint64_t>(bs, 4096), 128*1024);
+}
+
+// Same value as zlib's adler32, but the window can be moved a byte at a time.
+static void adler_init(const guchar *data, uint32_t len, uint32_t &a, uint32_t &b) {
+    uint64_t sa = 1;
+    uint64_t sb = 0;
+    for(uint32_t i=0; i<len; i++) {
+        sa += data[i];
+        sb += sa;
+        if((i & 0xfff) == 0xfff) {
+            sa %= ADLER_MOD;
+            sb %= ADLER_MOD;
+        }
+    }
+    a = sa % ADLER_MOD;
+    b = sb % ADLER_MOD;
+}
+
+static void adler_roll(uint32_t &a, uint32_t &b, uint32_t len, guchar out, guchar in) {
+    a = (a + ADLER_MOD - out + in) % ADLER_MOD;
+    int64_t nb = ((int64_t) b - (int64_t) (((uint64_t) len * out) % ADLER_MOD) + a - 1) % ADLER_MOD;
+    b = nb < 0 ? nb + ADLER_MOD : nb;
+}
+
+static inline uint32_t adler_value(uint32_t a, uint32_t b) {
+    return (b << 16) | a;
+}
+
+static inline size_t adler_tag(uint32_t weak) {
+    return (weak ^ (weak >> 16)) & 0xffff;
+}
+
+static bool open_helper(DeltaTransfer &dt, const char *mode, const std::string &path, const std::string &extra) {
+    std::string cmd = helper_command(mode, dt.block_size, path, extra);
+    dt.channel = open_exec_channel(dt.session, cmd.c_str());
+    dt.input.clear();
+    dt.input_eof = false;
+    dt.output.clear();
+    dt.output_pos = 0;
+    dt.output_eof = false;
+    return dt.channel != nullptr;
+}
+
+static bool flush_output(DeltaTransfer &dt) {
+    while(dt.output_pos < dt.output.size()) {
+        uint32_t room = std::min<uint64_t>(ssh_channel_window_size(dt.channel), dt.output.size() - dt.output_pos);
+        if(room == 0) {
+            // The rest goes when the server adjusts the window.
+            return true;
+        }
+        int written = ssh_channel_write(dt.channel, dt.output.data() + dt.output_pos, room);
+        if(written < 0) {
+            printf("Could not write to delta helper: %s\n", ssh_get_error(dt.session));
+            return false;
+        }
+        dt.output_pos += written;
+    }
+    dt.output.clear();
+    dt.output_pos = 0;
+    if(dt.output_eof) {
+        ssh_channel_send_eof(dt.channel);
+        dt.output_eof = false;
+    }
+    return true;
+}
+
+static size_t pending_output(const DeltaTransfer &dt) {
+    return dt.output.size() - dt.output_pos;
+}
+
+static uint32_t remote_block_size(const DeltaTransfer &dt, size_t block) {
+    return (uint32_t) std::min<uint64_t>(dt.block_size, dt.remote_size - (uint64_t) block*dt.block_size);
+}
+
+static bool write_fetched(DeltaTransfer &dt, const char *data, size_t len) {
+    while(len > 0) {
+        if(dt.fetch_block >= dt.missing.size()) {
+            printf("Delta helper sent too much data.\n");
+            return false;
+        }
+        size_t block = dt.missing[dt.fetch_block];
+        uint32_t block_len = remote_block_size(dt, block);
+        size_t chunk = std::min<size_t>(len, block_len - dt.fetch_got);
+        off_t offset = (off_t) block*dt.block_size + dt.fetch_got;
+        if(pwrite(dt.out_fd, data, chunk, offset) != (ssize_t) chunk) {
+            printf("Could not write to local file.\n");
+            return false;
+        }
+        data += chunk;
+        len -= chunk;
+        dt.fetch_got += chunk;
+        dt.transferred += chunk;
+        dt.sent += chunk;
+        if(dt.fetch_got == block_len) {
+            dt.fetch_block++;
+            dt.fetch_got = 0;
+        }
+    }
+    return true;
+}
+
+static bool read_input(DeltaTransfer &dt) {
+    char buf[32*1024];
+    while(!dt.input_eof) {
+        int num_read = ssh_channel_read_nonblocking(dt.channel, buf, sizeof(buf), 0);
+        if(num_read == SSH_EOF || (num_read == 0 && ssh_channel_is_eof(dt.channel))) {
+            dt.input_eof = true;
+            break;
+        }
+        if(num_read < 0) {
+            printf("Could not read from delta helper: %s\n", ssh_get_error(dt.session));
+            return false;
+        }
+        if(num_read == 0) {
+            break;
+        }
+        if(dt.phase == DELTA_FETCH) {
+            if(!write_fetched(dt, buf, num_read)) {
+                return false;
+            }
+        } else {
+            dt.input.append(buf, num_read);
+        }
+    }
+    return true;
+}
+
+static bool parse_sums(DeltaTransfer &dt) {
+    gchar **lines = g_strsplit(dt.input.c_str(), "\n", -1);
+    guint num_lines = g_strv_length(lines);
+    bool ok = num_lines > 0 && lines[0][0] != '\0';
+    if(ok) {
+        dt.remote_size = g_ascii_strtoull(lines[0], nullptr, 10);
+    }
+    for(guint i=1; ok && i<num_lines; i++) {
+        if(lines[i][0] == '\0') {
+            continue;
+        }
+        gchar **fields = g_strsplit(lines[i], " ", 3);
+        if(g_strv_length(fields) != 3) {
+            ok = false;
+        } else {
+            BlockSum sum{(uint32_t) g_ascii_strtoull(fields[0], nullptr, 10),
+                         fields[1],
+                         (uint32_t) g_ascii_strtoull(fields[2], nullptr, 10)};
+            dt.sums.push_back(std::move(sum));
+        }
+        g_strfreev(fields);
+    }
+    g_strfreev(lines);
+    uint64_t expected = (dt.remote_size + dt.block_size - 1) / dt.block_size;
+    if(!ok || dt.sums.size() != expected) {
+        return false;
+    }
+    // A short last block can only match at the very end, don't bother.
+    dt.tags.assign(1 << 16, false);
+    for(size_t i=0; i<dt.sums.size(); i++) {
+        if(dt.sums[i].size == dt.block_size) {
+            dt.index.emplace(dt.sums[i].weak, i);
+            dt.tags[adler_tag(dt.sums[i].weak)] = true;
+        }
+    }
+    dt.input.clear();
+    return true;
+}
+
+// Finds the blocks of the remote file whose contents are the current window.
+static void match_window(DeltaTransfer &dt, const guchar *window, std::vector<size_t> &blocks) {
+    blocks.clear();
+    uint32_t weak = adler_value(dt.a, dt.b);
+    if(!dt.tags[adler_tag(weak)]) {
+        return;
+    }
+    auto range = dt.index.equal_range(weak);
+    if(range.first == range.second) {
+        return;
+    }
+    g_checksum_reset(dt.md5);
+    g_checksum_update(dt.md5, window, dt.block_size);
+    const gchar *strong = g_checksum_get_string(dt.md5);
+    for(auto it=range.first; it!=range.second; ++it) {
+        if(dt.sums[it->second].strong == strong) {
+            blocks.push_back(it->second);
+        }
+    }
+}
+
+static void emit_literal(DeltaTransfer &dt, const guchar *data, uint64_t end) {
+    if(end <= dt.literal_start) {
+        return;
+    }
+    uint64_t len = end - dt.literal_start;
+    dt.output += "D " + std::to_string(len) + "\n";
+    dt.output.append((const char*) data + dt.literal_start, len);
+    dt.sent += len;
+    dt.literal_start = end;
+}
+
+// Returns true once the whole local file has been processed.
+static bool step_match(DeltaTransfer &dt) {
+    const guchar *data = (const guchar*) (dt.local ? g_mapped_file_get_contents(dt.local) : nullptr);
+    const uint64_t len = dt.block_size;
+    const uint64_t step_end = dt.pos + DELTA_STEP;
+    std::vector<size_t> blocks;
+    while(dt.pos < step_end && pending_output(dt) < DELTA_MAX_PENDING) {
+        if(dt.pos + len > dt.local_size) {
+            if(dt.upload) {
+                emit_literal(dt, data, dt.local_size);
+                dt.transferred = dt.local_size;
+            }
+            dt.pos = dt.local_size;
+            return true;
+        }
+        if(!dt.rolling) {
+            adler_init(data + dt.pos, len, dt.a, dt.b);
+            dt.rolling = true;
+        }
+        match_window(dt, data + dt.pos, blocks);
+        if(dt.upload && !blocks.empty()) {
+            emit_literal(dt, data, dt.pos);
+            dt.output += "C " + std::to_string(blocks.front()) + "\n";
+            dt.pos += len;
+            dt.literal_start = dt.pos;
+            dt.rolling = false;
+            continue;
+        }
+        bool copied = false;
+        for(const auto &block : blocks) {
+            if(dt.have[block]) {
+                continue;
+            }
+            if(pwrite(dt.out_fd, data + dt.pos, len, (off_t) block*len) != (ssize_t) len) {
+                printf("Could not write to local file.\n");
+                return false;
+            }
+            dt.have[block] = true;
+            dt.transferred += len;
+            copied = true;
+        }
+        if(copied) {
+            dt.pos += len;
+            dt.rolling = false;
+            continue;
+        }
+        if(dt.upload && dt.pos - dt.literal_start >= DELTA_MAX_LITERAL) {
+            emit_literal(dt, data, dt.pos);
+        }
+        if(dt.pos + len < dt.local_size) {
+            adler_roll(dt.a, dt.b, len, data[dt.pos], data[dt.pos + len]);
+        } else {
+            dt.rolling = false;
+        }
+        dt.pos++;
+    }
+    if(dt.upload) {
+        dt.transferred = dt.pos;
+    }
+    return false;
+}
+
+bool start_delta(DeltaTransfer &dt, ssh_session session, bool upload,
+                 const char *local_path, const char *remote_path,
+                 const char *temp_path, uint64_t remote_size) {
+    GError *err = nullptr;
+    dt.session = session;
+    dt.upload = upload;
+    dt.phase = DELTA_SUMS;
+    dt.can_fall_back = true;
+    dt.remote_path = remote_path;
+    dt.temp_path = temp_path;
+    dt.block_size = choose_block_size(remote_size);
+    dt.remote_size = remote_size;
+    dt.sums.clear();
+    dt.index.clear();
+    dt.md5 = g_checksum_new(G_CHECKSUM_MD5);
+    dt.out_fd = -1;
+    dt.local = g_mapped_file_new(local_path, FALSE, &err);
+    if(err) {
+        printf("Mmap fail: %s.\n", err->message);
+        g_error_free(err);
+        finish_delta(dt);
+        return false;
+    }
+    dt.local_size = g_mapped_file_get_length(dt.local);
+    dt.pos = 0;
+    dt.literal_start = 0;
+    dt.rolling = false;
+    dt.size = upload ? dt.local_size : remote_size;
+    dt.transferred = 0;
+    dt.sent = 0;
+    if(!open_helper(dt, "sums", dt.remote_path, "")) {
+        finish_delta(dt);
+        return false;
+    }
+    return true;
+}
+
+bool feed_delta(DeltaTransfer &dt) {
+    if(!flush_output(dt) || !read_input(dt)) {
+        return false;
+    }
+    switch(dt.phase) {
+    case DELTA_SUMS:
+        if(!dt.input_eof) {
+            return true;
+        }
+        if(!parse_sums(dt)) {
+            // Most likely the remote end has no python3.
+            printf("Delta helper failed on %s.\n", dt.remote_path.c_str());
+            return false;
+        }
+        if(dt.upload) {
+            if(!open_helper(dt, "patch", dt.remote_path, dt.temp_path)) {
+                return false;
+            }
+        } else {
+            dt.size = dt.remote_size;
+            dt.out_fd = open(dt.temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if(dt.out_fd < 0 || ftruncate(dt.out_fd, dt.remote_size) != 0) {
+                printf("Could not open local file.\n");
+                return false;
+            }
+            dt.have.assign(dt.sums.size(), false);
+        }
+        dt.can_fall_back = false;
+        dt.phase = DELTA_MATCH;
+        // Fall through.
+    case DELTA_MATCH:
+        if(pending_output(dt) >= DELTA_MAX_PENDING) {
+            return flush_output(dt);
+        }
+        if(!step_match(dt)) {
+            return flush_output(dt);
+        }
+        if(dt.upload) {
+            dt.output += "E\n";
+            dt.output_eof = true;
+            dt.phase = DELTA_COMMIT;
+            return flush_output(dt);
+        }
+        dt.missing.clear();
+        for(size_t i=0; i<dt.have.size(); i++) {
+            if(!dt.have[i]) {
+                dt.missing.push_back(i);
+            }
+        }
+        if(dt.missing.empty()) {
+            dt.phase = DELTA_DONE;
+            return true;
+        }
+        if(!open_helper(dt, "get", dt.remote_path, "")) {
+            return false;
+        }
+        for(const auto &block : dt.missing) {
+            dt.output += std::to_string(block) + "\n";
+        }
+        dt.output_eof = true;
+        dt.fetch_block = 0;
+        dt.fetch_got = 0;
+        dt.phase = DELTA_FETCH;
+        return flush_output(dt);
+    case DELTA_FETCH:
+        if(dt.fetch_block == dt.missing.size()) {
+            dt.phase = DELTA_DONE;
+        } else if(dt.input_eof) {
+            printf("Delta helper sent too little data.\n");
+            return false;
+        }
+        return true;
+    case DELTA_COMMIT:
+        if(dt.input.find("OK\n") != std::string::npos) {
+            dt.phase = DELTA_DONE;
+        } else if(dt.input_eof) {
+            printf("Delta helper could not write %s.\n", dt.temp_path.c_str());
+            return false;
+        }
+        return true;
+    case DELTA_DONE:
+        return true;
+    }
+    return true;
+}
+
+bool delta_busy(const DeltaTransfer &dt) {
+    return dt.phase == DELTA_MATCH && pending_output(dt) < DELTA_MAX_PENDING;
+}
+
+void finish_delta(DeltaTransfer &dt) {
+    dt.channel = SshChannel();
+    if(dt.local) {
+        g_mapped_file_unref(dt.local);
+        dt.local = nullptr;
+    }
+    if(dt.md5) {
+        g_checksum_free(dt.md5);
+        dt.md5 = nullptr;
+    }
+    if(dt.out_fd >= 0) {
+        close(dt.out_fd);
+        dt.out_fd = -1;
+    }
+    dt.sums.clear();
+    dt.index.clear();
+    dt.have.clear();
+    dt.missing.clear();
+    dt.input.clear();
+    dt.output.clear();
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<ssh_util.hpp>
+#include<glib.h>
+#include<string>
+#include<vector>
+#include<unordered_map>
+
+// Smaller files are sent whole, the checksums would cost more than they save.
+static const constexpr uint64_t DELTA_MIN_SIZE = 64*1024;
+
+enum DeltaPhase {
+    DELTA_SUMS,   // Reading block checksums from the remote helper.
+    DELTA_MATCH,  // Rolling through the local file looking for known blocks.
+    DELTA_FETCH,  // Downloads: getting the blocks we did not have.
+    DELTA_COMMIT, // Uploads: waiting for the helper to finish the file.
+    DELTA_DONE,
+};
+
+struct BlockSum {
+    uint32_t weak;
+    std::string strong;
+    uint32_t size;
+};
+
+/*
+ * rsync style transfer of a file whose previous version exists on the
+ * receiving side. A small Python helper run over an exec channel
+ * computes block checksums of the remote file. We roll through the
+ * local file to find the blocks both sides have, so the expensive part
+ * always runs here.
+ *
+ * Uploads stream copy and literal instructions to the helper, which
+ * builds temp_path from the old remote file. Downloads copy matching
+ * blocks from the old local file into temp_path and ask the helper for
+ * the rest.
+ */
+struct DeltaTransfer {
+    ssh_session session; // A non-owning pointer.
+    bool upload;
+    DeltaPhase phase;
+    bool can_fall_back; // True until something has been committed to.
+    SshChannel channel;
+    std::string input;
+    bool input_eof;
+    std::string output;
+    size_t output_pos;
+    bool output_eof;
+
+    std::string remote_path;
+    std::string temp_path;
+    uint32_t block_size;
+    uint64_t remote_size;
+    std::vector<BlockSum> sums;
+    std::unordered_multimap<uint32_t, size_t> index;
+    std::vector<bool> tags;
+    GChecksum *md5;
+
+    // The new file for uploads, the old one for downloads.
+    GMappedFile *local;
+    uint64_t local_size;
+    uint64_t pos;
+    uint64_t literal_start;
+    uint32_t a, b;
+    bool rolling;
+
+    int out_fd;
+    std::vector<bool> have;
+    std::vector<size_t> missing;
+    size_t fetch_block;
+    uint32_t fetch_got;
+
+    uint64_t size;
+    uint64_t transferred;
+    uint64_t sent; // Bytes of file data that actually crossed the network.
+};
+
+bool start_delta(DeltaTransfer &dt, ssh_session session, bool upload,
+                 const char *local_path, const char *remote_path,
+                 const char *temp_path, uint64_t remote_size);
+// Returns false on failure, the transfer is complete once phase is DELTA_DONE.
+bool feed_delta(DeltaTransfer &dt);
+// Whether there is local work to do that does not wait for the network.
+bool delta_busy(const DeltaTransfer &dt);
+void finish_delta(DeltaTransfer &dt);
@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<diskio.hpp>
+#include<util.hpp>
+
+#include<sys/eventfd.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<cerrno>
+#include<cstring>
+#include<cstdio>
+
+// Does the whole operation with blocking calls.
+static void run_op(DiskOp &op) {
+    if(op.sync) {
+        int r;
+        do {
+            r = fdatasync(op.fd);
+        } while(r < 0 && errno == EINTR);
+        op.result = r < 0 ? -errno : 0;
+        return;
+    }
+    if(op.offset == DISK_STREAM_OFFSET) {
+        ssize_t r;
+        do {
+            r = op.write ? write(op.fd, op.buf.data(), op.len) : read(op.fd, op.buf.data(), op.len);
+        } while(r < 0 && errno == EINTR);
+        op.result = r < 0 ? -errno : r;
+        return;
+    }
+    while(op.pos < op.len) {
+        char *p = op.buf.data() + op.pos;
+        size_t n = op.len - op.pos;
+        off_t offset = op.offset + op.pos;
+        ssize_t r = op.write ? pwrite(op.fd, p, n, offset) : pread(op.fd, p, n, offset);
+        if(r < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            op.result = -errno;
+            return;
+        }
+        if(r == 0) {
+            break;
+        }
+        op.pos += r;
+    }
+    op.result = op.pos;
+}
+
+static void signal_event(DiskIo &io) {
+    uint64_t one = 1;
+    ssize_t r = write(io.event_fd, &one, sizeof(one));
+    (void)r; // The counter can not overflow in practice.
+}
+
+static void pool_worker(gpointer data, gpointer user_data) {
+    DiskOp *op = reinterpret_cast<DiskOp*>(data);
+    DiskIo *io = reinterpret_cast<DiskIo*>(user_data);
+    if(op->task) {
+        op->task(op->task_data);
+        delete op;
+        return;
+    }
+    run_op(*op);
+    g_mutex_lock(&io->lock);
+    io->completed.push_back(op);
+    g_cond_broadcast(&io->cond);
+    g_mutex_unlock(&io->lock);
+    signal_event(*io);
+}
+
+static void push_to_pool(DiskIo &io, DiskOp &op) {
+    op.on_ring = false;
+    g_thread_pool_push(io.pool, &op, nullptr);
+}
+
+static gboolean stream_readable(GIOChannel *, GIOCondition, gpointer data) {
+    DiskOp &op = *reinterpret_cast<DiskOp*>(data);
+    DiskIo &io = *op.io;
+    // The fd is readable or closed, so this does not block.
+    run_op(op);
+    g_io_channel_unref(op.channel);
+    op.channel = nullptr;
+    op.watch = 0;
+    g_mutex_lock(&io.lock);
+    io.completed.push_back(&op);
+    g_cond_broadcast(&io.cond);
+    g_mutex_unlock(&io.lock);
+    signal_event(io);
+    return FALSE;
+}
+
+static void watch_stream(DiskIo &io, DiskOp &op) {
+    op.on_ring = false;
+    op.io = &io;
+    op.channel = g_io_channel_unix_new(op.fd);
+    op.watch = thread_io_add_watch(op.channel, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), stream_readable, &op);
+}
+
+#ifdef HAVE_LIBURING
+
+static bool ring_submit(DiskIo &io, DiskOp &op) {
+    // More than this could overflow the completion queue.
+    if(io.ring_pending >= DISK_QUEUE_DEPTH) {
+        return false;
+    }
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&io.ring);
+    if(!sqe) {
+        return false;
+    }
+    char *p = op.buf.data() + op.pos;
+    unsigned n = op.len - op.pos;
+    // An offset of -1 makes the kernel use the file position.
+    uint64_t offset = op.offset == DISK_STREAM_OFFSET ? (uint64_t)-1 : op.offset + op.pos;
+    if(op.sync) {
+        io_uring_prep_fsync(sqe, op.fd, IORING_FSYNC_DATASYNC);
+    } else if(op.write) {
+        io_uring_prep_write(sqe, op.fd, p, n, offset);
+    } else {
+        io_uring_prep_read(sqe, op.fd, p, n, offset);
+    }
+    io_uring_sqe_set_data(sqe, &op);
+    if(io_uring_submit(&io.ring) < 0) {
+        // The entry stays in the ring and goes with the next submit, so
+        // it must not point to the operation any more.
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, nullptr);
+        io.ring_pending++;
+        return false;
+    }
+    io.ring_pending++;
+    op.on_ring = true;
+    return true;
+}
+
+static void ring_completed(DiskIo &io, DiskOp &op, int res) {
+    if(res == -EINTR || res == -EAGAIN) {
+        res = 0;
+    } else if(res < 0 || op.sync || op.offset == DISK_STREAM_OFFSET) {
+        op.result = res;
+        op.done = true;
+        return;
+    } else if(res == 0) {
+        op.result = op.pos;
+        op.done = true;
+        return;
+    }
+    op.pos += res;
+    if(op.pos >= op.len) {
+        op.result = op.pos;
+        op.done = true;
+        return;
+    }
+    // Short read or write, carry on from where it stopped.
+    if(ring_submit(io, op)) {
+        return;
+    }
+    if(op.offset == DISK_STREAM_OFFSET && !op.write) {
+        watch_stream(io, op);
+    } else {
+        push_to_pool(io, op);
+    }
+}
+
+#endif
+
+static void reap_disk_io(DiskIo &io) {
+#ifdef HAVE_LIBURING
+    if(io.use_uring) {
+        struct io_uring_cqe *cqe;
+        while(io_uring_peek_cqe(&io.ring, &cqe) == 0) {
+            DiskOp *op = reinterpret_cast<DiskOp*>(io_uring_cqe_get_data(cqe));
+            int res = cqe->res;
+            io_uring_cqe_seen(&io.ring, cqe);
+            io.ring_pending--;
+            if(op) {
+                ring_completed(io, *op, res);
+            }
+        }
+    }
+#endif
+    std::vector<DiskOp*> done;
+    g_mutex_lock(&io.lock);
+    done.swap(io.completed);
+    g_mutex_unlock(&io.lock);
+    for(auto op : done) {
+        op->done = true;
+    }
+}
+
+static gboolean disk_io_event(GIOChannel *, GIOCondition, gpointer data) {
+    DiskIo &io = *reinterpret_cast<DiskIo*>(data);
+    uint64_t count;
+    ssize_t r = read(io.event_fd, &count, sizeof(count));
+    (void)r;
+    reap_disk_io(io);
+    if(io.wakeup) {
+        io.wakeup(io.wakeup_data);
+    }
+    return TRUE;
+}
+
+bool init_disk_io(DiskIo &io, void (*wakeup)(void *data), void *wakeup_data) {
+    io.wakeup = wakeup;
+    io.wakeup_data = wakeup_data;
+    io.event_channel = nullptr;
+    io.event_watch = 0;
+    io.pool = nullptr;
+    g_mutex_init(&io.lock);
+    g_cond_init(&io.cond);
+#ifdef HAVE_LIBURING
+    io.use_uring = false;
+    io.ring_pending = 0;
+#endif
+    io.ready = true;
+    io.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(io.event_fd < 0) {
+        printf("Could not create eventfd, file access will block.\n");
+        return false;
+    }
+#ifdef HAVE_LIBURING
+    // Seccomp filters and old kernels refuse io_uring, that is not an error.
+    if(io_uring_queue_init(DISK_QUEUE_DEPTH, &io.ring, 0) == 0) {
+        if(io_uring_register_eventfd(&io.ring, io.event_fd) == 0) {
+            io.use_uring = true;
+        } else {
+            io_uring_queue_exit(&io.ring);
+        }
+    }
+#endif
+    // Also needed with io_uring for whatever does not fit in the ring.
+    io.pool = g_thread_pool_new(pool_worker, &io, DISK_THREADS, FALSE, nullptr);
+    io.event_channel = g_io_channel_unix_new(io.event_fd);
+    io.event_watch = thread_io_add_watch(io.event_channel, G_IO_IN, disk_io_event, &io);
+    return true;
+}
+
+void close_disk_io(DiskIo &io) {
+    if(!io.ready) {
+        return;
+    }
+    if(io.pool) {
+        // Waits for the operations that are still running.
+        g_thread_pool_free(io.pool, FALSE, TRUE);
+        io.pool = nullptr;
+    }
+#ifdef HAVE_LIBURING
+    if(io.use_uring) {
+        io_uring_queue_exit(&io.ring);
+        io.use_uring = false;
+    }
+#endif
+    if(io.event_watch) {
+        thread_source_remove(io.event_watch);
+        io.event_watch = 0;
+    }
+    if(io.event_channel) {
+        g_io_channel_unref(io.event_channel);
+        io.event_channel = nullptr;
+    }
+    if(io.event_fd >= 0) {
+        close(io.event_fd);
+        io.event_fd = -1;
+    }
+    g_mutex_clear(&io.lock);
+    g_cond_clear(&io.cond);
+    io.completed.clear();
+    io.spare.clear();
+    io.ready = false;
+}
+
+std::unique_ptr<DiskOp> acquire_disk_op(DiskIo &io, uint32_t len) {
+    std::unique_ptr<DiskOp> op;
+    if(!io.spare.empty()) {
+        op = std::move(io.spare.back());
+        io.spare.pop_back();
+    } else {
+        op.reset(new DiskOp());
+    }
+    if(op->buf.size() < len) {
+        op->buf.resize(len);
+    }
+    op->done = false;
+    op->on_ring = false;
+    op->task = nullptr;
+    op->watch = 0;
+    return op;
+}
+
+void release_disk_op(DiskIo &io, std::unique_ptr<DiskOp> op) {
+    if(op && io.spare.size() < DISK_MAX_SPARE) {
+        io.spare.push_back(std::move(op));
+    }
+}
+
+static void submit_op(DiskIo &io, DiskOp &op, bool write, bool sync, int fd, uint64_t offset, uint32_t len) {
+    op.write = write;
+    op.sync = sync;
+    op.fd = fd;
+    op.offset = offset;
+    op.len = len;
+    op.pos = 0;
+    op.on_ring = false;
+    op.done = false;
+    op.result = 0;
+    op.task = nullptr;
+    op.watch = 0;
+    if(io.event_fd < 0) {
+        run_op(op);
+        op.done = true;
+        return;
+    }
+#ifdef HAVE_LIBURING
+    // The kernel polls streams itself, nothing blocks on them.
+    if(io.use_uring && ring_submit(io, op)) {
+        return;
+    }
+#endif
+    if(!write && !sync && offset == DISK_STREAM_OFFSET) {
+        watch_stream(io, op);
+        return;
+    }
+    push_to_pool(io, op);
+}
+
+void submit_disk_read(DiskIo &io, DiskOp &op, int fd, uint64_t offset, uint32_t len) {
+    if(op.buf.size() < len) {
+        op.buf.resize(len);
+    }
+    submit_op(io, op, false, false, fd, offset, len);
+}
+
+void submit_disk_write(DiskIo &io, DiskOp &op, int fd, uint64_t offset, uint32_t len) {
+    submit_op(io, op, true, false, fd, offset, len);
+}
+
+void submit_disk_sync(DiskIo &io, DiskOp &op, int fd) {
+    submit_op(io, op, false, true, fd, 0, 0);
+}
+
+void run_disk_task(DiskIo &io, void (*task)(void *data), void *data) {
+    if(!io.pool) {
+        task(data);
+        return;
+    }
+    DiskOp *op = new DiskOp();
+    op->task = task;
+    op->task_data = data;
+    g_thread_pool_push(io.pool, op, nullptr);
+}
+
+void wait_disk_op(DiskIo &io, DiskOp &op) {
+    // The writer may never come, a waiting stream read is given up.
+    if(op.watch) {
+        thread_source_remove(op.watch);
+        g_io_channel_unref(op.channel);
+        op.channel = nullptr;
+        op.watch = 0;
+        op.result = -ECANCELED;
+        op.done = true;
+    }
+    while(!op.done) {
+#ifdef HAVE_LIBURING
+        if(op.on_ring) {
+            struct io_uring_cqe *cqe;
+            io_uring_wait_cqe(&io.ring, &cqe);
+            reap_disk_io(io);
+            continue;
+        }
+#endif
+        g_mutex_lock(&io.lock);
+        while(io.completed.empty()) {
+            g_cond_wait(&io.cond, &io.lock);
+        }
+        g_mutex_unlock(&io.lock);
+        reap_disk_io(io);
+    }
+}
+
+bool preallocate_file(int fd, uint64_t offset, uint64_t len) {
+    if(len == 0) {
+        return true;
+    }
+    // Unlike posix_fallocate this never falls back to writing zeros,
+    // which would take as long as the download itself.
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return true;
+    }
+    if(errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL) {
+        return true;
+    }
+    printf("Could not reserve space for file: %s\n", strerror(errno));
+    return false;
+}
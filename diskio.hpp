@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<glib.h>
+#include<vector>
+#include<memory>
+#include<cstdint>
+
+#ifdef HAVE_LIBURING
+#include<liburing.h>
+#endif
+
+// Reads and writes that the kernel or a worker may be busy with at once.
+static const constexpr unsigned DISK_QUEUE_DEPTH = 64;
+// Worker threads used when io_uring is not available.
+static const constexpr int DISK_THREADS = 4;
+// Buffers kept around for reuse once their operation is done.
+static const constexpr size_t DISK_MAX_SPARE = 64;
+// Offset of operations that use the file position, such as pipes.
+static const constexpr uint64_t DISK_STREAM_OFFSET = UINT64_MAX;
+
+struct DiskIo;
+
+/*
+ * One read or write of a local file. Whoever submitted it owns it but
+ * must not touch the buffer or free the operation before done is set.
+ * Positional operations are carried out completely, a short result
+ * means end of file. Stream reads return whatever read() gave.
+ */
+struct DiskOp {
+    bool write;
+    bool sync;       // fdatasync, there is no data.
+    int fd;
+    uint64_t offset;
+    std::vector<char> buf;
+    uint32_t len;
+    uint32_t pos;    // How much of a positional operation is done.
+    bool on_ring;
+    bool done;
+    int64_t result;  // Bytes processed or -errno.
+    // Tasks run on the pool instead. Nobody waits for them, the task
+    // does its own signalling and the operation frees itself.
+    void (*task)(void *data);
+    void *task_data;
+    // A stream read waiting for its fd to become readable.
+    DiskIo *io;
+    GIOChannel *channel;
+    guint watch;
+};
+
+/*
+ * Runs local file I/O off the main thread. Uses io_uring if it was
+ * built in and the kernel allows it, a thread pool otherwise. Reads of
+ * pipes and other streams may wait for their writer forever, so
+ * without io_uring they wait in the main loop instead of blocking a
+ * worker that every other file needs.
+ * Completions are signalled through an eventfd watched by the main
+ * loop, which then calls wakeup so the owners can look at their
+ * operations. If even that can not be set up, operations run
+ * synchronously.
+ */
+struct DiskIo {
+    bool ready;
+    int event_fd;
+    GIOChannel *event_channel;
+    guint event_watch;
+#ifdef HAVE_LIBURING
+    bool use_uring;
+    struct io_uring ring;
+    unsigned ring_pending;
+#endif
+    GThreadPool *pool;
+    GMutex lock;
+    GCond cond;
+    std::vector<DiskOp*> completed; // Pool results, protected by lock.
+    std::vector<std::unique_ptr<DiskOp>> spare;
+
+    void (*wakeup)(void *data);
+    void *wakeup_data;
+};
+
+bool init_disk_io(DiskIo &io, void (*wakeup)(void *data), void *wakeup_data);
+void close_disk_io(DiskIo &io);
+
+// The buffer has room for at least len bytes.
+std::unique_ptr<DiskOp> acquire_disk_op(DiskIo &io, uint32_t len);
+void release_disk_op(DiskIo &io, std::unique_ptr<DiskOp> op);
+
+void submit_disk_read(DiskIo &io, DiskOp &op, int fd, uint64_t offset, uint32_t len);
+// Writes the first len bytes of op.buf.
+void submit_disk_write(DiskIo &io, DiskOp &op, int fd, uint64_t offset, uint32_t len);
+// Completes once everything written to fd so far is on stable storage.
+void submit_disk_sync(DiskIo &io, DiskOp &op, int fd);
+// Runs task on a worker, for slow file work that does not fit the above.
+void run_disk_task(DiskIo &io, void (*task)(void *data), void *data);
+// Blocks until the operation is done. Used when abandoning a file.
+void wait_disk_op(DiskIo &io, DiskOp &op);
+
+// Reserves room for the file without writing it. Not an error if the
+// file system can not do it.
+bool preallocate_file(int fd, uint64_t offset, uint64_t len);
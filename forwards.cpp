@@ -15,18 +15,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include<glades.hpp>
 #include<forwards.hpp>
 #include<ssh_util.hpp>
 #include<util.hpp>
 #include<gio/gunixinputstream.h>
-
-enum PortForwardingColumns {
-    HOST_COLUMN,
-    LOCAL_PORT_COLUMN,
-    REMOTE_PORT_COLUMN,
-    PF_N_COLUMNS,
-};
+#include<algorithm>
 
 SshChannel open_forward_channel(PortForwardings &pf, int local_port, int remote_port, const char *source_host, const char *remote_host) {
     SshChannel forward_channel(pf.session, ssh_channel_new(pf.session));
@@ -44,208 +37,371 @@ SshChannel open_forward_channel(PortForwardings &pf, int local_port, int remote_
     return forward_channel;
 }
 
-gboolean network_socket_has_data(GIOChannel *source, GIOCondition /*condition*/, gpointer data) {
-    ForwardState *fs = reinterpret_cast<ForwardState*>(data);
-    int read_bytes = g_input_stream_read(fs->istream, fs->from_network, FORW_BLOCK_SIZE, nullptr, nullptr);
-    if(read_bytes > 0) {
-        auto written_bytes = ssh_channel_write(fs->channel, fs->from_network, read_bytes);
-        if(written_bytes != read_bytes) {
-            printf("Error writing: %s\n", ssh_get_error(ssh_channel_get_session(fs->channel)));
-            // FIXME error out?
+// Returns false if the connection is broken.
+static bool read_network(ForwardState &fs) {
+    while(!fs.network_eof) {
+        size_t len;
+        char *buf = ring_write_ptr(fs.to_channel, FORW_READ_SIZE, len);
+        if(len == 0) {
+            break;
         }
-    } else {
-        close_forwarded_connection(fs);
-        return FALSE;
+        GError *err = nullptr;
+        gssize read_bytes = g_pollable_input_stream_read_nonblocking(G_POLLABLE_INPUT_STREAM(fs.istream),
+                                                                     buf, len, nullptr, &err);
+        if(read_bytes < 0) {
+            bool again = g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+            if(!again) {
+                printf("Error reading forwarded connection: %s\n", err->message);
+            }
+            g_error_free(err);
+            return again;
+        }
+        if(read_bytes == 0) {
+            fs.network_eof = true;
+            break;
+        }
+        ring_commit(fs.to_channel, read_bytes);
     }
-    return TRUE;
+    return true;
 }
 
-gboolean incoming_connection(GSocketService */*service*/, GSocketConnection *connection, GObject */*source_object*/, gpointer user_data) {
-    PortForwardings &pf = *reinterpret_cast<PortForwardings*>(user_data);
-    GValue val = G_VALUE_INIT;
-    GtkTreeIter iter;
-    GInetSocketAddress *local_address = G_INET_SOCKET_ADDRESS(g_socket_connection_get_local_address(connection, nullptr));
-    int local_port = g_inet_socket_address_get_port(local_address);
-    int remote_port;
-    g_object_unref(G_OBJECT(local_address));
-
-    const char *remote_host;
-    bool found = false;
-    gtk_tree_model_get_iter_first(GTK_TREE_MODEL(pf.forward_list), &iter);
-    do {
-        gtk_tree_model_get_value(GTK_TREE_MODEL(pf.forward_list), &iter, LOCAL_PORT_COLUMN, &val);
-        g_assert(G_VALUE_HOLDS_INT(&val));
-        int current_port = g_value_get_int(&val);
-        if(local_port == current_port) {
-            found = true;
+static bool flush_to_channel(ForwardState &fs) {
+    while(fs.to_channel.used > 0) {
+        // Writing more than the window would block until the server
+        // makes room.
+        uint32_t window = ssh_channel_window_size(fs.channel);
+        if(window == 0) {
             break;
         }
-    } while(gtk_tree_model_iter_next(GTK_TREE_MODEL(pf.forward_list), &iter));
-    g_value_unset(&val);
-    if(!found) {
-        return TRUE;
+        size_t len;
+        const char *buf = ring_read_ptr(fs.to_channel, len);
+        auto written_bytes = ssh_channel_write(fs.channel, buf, std::min<size_t>(len, window));
+        if(written_bytes == SSH_ERROR) {
+            printf("Error writing: %s\n", ssh_get_error(ssh_channel_get_session(fs.channel)));
+            return false;
+        }
+        if(written_bytes == 0) {
+            break;
+        }
+        ring_consume(fs.to_channel, written_bytes);
+        fs.counters.bytes_out += written_bytes;
+        fs.counters.writes++;
     }
-    gtk_tree_model_get_value(GTK_TREE_MODEL(pf.forward_list), &iter, REMOTE_PORT_COLUMN, &val);
-    g_assert(G_VALUE_HOLDS_INT(&val));
-    remote_port = g_value_get_int(&val);
-    g_value_unset(&val);
-    gtk_tree_model_get_value(GTK_TREE_MODEL(pf.forward_list), &iter, HOST_COLUMN, &val);
-    g_assert(G_VALUE_HOLDS_STRING(&val));
-    remote_host = g_value_get_string(&val);
+    if(fs.network_eof && fs.to_channel.used == 0 && !fs.channel_eof_sent) {
+        ssh_channel_send_eof(fs.channel);
+        fs.channel_eof_sent = true;
+    }
+    return true;
+}
 
-    GInetSocketAddress *source_address = G_INET_SOCKET_ADDRESS(g_socket_connection_get_remote_address(connection, nullptr));
-    const char *source_address_string = g_inet_address_to_string(g_inet_socket_address_get_address(source_address));
+static bool read_channel(ForwardState &fs) {
+    while(!fs.channel_eof) {
+        size_t len;
+        char *buf = ring_write_ptr(fs.to_network, FORW_READ_SIZE, len);
+        if(len == 0) {
+            // Not reading lets the channel window close, which stops the
+            // server until the client catches up.
+            break;
+        }
+        auto num_read = ssh_channel_read_nonblocking(fs.channel, buf, len, 0);
+        if(num_read == SSH_EOF) {
+            fs.channel_eof = true;
+            break;
+        }
+        if(num_read == SSH_AGAIN) {
+            break;
+        }
+        if(num_read < 0) {
+            printf("Error reading reply: %s\n", ssh_get_error(fs.parent->session));
+            return false;
+        }
+        if(num_read == 0) {
+            if(ssh_channel_is_eof(fs.channel)) {
+                fs.channel_eof = true;
+            }
+            break;
+        }
+        ring_commit(fs.to_network, num_read);
+        fs.counters.bytes_in += num_read;
+        fs.counters.reads++;
+    }
+    return true;
+}
 
-    auto channel = open_forward_channel(pf, local_port, remote_port, source_address_string, remote_host);
-    // Can't be released earlier as they hold the actual data used by the above function call.
-    g_object_unref(source_address);
-    g_value_unset(&val);
-    if(channel == nullptr) {
+static bool flush_to_network(ForwardState &fs) {
+    while(fs.to_network.used > 0) {
+        size_t len;
+        const char *buf = ring_read_ptr(fs.to_network, len);
+        GError *err = nullptr;
+        gssize written_bytes = g_pollable_output_stream_write_nonblocking(G_POLLABLE_OUTPUT_STREAM(fs.ostream),
+                                                                          buf, len, nullptr, &err);
+        if(written_bytes < 0) {
+            bool again = g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+            if(!again) {
+                printf("Error writing to forwarded connection: %s\n", err->message);
+            }
+            g_error_free(err);
+            return again;
+        }
+        ring_consume(fs.to_network, written_bytes);
+    }
+    if(fs.channel_eof && !fs.network_shut) {
+        g_socket_shutdown(g_socket_connection_get_socket(fs.socket_connection), FALSE, TRUE, nullptr);
+        fs.network_shut = true;
+    }
+    return true;
+}
+
+static bool forward_finished(ForwardState &fs) {
+    if(fs.channel_eof_sent && fs.network_shut) {
+        return true;
+    }
+    // Whatever the server sent before closing is still delivered.
+    return ssh_channel_is_closed(fs.channel) && fs.to_network.used == 0;
+}
+
+static GIOCondition wanted_condition(const ForwardState &fs) {
+    int cond = 0;
+    if(!fs.network_eof && ring_free(fs.to_channel) > 0) {
+        cond |= G_IO_IN;
+    }
+    if(fs.to_network.used > 0) {
+        cond |= G_IO_OUT;
+    }
+    return (GIOCondition) cond;
+}
+
+gboolean network_socket_ready(GIOChannel *source, GIOCondition condition, gpointer data);
+
+// Polls the socket only for what can be done right now.
+static void watch_socket(ForwardState &fs) {
+    GIOCondition cond = wanted_condition(fs);
+    if(fs.network_watch_id && cond == fs.watch_condition) {
+        return;
+    }
+    if(fs.network_watch_id) {
+        thread_source_remove(fs.network_watch_id);
+        fs.network_watch_id = 0;
+    }
+    fs.watch_condition = cond;
+    if(cond) {
+        fs.network_watch_id = thread_io_add_watch(fs.network_channel, cond, (GIOFunc) network_socket_ready, &fs);
+    }
+}
+
+gboolean network_socket_ready(GIOChannel */*source*/, GIOCondition condition, gpointer data) {
+    ForwardState *fs = reinterpret_cast<ForwardState*>(data);
+    bool ok = true;
+    if(condition & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+        ok = read_network(*fs) && flush_to_channel(*fs);
+    }
+    if(ok && (condition & G_IO_OUT)) {
+        // Room in the buffer lets in what libssh held back.
+        ok = flush_to_network(*fs) && read_channel(*fs) && flush_to_network(*fs);
+    }
+    if(!ok || forward_finished(*fs)) {
+        // Returning FALSE removes this source.
+        fs->network_watch_id = 0;
+        close_forwarded_connection(fs);
+        return FALSE;
+    }
+    if(wanted_condition(*fs) == fs->watch_condition) {
         return TRUE;
     }
+    fs->network_watch_id = 0;
+    watch_socket(*fs);
+    return FALSE;
+}
+
+gboolean dispatch_forwards(gpointer data) {
+    PortForwardings &pf = *reinterpret_cast<PortForwardings*>(data);
+    pf.dispatch_source = 0;
+    feed_forwards(pf);
+    return G_SOURCE_REMOVE;
+}
+
+// Packets may be processed by any libssh call, so the work is always
+// deferred to the I/O thread's loop.
+static void mark_dirty(ForwardState &fs) {
+    PortForwardings &pf = *fs.parent;
+    if(!fs.dirty) {
+        fs.dirty = true;
+        pf.dirty.push_back(fs.handle);
+    }
+    if(pf.dispatch_source == 0) {
+        pf.dispatch_source = thread_idle_add(dispatch_forwards, &pf);
+    }
+}
+
+int channel_data_arrived(ssh_session, ssh_channel, void *, uint32_t, int, void *userdata) {
+    mark_dirty(*reinterpret_cast<ForwardState*>(userdata));
+    // Left in the channel buffer until read_channel has room for it.
+    return 0;
+}
+
+void channel_changed(ssh_session, ssh_channel, void *userdata) {
+    mark_dirty(*reinterpret_cast<ForwardState*>(userdata));
+}
+
+int channel_window_opened(ssh_session, ssh_channel, uint32_t, void *userdata) {
+    mark_dirty(*reinterpret_cast<ForwardState*>(userdata));
+    return 0;
+}
+
+ForwardState* relay_connection(ForwardRule &rule, GSocketConnection *connection, SshChannel &&channel) {
+    PortForwardings &pf = *rule.parent;
     g_object_ref(G_OBJECT(connection));
-    pf.ongoing.emplace_back(std::make_unique<ForwardState>());
-    ForwardState *fs = pf.ongoing.back().get();
+    SlotHandle handle = pf.connections.add();
+    ForwardState *fs = pf.connections.get(handle);
+    // The slot may have been used before, every field is set here.
+    fs->handle = handle;
     fs->parent = &pf;
+    fs->rule = &rule;
+    fs->id = ++rule.accepted;
+    rule.connections.insert(fs);
     fs->istream = g_io_stream_get_input_stream(G_IO_STREAM(connection));
     fs->ostream = g_io_stream_get_output_stream(G_IO_STREAM(connection));
     fs->channel = std::move(channel);
     fs->socket_connection = connection;
-    fs->port = local_port;
+    fs->counters = ChannelCounters();
+    fs->port = rule.local_port;
+    ring_init(fs->to_channel, FORW_BUFFER_INITIAL, FORW_BUFFER_MAX);
+    ring_init(fs->to_network, FORW_BUFFER_INITIAL, FORW_BUFFER_MAX);
+    fs->network_eof = false;
+    fs->channel_eof = false;
+    fs->channel_eof_sent = false;
+    fs->network_shut = false;
     gint fd = g_socket_get_fd(g_socket_connection_get_socket(connection));
     fs->network_channel = g_io_channel_unix_new(fd);
-    fs->network_watch_id = g_io_add_watch(fs->network_channel, G_IO_IN, (GIOFunc) network_socket_has_data, fs);
-
-    return TRUE;
+    fs->network_watch_id = 0;
+    fs->watch_condition = (GIOCondition) 0;
+    fs->dirty = false;
+    ssh_callbacks_init(&fs->callbacks);
+    fs->callbacks.userdata = fs;
+    fs->callbacks.channel_data_function = channel_data_arrived;
+    fs->callbacks.channel_eof_function = channel_changed;
+    fs->callbacks.channel_close_function = channel_changed;
+    fs->callbacks.channel_write_wontblock_function = channel_window_opened;
+    ssh_set_channel_callbacks(fs->channel, &fs->callbacks);
+    watch_socket(*fs);
+    return fs;
 }
 
-void open_new_forwarding(GtkMenuItem*, gpointer data) {
-    PortForwardings &pf = *reinterpret_cast<PortForwardings*>(data);
-    gtk_widget_show_all(GTK_WIDGET(pf.createWindow));
-}
+gboolean incoming_connection(GSocketService */*service*/, GSocketConnection *connection, GObject */*source_object*/, gpointer user_data) {
+    ForwardRule &rule = *reinterpret_cast<ForwardRule*>(user_data);
+    PortForwardings &pf = *rule.parent;
+    int local_port = rule.local_port;
+    int remote_port = rule.remote_port;
+    const char *remote_host = rule.host.c_str();
 
-void delete_forwarding(GtkMenuItem*, gpointer data) {
-    PortForwardings &pf = *reinterpret_cast<PortForwardings*>(data);
-    GtkTreeSelection *sel = gtk_tree_view_get_selection(pf.forwardings);
-    GtkTreeIter iter;
-    GtkTreeModel *m = nullptr;
-    if(gtk_tree_selection_get_selected(sel, &m, &iter)) {
-        auto path = gtk_tree_model_get_path(m, &iter);
-        int row = gtk_tree_path_get_indices(path)[0];
-        // FIXME delete ongoing connections for this rule.
-        gtk_tree_path_free(path);
-        gtk_list_store_remove(pf.forward_list, &iter);
+    GInetSocketAddress *source_address = G_INET_SOCKET_ADDRESS(g_socket_connection_get_remote_address(connection, nullptr));
+    const char *source_address_string = g_inet_address_to_string(g_inet_socket_address_get_address(source_address));
+
+    auto channel = open_forward_channel(pf, local_port, remote_port, source_address_string, remote_host);
+    // Can't be released earlier as it holds the actual data used by the above function call.
+    g_object_unref(source_address);
+    if(channel == nullptr) {
+        return TRUE;
     }
+    relay_connection(rule, connection, std::move(channel));
+    return TRUE;
+}
 
+bool add_forward_rule(PortForwardings &pf, int local_port, int remote_port, const char *host) {
+    if(pf.rules.find(local_port) != pf.rules.end()) {
+        printf("Port %d is already forwarded.\n", local_port);
+        return false;
+    }
+    std::unique_ptr<ForwardRule> rule(new ForwardRule());
+    rule->parent = &pf;
+    rule->local_port = local_port;
+    rule->remote_port = remote_port;
+    rule->host = host;
+    rule->listener = g_socket_service_new();
+    GError *err = nullptr;
+    if(!g_socket_listener_add_inet_port(G_SOCKET_LISTENER(rule->listener), local_port, nullptr, &err)) {
+        printf("Could not listen on port %d: %s\n", local_port, err->message);
+        g_error_free(err);
+        g_object_unref(G_OBJECT(rule->listener));
+        return false;
+    }
+    g_signal_connect(G_OBJECT(rule->listener), "incoming", G_CALLBACK(incoming_connection), rule.get());
+    pf.rules[local_port] = std::move(rule);
+    return true;
 }
 
-void create_new_forwarding(GtkMenuItem*, gpointer data) {
-    PortForwardings &pf = *reinterpret_cast<PortForwardings*>(data);
-    GtkTreeIter iter;
-    gtk_widget_hide(GTK_WIDGET(pf.createWindow));
-    int local_port = gtk_spin_button_get_value_as_int(pf.local_spin);
-    int remote_port = gtk_spin_button_get_value_as_int(pf.remote_spin);
-    const gchar *host = gtk_entry_get_text(pf.host_entry);
-    if(host == nullptr || host[0] == '\0') {
+void remove_forward_rule(PortForwardings &pf, int local_port) {
+    auto it = pf.rules.find(local_port);
+    if(it == pf.rules.end()) {
         return;
     }
-    // FIXME, check that there is not already a forwarding for the
-    // given port.
-    if(g_socket_listener_add_inet_port(G_SOCKET_LISTENER(pf.listener), local_port, nullptr, nullptr)) {
-        gtk_list_store_append(pf.forward_list, &iter);
-        gtk_list_store_set(pf.forward_list, &iter,
-                           HOST_COLUMN, host,
-                           LOCAL_PORT_COLUMN, local_port,
-                           REMOTE_PORT_COLUMN, remote_port,
-                          -1);
-    } else {
-        // FIXME add errors here.
+    ForwardRule &rule = *it->second;
+    g_socket_service_stop(rule.listener);
+    g_socket_listener_close(G_SOCKET_LISTENER(rule.listener));
+    g_object_unref(G_OBJECT(rule.listener));
+    // Closing removes the connection from the set.
+    std::vector<ForwardState*> connections(rule.connections.begin(), rule.connections.end());
+    for(auto fs : connections) {
+        close_forwarded_connection(fs);
     }
+    pf.rules.erase(it);
 }
 
-void close_new_fw_window(GtkMenuItem*, gpointer data) {
-    PortForwardings &pf = *reinterpret_cast<PortForwardings*>(data);
-    gtk_widget_hide(GTK_WIDGET(pf.createWindow));
-}
-
-void build_port_gui(PortForwardings &pf) {
-    GtkBuilder *portBuilder = gtk_builder_new_from_string((const gchar*)forwardings, sizeof(forwardings));
-    GtkBuilder *newPortBuilder = gtk_builder_new_from_string((const gchar*)createforwarding, sizeof(createforwarding));
-
-    pf.forwardingBuilder = portBuilder;
-    pf.newBuilder = newPortBuilder;
-
-    pf.forwardWindow = GTK_WINDOW(gtk_builder_get_object(portBuilder, "forwarding_window"));
-    pf.createWindow = GTK_WINDOW(gtk_builder_get_object(newPortBuilder, "create_forwarding_window"));
-    pf.forwardings = GTK_TREE_VIEW(gtk_builder_get_object(portBuilder, "forwards_view"));
-    pf.forward_list = gtk_list_store_new(PF_N_COLUMNS, G_TYPE_STRING, G_TYPE_INT, G_TYPE_INT);
-
-    pf.create_button = GTK_BUTTON(gtk_builder_get_object(portBuilder, "create_button"));
-    pf.delete_button = GTK_BUTTON(gtk_builder_get_object(portBuilder, "delete_button"));
-
-    pf.host_entry = GTK_ENTRY(gtk_builder_get_object(newPortBuilder, "host_entry"));
-    pf.remote_spin = GTK_SPIN_BUTTON(gtk_builder_get_object(newPortBuilder, "remote_spin"));
-    pf.local_spin = GTK_SPIN_BUTTON(gtk_builder_get_object(newPortBuilder, "local_spin"));
-    pf.ok_button = GTK_BUTTON(gtk_builder_get_object(newPortBuilder, "ok_button"));
-    pf.cancel_button = GTK_BUTTON(gtk_builder_get_object(newPortBuilder, "cancel_button"));
-
-    g_signal_connect(G_OBJECT(pf.create_button), "clicked", G_CALLBACK(open_new_forwarding), &pf);
-    g_signal_connect(G_OBJECT(pf.delete_button), "clicked", G_CALLBACK(delete_forwarding), &pf);
-    g_signal_connect(G_OBJECT(pf.ok_button), "clicked", G_CALLBACK(create_new_forwarding), &pf);
-    g_signal_connect(G_OBJECT(pf.cancel_button), "clicked", G_CALLBACK(close_new_fw_window), &pf);
-
-    // Connect view to model.
-    gtk_tree_view_set_headers_visible(pf.forwardings, TRUE);
-    gtk_tree_view_set_model(pf.forwardings, GTK_TREE_MODEL(pf.forward_list));
-    gtk_tree_view_append_column(pf.forwardings,
-                gtk_tree_view_column_new_with_attributes("Hostname",
-                gtk_cell_renderer_text_new(), "text", HOST_COLUMN, nullptr));
-    gtk_tree_view_append_column(pf.forwardings,
-                gtk_tree_view_column_new_with_attributes("Local port",
-                gtk_cell_renderer_text_new(), "text", LOCAL_PORT_COLUMN, nullptr));
-    gtk_tree_view_append_column(pf.forwardings,
-                gtk_tree_view_column_new_with_attributes("Remote port",
-                gtk_cell_renderer_text_new(), "text", REMOTE_PORT_COLUMN, nullptr));
-    gtk_tree_selection_set_mode(gtk_tree_view_get_selection(pf.forwardings), GTK_SELECTION_SINGLE);
-
-    pf.listener = g_socket_service_new();
-    g_signal_connect(G_OBJECT(pf.listener), "incoming", G_CALLBACK(incoming_connection), &pf);
-}
-
-bool feed_forwards(PortForwardings &pf) {
-    bool read_data = false;
-    for(const auto &f : pf.ongoing) {
-        auto num_read = ssh_channel_read_nonblocking(f->channel, f->from_channel, FORW_BLOCK_SIZE, 0);
-        if(num_read == SSH_AGAIN) {
-            continue;
-        }
-        if(num_read < 0) {
-            printf("Error reading reply: %s\n", ssh_get_error(pf.session));
-            // FIXME, close connection.
+void feed_forwards(PortForwardings &pf) {
+    // Serving one connection can run callbacks that mark others, those
+    // are picked up by the next round.
+    for(int round=0; round<FORW_MAX_ROUNDS && !pf.dirty.empty(); round++) {
+        std::vector<SlotHandle> dirty;
+        dirty.swap(pf.dirty);
+        for(auto h : dirty) {
+            ForwardState *fs = pf.connections.get(h);
+            if(fs) {
+                fs->dirty = false;
+            }
         }
-        if(num_read > 0) {
-            read_data = true;
-            gsize bytes_written;
-            g_output_stream_write_all(f->ostream, f->from_channel, num_read, &bytes_written, nullptr, nullptr);
-            if(bytes_written != (gsize)num_read) {
-                // FIXME, close connection
+        for(auto h : dirty) {
+            // Closed since it was marked.
+            ForwardState *fs = pf.connections.get(h);
+            if(!fs) {
+                continue;
+            }
+            // Incoming window adjusts may let buffered data go out.
+            bool ok = read_channel(*fs) && flush_to_network(*fs) && flush_to_channel(*fs);
+            if(!ok || forward_finished(*fs)) {
+                close_forwarded_connection(fs);
+            } else {
+                watch_socket(*fs);
             }
         }
     }
-    return read_data;
 }
 
 bool close_forwarded_connection(ForwardState *fs) {
-    auto &ongoing = fs->parent->ongoing;
-    for(size_t i=0; i<ongoing.size(); i++) {
-        if(ongoing[i].get() == fs) {
-            g_input_stream_close(fs->istream, nullptr, nullptr);
-            g_output_stream_close(fs->ostream, nullptr, nullptr);
-            g_object_unref(G_OBJECT(fs->socket_connection));
-            g_io_channel_shutdown(fs->network_channel, TRUE, nullptr);
-            ongoing.erase(ongoing.begin()+i);
-            return true;
-        }
+    PortForwardings &pf = *fs->parent;
+    if(pf.connections.get(fs->handle) != fs) {
+        return false;
+    }
+    if(fs->network_watch_id) {
+        thread_source_remove(fs->network_watch_id);
     }
-    return false;
+    fs->rule->connections.erase(fs);
+    ChannelCounters &closed = fs->rule->closed;
+    closed.bytes_in += fs->counters.bytes_in;
+    closed.bytes_out += fs->counters.bytes_out;
+    closed.reads += fs->counters.reads;
+    closed.writes += fs->counters.writes;
+    ssh_remove_channel_callbacks(fs->channel, &fs->callbacks);
+    fs->channel = SshChannel();
+    // A handle left in the dirty list goes stale and is skipped.
+    g_input_stream_close(fs->istream, nullptr, nullptr);
+    g_output_stream_close(fs->ostream, nullptr, nullptr);
+    // The channel does not own the fd, the connection closes it.
+    g_io_channel_unref(fs->network_channel);
+    g_object_unref(G_OBJECT(fs->socket_connection));
+    // The next connection gets the buffers, unless they grew for a
+    // bulk transfer.
+    ring_recycle(fs->to_channel, FORW_BUFFER_INITIAL);
+    ring_recycle(fs->to_network, FORW_BUFFER_INITIAL);
+    pf.connections.remove(fs->handle);
+    return true;
 }
@@ -19,16 +19,61 @@
 
 #include<gtk/gtk.h>
 #include<ssh_util.hpp>
+#include<ringbuffer.hpp>
+#include<iothread.hpp>
+#include<slotmap.hpp>
+#include<libssh/callbacks.h>
 #include<vector>
 #include<memory>
+#include<string>
+#include<unordered_map>
+#include<unordered_set>
 
-const constexpr int FORW_BLOCK_SIZE = 1024;
+// Buffers start at this size and grow for bulk transfers.
+const constexpr size_t FORW_BUFFER_INITIAL = 16*1024;
+// When a buffer is this full the side filling it is no longer read.
+const constexpr size_t FORW_BUFFER_MAX = 1024*1024;
+// Space asked for before each read.
+const constexpr size_t FORW_READ_SIZE = 64*1024;
+// Times the dirty list is drained in one go before yielding to the main loop.
+const constexpr int FORW_MAX_ROUNDS = 8;
 
 struct PortForwardings;
+struct ForwardState;
 
+/*
+ * A local port that is forwarded to host:remote_port on the other side.
+ * Each rule has its own listener so it can be removed on its own,
+ * together with the connections it has accepted.
+ */
+struct ForwardRule {
+    PortForwardings *parent;
+    int local_port;
+    int remote_port;
+    std::string host;
+    GSocketService *listener;
+    std::unordered_set<ForwardState*> connections;
+    int accepted; // Also the id of the latest connection.
+    ChannelCounters closed; // Totals of the connections that have ended.
+};
+
+/*
+ * One forwarded connection. Both directions go through a buffer and
+ * neither side is ever written to with a blocking call. When a buffer
+ * is full, the side feeding it is not read any more: the local socket
+ * is no longer polled, or the channel is not read so the server runs
+ * out of window.
+ *
+ * The channel callbacks only mark the connection dirty, the work is
+ * done later by feed_forwards. They can fire from inside any libssh
+ * call, so they must not touch the buffers or close anything.
+ */
 struct ForwardState {
     PortForwardings *parent;
-    // Immovable because arrays are used for async operations.
+    ForwardRule *rule;
+    SlotHandle handle; // Of its slot in PortForwardings::connections.
+    int id;
+    // Immovable because the socket watch points to it.
     ForwardState() = default;
     ForwardState(const ForwardState&) = delete;
     ForwardState(ForwardState&&) = delete;
@@ -36,12 +81,20 @@ struct ForwardState {
     GInputStream *istream;
     GOutputStream *ostream;
     GSocketConnection *socket_connection;
-    char from_network[FORW_BLOCK_SIZE];
-    char from_channel[FORW_BLOCK_SIZE];
+    RingBuffer to_channel;
+    RingBuffer to_network;
     SshChannel channel;
+    ChannelCounters counters;
     int port;
     GIOChannel *network_channel;
     guint network_watch_id;
+    GIOCondition watch_condition;
+    struct ssh_channel_callbacks_struct callbacks;
+    bool dirty;
+    bool network_eof;      // The local client will not send more.
+    bool channel_eof;      // Nor will the server.
+    bool channel_eof_sent;
+    bool network_shut;
 };
 
 struct PortForwardings {
@@ -63,13 +116,30 @@ struct PortForwardings {
     GtkButton *ok_button;
     GtkButton *cancel_button;
 
-    GSocketService *listener;
+    IoThread *io;
+    // Everything below belongs to the I/O thread.
     ssh_session session;
-    std::vector<std::unique_ptr<ForwardState>> ongoing;
+    // The list store only shows these, keyed by local port.
+    std::unordered_map<int, std::unique_ptr<ForwardRule>> rules;
+    // Slots are reused, so bursts of short connections cost no
+    // allocations once the map has grown.
+    SlotMap<ForwardState> connections;
+    // Connections whose channel has had traffic since they were last
+    // served. Handles of connections closed meanwhile are stale.
+    std::vector<SlotHandle> dirty;
+    guint dispatch_source;
 };
 
+// The window is in forwardsgui.cpp, everything else works without GTK
+// so long as the widget pointers are not used.
 void build_port_gui(PortForwardings &pf);
 
-bool feed_forwards(PortForwardings &pf);
+void feed_forwards(PortForwardings &pf);
 
+SshChannel open_forward_channel(PortForwardings &pf, int local_port, int remote_port, const char *source_host, const char *remote_host);
+// Takes a reference to the connection and passes data both ways until
+// either side closes.
+ForwardState* relay_connection(ForwardRule &rule, GSocketConnection *connection, SshChannel &&channel);
 bool close_forwarded_connection(ForwardState *fs);
+bool add_forward_rule(PortForwardings &pf, int local_port, int remote_port, const char *host);
+void remove_forward_rule(PortForwardings &pf, int local_port);
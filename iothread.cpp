@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<iothread.hpp>
+
+#include<sys/eventfd.h>
+#include<unistd.h>
+#include<cstdio>
+
+// Tasks run per wakeup, so that a flood from the other side does not
+// keep GTK from redrawing.
+static const constexpr int IO_TASKS_PER_WAKEUP = 256;
+
+static void wake(TaskQueue &q) {
+    if(q.wake_pending.exchange(true)) {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t r = write(q.wake_fd, &one, sizeof(one));
+    (void)r;
+}
+
+static void push_task(TaskQueue &q, IoTask &&task) {
+    // Only the receiver clears the flag, so if it is not set here it
+    // stays that way until we set it.
+    if(!q.overflowed.load(std::memory_order_acquire) && q.ring.push(std::move(task))) {
+        wake(q);
+        return;
+    }
+    g_mutex_lock(&q.overflow_lock);
+    if(!q.overflowed.load(std::memory_order_relaxed) && q.ring.push(std::move(task))) {
+        // The receiver emptied the overflow while we were waiting.
+    } else {
+        // Everything goes here until the receiver has taken it all, so
+        // that tasks stay in order.
+        q.overflow.push_back(std::move(task));
+        q.overflowed.store(true, std::memory_order_release);
+    }
+    g_mutex_unlock(&q.overflow_lock);
+    wake(q);
+}
+
+static bool take_overflow(TaskQueue &q) {
+    if(!q.overflowed.load(std::memory_order_acquire)) {
+        return false;
+    }
+    // The sender may have filled the ring again after we found it empty,
+    // but while the flag is set it only adds to the overflow. Whatever is
+    // in the ring was sent before the overflow, so it goes first.
+    g_mutex_lock(&q.overflow_lock);
+    IoTask task;
+    while(q.ring.pop(task)) {
+        q.backlog.push_back(std::move(task));
+    }
+    for(auto &t : q.overflow) {
+        q.backlog.push_back(std::move(t));
+    }
+    q.overflow.clear();
+    q.overflowed.store(false, std::memory_order_release);
+    g_mutex_unlock(&q.overflow_lock);
+    return !q.backlog.empty();
+}
+
+static void run_tasks(TaskQueue &q) {
+    uint64_t count;
+    ssize_t r = read(q.wake_fd, &count, sizeof(count));
+    (void)r;
+    // Clearing the flag first means a task pushed from now on wakes us
+    // again. The exchange also makes its data visible to us.
+    q.wake_pending.exchange(false);
+    IoTask task;
+    for(int i=0; i<IO_TASKS_PER_WAKEUP; i++) {
+        if(!q.backlog.empty()) {
+            task = std::move(q.backlog.front());
+            q.backlog.pop_front();
+        } else if(!q.ring.pop(task)) {
+            if(!take_overflow(q)) {
+                return;
+            }
+            continue;
+        }
+        task();
+        task = nullptr;
+    }
+    wake(q);
+}
+
+static gboolean io_wakeup(GIOChannel *, GIOCondition, gpointer data) {
+    IoThread &io = *reinterpret_cast<IoThread*>(data);
+    run_tasks(io.to_io);
+    return TRUE;
+}
+
+static gboolean ui_wakeup(GIOChannel *, GIOCondition, gpointer data) {
+    IoThread &io = *reinterpret_cast<IoThread*>(data);
+    run_tasks(io.to_ui);
+    return TRUE;
+}
+
+static bool init_queue(TaskQueue &q) {
+    q.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(q.wake_fd < 0) {
+        return false;
+    }
+    q.ring.head = 0;
+    q.ring.tail = 0;
+    g_mutex_init(&q.overflow_lock);
+    q.overflowed = false;
+    q.wake_pending = false;
+    q.wake_channel = g_io_channel_unix_new(q.wake_fd);
+    return true;
+}
+
+static void close_queue(TaskQueue &q) {
+    g_io_channel_unref(q.wake_channel);
+    close(q.wake_fd);
+    g_mutex_clear(&q.overflow_lock);
+    q.overflow.clear();
+    q.backlog.clear();
+    IoTask task;
+    while(q.ring.pop(task)) {
+    }
+}
+
+static gpointer io_thread_main(gpointer data) {
+    IoThread &io = *reinterpret_cast<IoThread*>(data);
+    // Sources that the engine code adds from here go to our context.
+    g_main_context_push_thread_default(io.context);
+    GSource *source = g_io_create_watch(io.to_io.wake_channel, G_IO_IN);
+    g_source_set_callback(source, (GSourceFunc) io_wakeup, &io, nullptr);
+    g_source_attach(source, io.context);
+    g_source_unref(source);
+    g_main_loop_run(io.loop);
+    g_main_context_pop_thread_default(io.context);
+    return nullptr;
+}
+
+bool start_io_thread(IoThread &io) {
+    io.thread = nullptr;
+    if(!init_queue(io.to_io)) {
+        // Everything then simply runs on the main thread.
+        printf("Could not create eventfd, running without an I/O thread.\n");
+        return false;
+    }
+    if(!init_queue(io.to_ui)) {
+        printf("Could not create eventfd, running without an I/O thread.\n");
+        close_queue(io.to_io);
+        return false;
+    }
+    io.context = g_main_context_new();
+    io.loop = g_main_loop_new(io.context, FALSE);
+    io.ui_wake_watch = g_io_add_watch(io.to_ui.wake_channel, G_IO_IN, ui_wakeup, &io);
+    io.thread = g_thread_new("ssh-io", io_thread_main, &io);
+    return true;
+}
+
+void stop_io_thread(IoThread &io) {
+    if(!io.thread) {
+        return;
+    }
+    GMainLoop *loop = io.loop;
+    run_on_io(io, [loop]() { g_main_loop_quit(loop); });
+    g_thread_join(io.thread);
+    io.thread = nullptr;
+    g_source_remove(io.ui_wake_watch);
+    close_queue(io.to_io);
+    close_queue(io.to_ui);
+    g_main_loop_unref(io.loop);
+    g_main_context_unref(io.context);
+}
+
+void run_on_io(IoThread &io, IoTask task) {
+    if(!io.thread || g_thread_self() == io.thread) {
+        task();
+        return;
+    }
+    push_task(io.to_io, std::move(task));
+}
+
+void run_on_ui(IoThread &io, IoTask task) {
+    if(!io.thread || g_thread_self() != io.thread) {
+        task();
+        return;
+    }
+    push_task(io.to_ui, std::move(task));
+}
+
+size_t queued_tasks(TaskQueue &q) {
+    // Head first, the tail can only have moved further since.
+    size_t head = q.ring.head.load(std::memory_order_acquire);
+    size_t n = q.ring.tail.load(std::memory_order_acquire) - head;
+    if(q.overflowed.load(std::memory_order_acquire)) {
+        g_mutex_lock(&q.overflow_lock);
+        n += q.overflow.size();
+        g_mutex_unlock(&q.overflow_lock);
+    }
+    return n;
+}
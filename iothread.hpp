@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<glib.h>
+#include<atomic>
+#include<functional>
+#include<deque>
+#include<cstddef>
+
+// Tasks that fit in each direction before the slower overflow list is used.
+static const constexpr size_t IO_QUEUE_SIZE = 4096;
+
+/*
+ * A fixed size queue with exactly one thread pushing and one popping.
+ * Neither side ever takes a lock.
+ */
+template<typename T, size_t N>
+struct SpscQueue {
+    static_assert((N & (N-1)) == 0, "Queue size must be a power of two.");
+
+    T items[N];
+    std::atomic<size_t> head; // Next to pop, only written by the consumer.
+    std::atomic<size_t> tail; // Next to push, only written by the producer.
+
+    bool push(T &&item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        items[t & (N-1)] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(items[h & (N-1)]);
+        // Whatever the task held is released now rather than when the
+        // slot is reused.
+        items[h & (N-1)] = T();
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+typedef std::function<void()> IoTask;
+
+/*
+ * Tasks going to one thread. Normally they only pass through the ring.
+ * If it fills up the sender does not wait, as the receiver may just as
+ * well be busy sending to it, but puts the rest in the overflow list
+ * until the receiver has caught up. The receiver is woken through
+ * its eventfd only when the queue goes from empty to not empty, so a
+ * busy link costs one wakeup per batch rather than per task.
+ */
+struct TaskQueue {
+    SpscQueue<IoTask, IO_QUEUE_SIZE> ring;
+    GMutex overflow_lock;
+    std::deque<IoTask> overflow;
+    std::atomic<bool> overflowed;
+    std::deque<IoTask> backlog; // Taken from the overflow, receiver only.
+    std::atomic<bool> wake_pending;
+    int wake_fd;
+    GIOChannel *wake_channel;
+};
+
+/*
+ * The thread that owns the SSH session and everything that uses it:
+ * the terminal channel, SFTP, transfers and forwards. GTK stays on the
+ * main thread. The two only talk by passing tasks to each other.
+ *
+ * Code running on the I/O thread attaches its sources to the thread
+ * default context, see the thread_* helpers in util.hpp.
+ */
+struct IoThread {
+    GMainContext *context;
+    GMainLoop *loop;
+    GThread *thread;
+    TaskQueue to_io;
+    TaskQueue to_ui;
+    guint ui_wake_watch;
+};
+
+bool start_io_thread(IoThread &io);
+void stop_io_thread(IoThread &io);
+
+// If the caller is already on the target thread, or the I/O thread
+// could not be started, the task runs right away.
+void run_on_io(IoThread &io, IoTask task);
+void run_on_ui(IoThread &io, IoTask task);
+
+// Tasks sent but not yet taken by the receiver, from either thread. The
+// backlog is the receiver's own and not counted.
+size_t queued_tasks(TaskQueue &q);
@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<journal.hpp>
+#include<cstdio>
+#include<cstring>
+#include<cerrno>
+#include<fcntl.h>
+#include<sys/file.h>
+#include<unistd.h>
+
+static std::string journal_dir() {
+    gchar *dir = g_build_filename(g_get_user_data_dir(), "sshthingy", nullptr);
+    std::string result(dir);
+    g_free(dir);
+    return result;
+}
+
+static std::string owner_path(const std::string &owner) {
+    return journal_dir() + "/owners/" + owner;
+}
+
+static void lock_file(int fd, int operation) {
+    while(fd >= 0 && flock(fd, operation) != 0 && errno == EINTR) {
+    }
+}
+
+// The owner's file is locked for as long as its process runs.
+static bool owner_alive(const TransferJournal &j, const std::string &owner) {
+    if(owner.empty()) {
+        return false;
+    }
+    if(owner == j.owner) {
+        return true;
+    }
+    std::string path = owner_path(owner);
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    bool alive = flock(fd, LOCK_EX | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+    if(!alive) {
+        unlink(path.c_str());
+    }
+    close(fd);
+    return alive;
+}
+
+static void save_journal(TransferJournal &j, GKeyFile *kf) {
+    GError *err = nullptr;
+    if(!g_key_file_save_to_file(kf, j.fname.c_str(), &err)) {
+        printf("Could not write transfer journal: %s\n", err->message);
+        g_error_free(err);
+    }
+}
+
+static GKeyFile* load_journal(const TransferJournal &j) {
+    GKeyFile *kf = g_key_file_new();
+    // A missing file just means that there is nothing to resume.
+    g_key_file_load_from_file(kf, j.fname.c_str(), G_KEY_FILE_NONE, nullptr);
+    return kf;
+}
+
+// Changes only set or remove keys, so applying them again to a file
+// that already has them changes nothing.
+static void apply_change(GKeyFile *kf, const JournalChange &c) {
+    const gchar *group = c.entry.id.c_str();
+    switch(c.type) {
+    case JOURNAL_ADD:
+        g_key_file_set_string(kf, group, "session", c.session_key.c_str());
+        g_key_file_set_boolean(kf, group, "upload", c.entry.upload);
+        g_key_file_set_string(kf, group, "local", c.entry.local_path.c_str());
+        g_key_file_set_string(kf, group, "remote", c.entry.remote_path.c_str());
+        g_key_file_set_uint64(kf, group, "size", c.entry.size);
+        g_key_file_set_int64(kf, group, "mtime", c.entry.mtime);
+        g_key_file_set_uint64(kf, group, "offset", c.entry.offset);
+        break;
+    case JOURNAL_UPDATE:
+        if(g_key_file_has_group(kf, group)) {
+            g_key_file_set_uint64(kf, group, "offset", c.entry.offset);
+        }
+        break;
+    case JOURNAL_REMOVE:
+        g_key_file_remove_group(kf, group, nullptr);
+        break;
+    }
+}
+
+// What the file will look like once our changes are in. Other processes
+// replace the file atomically, so it can be read without the lock.
+static GKeyFile* journal_view(TransferJournal &j) {
+    // Under the lock so that the worker can not finish a write between
+    // us reading the file and looking at what it was writing.
+    g_mutex_lock(&j.lock);
+    GKeyFile *kf = load_journal(j);
+    for(const auto &c : j.writing) {
+        apply_change(kf, c);
+    }
+    for(const auto &c : j.pending) {
+        apply_change(kf, c);
+    }
+    g_mutex_unlock(&j.lock);
+    return kf;
+}
+
+// Runs on a disk worker until nothing is left to write.
+static void flush_journal(void *data) {
+    TransferJournal &j = *reinterpret_cast<TransferJournal*>(data);
+    g_mutex_lock(&j.lock);
+    while(!j.pending.empty()) {
+        j.writing.swap(j.pending);
+        g_mutex_unlock(&j.lock);
+        // Other processes may have changed the file since we last saw it.
+        lock_file(j.lock_fd, LOCK_EX);
+        GKeyFile *kf = load_journal(j);
+        for(const auto &c : j.writing) {
+            apply_change(kf, c);
+        }
+        save_journal(j, kf);
+        lock_file(j.lock_fd, LOCK_UN);
+        g_key_file_free(kf);
+        g_mutex_lock(&j.lock);
+        j.writing.clear();
+    }
+    j.flushing = false;
+    g_cond_broadcast(&j.flushed);
+    g_mutex_unlock(&j.lock);
+}
+
+static void queue_change(TransferJournal &j, JournalChange &&c) {
+    g_mutex_lock(&j.lock);
+    j.pending.push_back(std::move(c));
+    bool start = !j.flushing;
+    j.flushing = true;
+    g_mutex_unlock(&j.lock);
+    if(start) {
+        run_disk_task(*j.io, flush_journal, &j);
+    }
+}
+
+static GKeyFile* lock_claims(TransferJournal &j) {
+    lock_file(j.claims_fd, LOCK_EX);
+    GKeyFile *claims = g_key_file_new();
+    std::string data;
+    char buf[4096];
+    ssize_t r;
+    off_t offset = 0;
+    while(j.claims_fd >= 0 && (r = pread(j.claims_fd, buf, sizeof(buf), offset)) > 0) {
+        data.append(buf, r);
+        offset += r;
+    }
+    g_key_file_load_from_data(claims, data.data(), data.size(), G_KEY_FILE_NONE, nullptr);
+    return claims;
+}
+
+static void unlock_claims(TransferJournal &j, GKeyFile *claims, bool changed) {
+    if(changed && j.claims_fd >= 0) {
+        // Claims of dead processes are dropped while we are at it.
+        gchar **ids = g_key_file_get_keys(claims, "claims", nullptr, nullptr);
+        for(gchar **id = ids; ids && *id; id++) {
+            gchar *owner = g_key_file_get_string(claims, "claims", *id, nullptr);
+            if(!owner_alive(j, owner ? owner : "")) {
+                g_key_file_remove_key(claims, "claims", *id, nullptr);
+            }
+            g_free(owner);
+        }
+        g_strfreev(ids);
+        gsize len;
+        gchar *data = g_key_file_to_data(claims, &len, nullptr);
+        if(ftruncate(j.claims_fd, 0) != 0 || pwrite(j.claims_fd, data, len, 0) != (ssize_t)len) {
+            printf("Could not write transfer claims: %s\n", strerror(errno));
+        }
+        g_free(data);
+    }
+    g_key_file_free(claims);
+    lock_file(j.claims_fd, LOCK_UN);
+}
+
+static std::string claim_owner(GKeyFile *claims, const std::string &id) {
+    std::string result;
+    gchar *owner = g_key_file_get_string(claims, "claims", id.c_str(), nullptr);
+    if(owner) {
+        result = owner;
+        g_free(owner);
+    }
+    return result;
+}
+
+static void drop_claim(TransferJournal &j, const std::string &id) {
+    GKeyFile *claims = lock_claims(j);
+    bool changed = g_key_file_remove_key(claims, "claims", id.c_str(), nullptr);
+    unlock_claims(j, claims, changed);
+}
+
+void open_journal(TransferJournal &j, DiskIo &io) {
+    close_journal(j);
+    std::string dir = journal_dir();
+    g_mkdir_with_parents((dir + "/owners").c_str(), 0700);
+    j.fname = dir + "/transfers.journal";
+    std::string lock_name = j.fname + ".lock";
+    j.lock_fd = open(lock_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(j.lock_fd < 0) {
+        printf("Could not open %s, the transfer journal is not locked.\n", lock_name.c_str());
+    }
+    std::string claims_name = dir + "/transfers.claims";
+    j.claims_fd = open(claims_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(j.claims_fd < 0) {
+        printf("Could not open %s, transfers can not be claimed.\n", claims_name.c_str());
+    }
+    j.owner = std::to_string(getpid()) + "-" + std::to_string(g_get_real_time());
+    std::string path = owner_path(j.owner);
+    // Under the claims lock so that nobody takes the file for the
+    // leftover of a dead process before we have locked it.
+    lock_file(j.claims_fd, LOCK_EX);
+    j.owner_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    lock_file(j.owner_fd, LOCK_EX);
+    lock_file(j.claims_fd, LOCK_UN);
+    if(j.owner_fd < 0) {
+        printf("Could not create %s, other processes may resume our transfers.\n", path.c_str());
+    }
+    g_mutex_init(&j.lock);
+    g_cond_init(&j.flushed);
+    j.pending.clear();
+    j.writing.clear();
+    j.flushing = false;
+    j.io = &io;
+}
+
+void close_journal(TransferJournal &j) {
+    if(!j.io) {
+        return;
+    }
+    g_mutex_lock(&j.lock);
+    while(j.flushing) {
+        g_cond_wait(&j.flushed, &j.lock);
+    }
+    g_mutex_unlock(&j.lock);
+    j.io = nullptr;
+    g_mutex_clear(&j.lock);
+    g_cond_clear(&j.flushed);
+    if(j.owner_fd >= 0) {
+        unlink(owner_path(j.owner).c_str());
+        close(j.owner_fd);
+    }
+    if(j.claims_fd >= 0) {
+        close(j.claims_fd);
+    }
+    if(j.lock_fd >= 0) {
+        close(j.lock_fd);
+    }
+}
+
+std::string journal_id(const std::string &session_key, bool upload,
+                       const std::string &local_path, const std::string &remote_path) {
+    // Paths may contain characters that are not valid in group names.
+    std::string key = session_key + "\n" + (upload ? "put" : "get") + "\n" + local_path + "\n" + remote_path;
+    gchar *sum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key.c_str(), -1);
+    std::string id(sum);
+    g_free(sum);
+    return id;
+}
+
+static std::string get_string(GKeyFile *kf, const gchar *group, const gchar *key) {
+    std::string result;
+    gchar *value = g_key_file_get_string(kf, group, key, nullptr);
+    if(value) {
+        result = value;
+        g_free(value);
+    }
+    return result;
+}
+
+static bool read_entry(GKeyFile *kf, const std::string &session_key, const std::string &id, JournalEntry &entry) {
+    const gchar *group = id.c_str();
+    if(!g_key_file_has_group(kf, group)) {
+        return false;
+    }
+    if(get_string(kf, group, "session") != session_key) {
+        return false;
+    }
+    entry.id = id;
+    entry.upload = g_key_file_get_boolean(kf, group, "upload", nullptr);
+    entry.local_path = get_string(kf, group, "local");
+    entry.remote_path = get_string(kf, group, "remote");
+    entry.size = g_key_file_get_uint64(kf, group, "size", nullptr);
+    entry.mtime = g_key_file_get_int64(kf, group, "mtime", nullptr);
+    entry.offset = g_key_file_get_uint64(kf, group, "offset", nullptr);
+    return true;
+}
+
+bool journal_lookup(TransferJournal &j, const std::string &session_key, const std::string &id, JournalEntry &entry) {
+    GKeyFile *kf = journal_view(j);
+    bool found = read_entry(kf, session_key, id, entry);
+    g_key_file_free(kf);
+    return found;
+}
+
+std::vector<JournalEntry> journal_entries(TransferJournal &j, const std::string &session_key) {
+    std::vector<JournalEntry> entries;
+    GKeyFile *claims = lock_claims(j);
+    GKeyFile *kf = journal_view(j);
+    gchar **groups = g_key_file_get_groups(kf, nullptr);
+    for(gchar **g = groups; *g; g++) {
+        JournalEntry e;
+        if(!owner_alive(j, claim_owner(claims, *g)) && read_entry(kf, session_key, *g, e)) {
+            entries.push_back(std::move(e));
+        }
+    }
+    g_strfreev(groups);
+    g_key_file_free(kf);
+    unlock_claims(j, claims, false);
+    return entries;
+}
+
+bool journal_add(TransferJournal &j, const std::string &session_key, const JournalEntry &entry) {
+    GKeyFile *claims = lock_claims(j);
+    if(owner_alive(j, claim_owner(claims, entry.id))) {
+        unlock_claims(j, claims, false);
+        return false;
+    }
+    g_key_file_set_string(claims, "claims", entry.id.c_str(), j.owner.c_str());
+    unlock_claims(j, claims, true);
+    queue_change(j, JournalChange{JOURNAL_ADD, session_key, entry});
+    return true;
+}
+
+static JournalChange offset_change(JournalChangeType type, const std::string &id, uint64_t offset) {
+    JournalChange c;
+    c.type = type;
+    c.entry.id = id;
+    c.entry.upload = false;
+    c.entry.size = 0;
+    c.entry.mtime = 0;
+    c.entry.offset = offset;
+    return c;
+}
+
+void journal_update(TransferJournal &j, const std::string &id, uint64_t offset) {
+    queue_change(j, offset_change(JOURNAL_UPDATE, id, offset));
+}
+
+void journal_release(TransferJournal &j, const std::string &id, uint64_t offset) {
+    queue_change(j, offset_change(JOURNAL_UPDATE, id, offset));
+    drop_claim(j, id);
+}
+
+void journal_remove(TransferJournal &j, const std::string &id) {
+    queue_change(j, offset_change(JOURNAL_REMOVE, id, 0));
+    drop_claim(j, id);
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<diskio.hpp>
+#include<glib.h>
+#include<string>
+#include<vector>
+
+/*
+ * One unfinished transfer. offset is how much of the destination is
+ * known to be complete, size and mtime identify the version of the
+ * source it was copied from.
+ */
+struct JournalEntry {
+    std::string id;
+    bool upload;
+    std::string local_path;
+    std::string remote_path;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t offset;
+};
+
+enum JournalChangeType {
+    JOURNAL_ADD,
+    JOURNAL_UPDATE,
+    JOURNAL_REMOVE,
+};
+
+struct JournalChange {
+    JournalChangeType type;
+    std::string session_key; // Adds.
+    JournalEntry entry;      // Only id and offset unless adding.
+};
+
+/*
+ * Unfinished transfers of all sessions live in one key file in the
+ * user's data directory. Changes are written out by a disk worker with
+ * an atomic replace so that the file survives crashes. Those that pile
+ * up while a write is going on all go out in the next one. Reads see
+ * them straight away.
+ *
+ * One of these is shared by all sessions of a process, but other
+ * processes write the same file. The worker applies the changes under
+ * a lock file to what is on disk at that moment, so nobody's entries
+ * are lost.
+ *
+ * An entry that is being transferred is claimed by its owner, a
+ * process that holds a lock on its own file in owners/ for as long as
+ * it runs. Entries of a live owner are not resumed anywhere else, those
+ * of a process that died are free for anyone. Claims must be seen by
+ * the others right away, so they live in a separate small file that is
+ * changed in place and never synced. After a crash they are void
+ * anyway.
+ */
+struct TransferJournal {
+    std::string fname;
+    std::string owner;
+    DiskIo *io;     // Not owned. Null while the journal is closed.
+    int lock_fd;    // Held by the worker while it replaces the file.
+    int claims_fd;  // Locked while claims are read and changed.
+    int owner_fd;   // Held until the journal is closed.
+    GMutex lock;    // Protects the rest.
+    GCond flushed;
+    std::vector<JournalChange> pending; // Not yet picked up by the worker.
+    std::vector<JournalChange> writing; // Being written by the worker.
+    bool flushing;
+};
+
+void open_journal(TransferJournal &j, DiskIo &io);
+// Waits until all changes have been written.
+void close_journal(TransferJournal &j);
+
+std::string journal_id(const std::string &session_key, bool upload,
+                       const std::string &local_path, const std::string &remote_path);
+bool journal_lookup(TransferJournal &j, const std::string &session_key, const std::string &id, JournalEntry &entry);
+// Leaves out entries that some session is working on.
+std::vector<JournalEntry> journal_entries(TransferJournal &j, const std::string &session_key);
+
+// Takes ownership of the entry. Fails if another session already has it.
+bool journal_add(TransferJournal &j, const std::string &session_key, const JournalEntry &entry);
+void journal_update(TransferJournal &j, const std::string &id, uint64_t offset);
+// Leaves the entry for whoever continues the transfer next.
+void journal_release(TransferJournal &j, const std::string &id, uint64_t offset);
+void journal_remove(TransferJournal &j, const std::string &id);
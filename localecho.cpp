@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<localecho.hpp>
+
+#include<string>
+#include<cstring>
+#include<cstdio>
+
+static bool is_backspace(char c) {
+    return c == 0x7f || c == '\b';
+}
+
+// What is left on the line once the backspaces have been applied.
+static std::string overlay_text(const LocalEcho &e) {
+    std::string text;
+    for(const auto &k : e.pending) {
+        if(is_backspace(k.c)) {
+            if(!text.empty()) {
+                text.pop_back();
+            }
+        } else {
+            text.push_back(k.c);
+        }
+    }
+    return text;
+}
+
+// The guess is only ever drawn over blank cells, blanking exactly those
+// again restores the line.
+static void erase_overlay(LocalEcho &e) {
+    if(e.drawn == 0) {
+        return;
+    }
+    char seq[32];
+    int len = snprintf(seq, sizeof(seq), "\x1b[%zuD\x1b[%zuX", e.drawn, e.drawn);
+    vte_terminal_feed(e.terminal, seq, len);
+    e.drawn = 0;
+}
+
+// A right prompt, or text after a cursor that was moved without us
+// seeing it, must not be drawn over.
+static bool rest_of_line_blank(const LocalEcho &e, glong col, glong row) {
+    glong last = vte_terminal_get_column_count(e.terminal) - 1;
+    char *text = vte_terminal_get_text_range(e.terminal, row, col, row, last, nullptr, nullptr, nullptr);
+    if(!text) {
+        return false;
+    }
+    bool blank = strspn(text, " \n") == strlen(text);
+    g_free(text);
+    return blank;
+}
+
+static void draw_overlay(LocalEcho &e) {
+    if(!e.enabled || e.alt_screen || e.tentative || e.mid_line ||
+       e.srtt < LOCAL_ECHO_MIN_RTT_US || g_get_monotonic_time() < e.disabled_until) {
+        return;
+    }
+    std::string text = overlay_text(e);
+    if(text.empty()) {
+        return;
+    }
+    glong col, row;
+    vte_terminal_get_cursor_position(e.terminal, &col, &row);
+    // Wrapping would make the guess impossible to take back.
+    if(col + (glong)text.size() >= vte_terminal_get_column_count(e.terminal)) {
+        return;
+    }
+    if(!rest_of_line_blank(e, col, row)) {
+        return;
+    }
+    std::string seq = "\x1b[4m" + text + "\x1b[24m";
+    vte_terminal_feed(e.terminal, seq.data(), seq.size());
+    e.drawn = text.size();
+    for(auto &k : e.pending) {
+        k.shown = true;
+    }
+}
+
+// Drawing after a chunk that stops inside an escape sequence or a UTF-8
+// character would garble both.
+static bool ends_cleanly(const char *data, size_t len) {
+    size_t start = len > 32 ? len - 32 : 0;
+    for(size_t i=len; i>start; i--) {
+        unsigned char c = data[i-1];
+        if(c == 0x1b) {
+            if(i == len) {
+                return false;
+            }
+            if(data[i] != '[') {
+                // OSC and DCS strings may run on, everything else is
+                // two bytes.
+                return data[i] != ']' && data[i] != 'P';
+            }
+            for(size_t j=i+1; j<len; j++) {
+                unsigned char f = data[j];
+                if(f >= 0x40 && f <= 0x7e) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+    unsigned char last = len > 0 ? data[len-1] : 0;
+    if(last < 0x80) {
+        return true;
+    }
+    // Find the lead byte and see whether all its continuation bytes came.
+    size_t lead = len - 1;
+    while(lead > 0 && len - lead < 4 && ((unsigned char)data[lead] & 0xc0) == 0x80) {
+        lead--;
+    }
+    unsigned char l = data[lead];
+    size_t need = l >= 0xf0 ? 4 : l >= 0xe0 ? 3 : l >= 0xc0 ? 2 : 1;
+    return len - lead >= need;
+}
+
+static void track_screen(LocalEcho &e, const char *data, size_t len) {
+    static const char *const modes[] = {"\x1b[?1049", "\x1b[?1047", "\x1b[?47"};
+    for(size_t i=0; i<len; i++) {
+        if(data[i] != 0x1b) {
+            continue;
+        }
+        for(const char *mode : modes) {
+            size_t n = strlen(mode);
+            if(i + n < len && memcmp(data + i, mode, n) == 0) {
+                if(data[i+n] == 'h') {
+                    e.alt_screen = true;
+                } else if(data[i+n] == 'l') {
+                    e.alt_screen = false;
+                }
+            }
+        }
+    }
+}
+
+static void prediction_failed(LocalEcho &e) {
+    bool shown = false;
+    for(const auto &k : e.pending) {
+        shown = shown || k.shown;
+    }
+    if(shown && ++e.misses >= LOCAL_ECHO_MAX_MISSES) {
+        e.disabled_until = g_get_monotonic_time() + LOCAL_ECHO_BACKOFF_US;
+        e.misses = 0;
+    }
+    e.pending.clear();
+    e.tentative = true;
+}
+
+static void key_confirmed(LocalEcho &e) {
+    const PredictedKey &k = e.pending.front();
+    gint64 sample = g_get_monotonic_time() - k.typed_at;
+    e.srtt = e.srtt ? (7*e.srtt + sample)/8 : sample;
+    if(k.shown) {
+        e.misses = 0;
+    }
+    e.tentative = false;
+    e.pending.pop_front();
+}
+
+// Matches the start of the output against the echoes the unconfirmed
+// keys should produce.
+static void reconcile(LocalEcho &e, const char *data, size_t len) {
+    static const char *const erasers[] = {"\b \b", "\b\x1b[K", "\b\x1b[1P"};
+    size_t pos = 0;
+    while(!e.pending.empty() && pos < len) {
+        const PredictedKey &k = e.pending.front();
+        if(!is_backspace(k.c)) {
+            if(data[pos] != k.c) {
+                prediction_failed(e);
+                return;
+            }
+            pos++;
+            key_confirmed(e);
+            continue;
+        }
+        size_t matched = 0;
+        for(const char *eraser : erasers) {
+            size_t n = strlen(eraser);
+            if(len - pos >= n && memcmp(data + pos, eraser, n) == 0) {
+                matched = n;
+                break;
+            }
+        }
+        if(matched == 0) {
+            prediction_failed(e);
+            return;
+        }
+        pos += matched;
+        key_confirmed(e);
+    }
+}
+
+void init_local_echo(LocalEcho &e, VteTerminal *terminal) {
+    e.terminal = terminal;
+    e.enabled = true;
+    e.alt_screen = false;
+    e.tentative = true;
+    e.mid_line = false;
+    e.pending.clear();
+    e.drawn = 0;
+    e.srtt = 0;
+    e.misses = 0;
+    e.disabled_until = 0;
+}
+
+void predict_input(LocalEcho &e, const char *text, size_t len) {
+    gint64 now = g_get_monotonic_time();
+    if(len == 1 && ((text[0] >= 0x20 && text[0] < 0x7f) || is_backspace(text[0]))) {
+        // A backspace over something that is already on screen would
+        // have to erase the real text.
+        if(!is_backspace(text[0]) || !overlay_text(e).empty()) {
+            e.pending.push_back(PredictedKey{text[0], now, false});
+            erase_overlay(e);
+            draw_overlay(e);
+        }
+        return;
+    }
+    // Escape sequences are cursor and function keys. After those, and
+    // after the Emacs style Ctrl-A, Ctrl-B, Ctrl-E and Ctrl-F, the cursor
+    // may be anywhere on the line.
+    if(memchr(text, 0x1b, len)) {
+        e.mid_line = true;
+    }
+    if(len == 1 && (text[0] == 0x01 || text[0] == 0x02 || text[0] == 0x05 || text[0] == 0x06)) {
+        e.mid_line = true;
+    }
+    if(len == 1 && (text[0] == '\r' || text[0] == '\n')) {
+        e.mid_line = false;
+    }
+    e.tentative = true;
+}
+
+void feed_terminal_output(LocalEcho &e, const char *data, size_t len) {
+    erase_overlay(e);
+    vte_terminal_feed(e.terminal, data, len);
+    track_screen(e, data, len);
+    reconcile(e, data, len);
+    if(ends_cleanly(data, len)) {
+        draw_overlay(e);
+    }
+}
+
+void set_local_echo(LocalEcho &e, bool enabled) {
+    e.enabled = enabled;
+    if(!enabled) {
+        erase_overlay(e);
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<vte/vte.h>
+#include<deque>
+#include<cstddef>
+
+// Predictions are only shown when echoes take at least this long.
+static const constexpr gint64 LOCAL_ECHO_MIN_RTT_US = 30000;
+// After this many wrong predictions in a row they are not shown for
+// LOCAL_ECHO_BACKOFF_US.
+static const constexpr int LOCAL_ECHO_MAX_MISSES = 3;
+static const constexpr gint64 LOCAL_ECHO_BACKOFF_US = 60*G_USEC_PER_SEC;
+
+struct PredictedKey {
+    char c; // Printable ASCII or a backspace.
+    gint64 typed_at;
+    bool shown;
+};
+
+/*
+ * Shows what typing will probably do before the server has echoed it,
+ * underlined, at the end of the current line. It is only drawn if the
+ * rest of the line is blank. When output arrives the
+ * guess is wiped and the real output is compared against the keys that
+ * are still unconfirmed.
+ *
+ * Only printable characters and backspaces over them are predicted.
+ * Anything else, such as Enter or cursor keys, makes predictions
+ * tentative: they are checked but not shown until one has been
+ * confirmed again. This keeps passwords from being shown, as those are
+ * never echoed. Nothing is shown in full screen programs, which use
+ * the alternate screen, or after cursor movement until the next line.
+ */
+struct LocalEcho {
+    VteTerminal *terminal;
+    bool enabled;
+    bool alt_screen;
+    bool tentative;
+    bool mid_line;
+    std::deque<PredictedKey> pending;
+    size_t drawn; // Predicted characters currently on screen.
+    gint64 srtt;
+    int misses;
+    gint64 disabled_until;
+};
+
+void init_local_echo(LocalEcho &e, VteTerminal *terminal);
+void predict_input(LocalEcho &e, const char *text, size_t len);
+// Use instead of vte_terminal_feed for everything from the server.
+void feed_terminal_output(LocalEcho &e, const char *data, size_t len);
+void set_local_echo(LocalEcho &e, bool enabled);
@@ -19,95 +19,471 @@
 #include<ssh_util.hpp>
 #include<sftp.hpp>
 #include<forwards.hpp>
+#include<controlsocket.hpp>
+#include<connector.hpp>
+#include<cipherbench.hpp>
+#include<batch.hpp>
 #include<util.hpp>
+#include<iothread.hpp>
+#include<diskio.hpp>
+#include<terminput.hpp>
+#include<localecho.hpp>
+#include<metrics.hpp>
+#include<statswindow.hpp>
 
 #include<vte/vte.h>
 #include<gtk/gtk.h>
+#include<algorithm>
+#include<atomic>
+#include<memory>
+#include<vector>
 
+// Space asked for before each read of terminal output.
+static const constexpr int TERM_READ_SIZE = 64*1024;
+// Limits for how much output is fed to the terminal in one frame. The
+// amount adapts so that feeding takes about TERM_FEED_BUDGET_US.
+static const constexpr size_t TERM_FEED_MIN = 16*1024;
+static const constexpr size_t TERM_FEED_MAX = 4*1024*1024;
+static const constexpr gint64 TERM_FEED_BUDGET_US = 8000;
+// The pty is not read while this much output waits for the terminal.
+// The channel window then fills up and the server stops sending, so a
+// flood neither eats memory nor delays what comes after it, such as
+// the prompt after Ctrl-C. Reading resumes at half of this.
+static const constexpr size_t TERM_UNFED_MAX = 4*1024*1024;
 
-struct App {
-    GtkWidget *mainWindow;
+struct App;
+
+/*
+ * One connection and everything that goes over it, shown in a tab.
+ * All sessions are served by the same I/O thread, whose main loop
+ * watches every socket, and share the disk threads of their transfers.
+ */
+struct Session {
+    App *app;
+    GtkWidget *page;
+    GtkLabel *label;
     VteTerminal *terminal;
+    LocalEcho echo;
+    bool connecting;
+    bool connected;
+    std::string timings; // Of the handshake.
+
+    // Output waiting for the next frame, from term_output_pos on.
+    std::string term_output;
+    size_t term_output_pos;
+    size_t term_feed_size;
+    guint term_tick;
+    guint term_idle; // Feeds terminals in background tabs instead.
+    // Read from the pty but not yet fed to the terminal.
+    std::atomic<size_t> term_unfed;
+
+    // Everything below belongs to the I/O thread once connecting starts.
     SshSession session;
+    Connector connector;
     SshChannel pty;
+    bool pty_paused; // Waiting for the terminal to catch up.
+    TerminalInput input;
     PortForwardings ports;
-
+    ControlSocket control;
+    SftpWindow sftp_win;
     GIOChannel *session_channel;
+    guint session_watch;
+    ssh_event event;
+    // Filled in by libssh. Wire bytes as on the socket, payload before
+    // compression and encryption.
+    struct ssh_counter_struct wire_counter;
+    struct ssh_counter_struct payload_counter;
+};
+
+struct App {
+    GtkWidget *mainWindow;
+    GtkNotebook *notebook;
     GtkBuilder *connectionBuilder;
-    SftpWindow sftp_win;
+    IoThread io;
+    std::vector<std::unique_ptr<Session>> sessions;
+
+    // Belong to the I/O thread.
+    DiskIo disk;
+    TransferJournal journal;
+    DnsCache dns;
+    AlgorithmTuner tuner; // Locked, used from the I/O thread.
+    std::vector<Session*> live_sessions;
+    MetricsServer metrics;
+    LoopProbe io_probe;
+
+    StatsWindow stats;
 };
 
-void feed_terminal(App &a) {
-    const int bufsize = 1024;
-    char buf[bufsize];
-    auto num_read = a.pty.read(buf, bufsize);
-    vte_terminal_feed(a.terminal, buf, num_read);
+void feed_terminal(Session &s);
+
+// Called on the I/O thread.
+void resume_terminal(Session &s) {
+    if(s.pty_paused && s.pty != nullptr) {
+        s.pty_paused = false;
+        feed_terminal(s);
+    }
 }
 
+void output_fed(Session &s, size_t n) {
+    size_t before = s.term_unfed.fetch_sub(n);
+    // A closed tab is not read any more.
+    if(s.connected && before >= TERM_UNFED_MAX/2 && before - n < TERM_UNFED_MAX/2) {
+        Session *sp = &s;
+        run_on_io(s.app->io, [sp]() { resume_terminal(*sp); });
+    }
+}
 
-gboolean session_has_data(GIOChannel *channel, GIOCondition cond, gpointer data) {
-    App &a = *reinterpret_cast<App*>(data);
-    bool forwards_had_data;
-    feed_terminal(a);
-    if(a.sftp_win.downloading) {
-        feed_sftp(a.sftp_win);
-    }
-    // Process data that libssh has hidden in its buffers.
-    // Must handle the case where the remote connection pushes data
-    // faster than we can push to the client. A simple "read until
-    // nothing left" can get stuck in an eternal loop.
+// Feeds one frame's worth of the waiting output. False once all of it
+// has been fed.
+bool feed_waiting_output(Session &s) {
+    size_t n = std::min(s.term_feed_size, s.term_output.size() - s.term_output_pos);
+    gint64 start = g_get_monotonic_time();
+    feed_terminal_output(s.echo, s.term_output.data() + s.term_output_pos, n);
+    gint64 took = g_get_monotonic_time() - start;
+    s.term_output_pos += n;
+    output_fed(s, n);
+    // Floods get through in big chunks, but a frame never takes so long
+    // that typing feels sluggish.
+    if(n == s.term_feed_size && took < TERM_FEED_BUDGET_US/2) {
+        s.term_feed_size = std::min(s.term_feed_size*2, TERM_FEED_MAX);
+    } else if(took > TERM_FEED_BUDGET_US) {
+        s.term_feed_size = std::max(s.term_feed_size/2, TERM_FEED_MIN);
+    }
+    if(s.term_output_pos < s.term_output.size()) {
+        return true;
+    }
+    s.term_output.clear();
+    s.term_output_pos = 0;
+    return false;
+}
+
+gboolean terminal_tick(GtkWidget *, GdkFrameClock *, gpointer data) {
+    Session &s = *reinterpret_cast<Session*>(data);
+    if(feed_waiting_output(s)) {
+        return G_SOURCE_CONTINUE;
+    }
+    s.term_tick = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// Terminals in background tabs have no frames, they are fed whenever
+// the UI has nothing else to do.
+gboolean terminal_idle(gpointer data) {
+    Session &s = *reinterpret_cast<Session*>(data);
+    if(feed_waiting_output(s)) {
+        return G_SOURCE_CONTINUE;
+    }
+    s.term_idle = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// Also called when the tab is switched to or away from.
+void schedule_terminal_feed(Session &s) {
+    bool mapped = gtk_widget_get_mapped(GTK_WIDGET(s.terminal));
+    if(mapped && s.term_idle) {
+        g_source_remove(s.term_idle);
+        s.term_idle = 0;
+    }
+    if(!mapped && s.term_tick) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(s.terminal), s.term_tick);
+        s.term_tick = 0;
+    }
+    if(s.term_output_pos >= s.term_output.size()) {
+        return;
+    }
+    if(s.term_feed_size == 0) {
+        s.term_feed_size = TERM_FEED_MIN;
+    }
+    if(mapped && s.term_tick == 0) {
+        s.term_tick = gtk_widget_add_tick_callback(GTK_WIDGET(s.terminal), terminal_tick, &s, nullptr);
+    } else if(!mapped && s.term_idle == 0) {
+        s.term_idle = g_idle_add(terminal_idle, &s);
+    }
+}
+
+void terminal_mapping_changed(GtkWidget *, gpointer data) {
+    schedule_terminal_feed(*reinterpret_cast<Session*>(data));
+}
+
+void show_terminal_output(Session &s, std::string &output) {
+    if(s.term_output.empty()) {
+        s.term_output.swap(output);
+    } else {
+        s.term_output.erase(0, s.term_output_pos);
+        s.term_output_pos = 0;
+        s.term_output.append(output);
+    }
+    schedule_terminal_feed(s);
+}
+
+// Called on the I/O thread. Takes what the channel has, up to what the
+// terminal can be behind by.
+void feed_terminal(Session &s) {
+    if(s.pty_paused) {
+        return;
+    }
+    std::string output;
+    size_t used = 0;
     while(true) {
-        forwards_had_data = feed_forwards(a.ports);
-        if(!forwards_had_data) {
-            // a) there is no more data inside libssh
+        if(s.term_unfed.load() + used >= TERM_UNFED_MAX) {
+            s.pty_paused = true;
             break;
         }
-        if(fd_has_data(g_io_channel_unix_get_fd(a.session_channel))) {
-            // There is data in the socket, but in this case glib will call this
-            // function so it will get processed then.
+        output.resize(used + TERM_READ_SIZE);
+        int num_read = s.pty.read(&output[used], TERM_READ_SIZE);
+        if(num_read <= 0) {
+            if(num_read == SSH_ERROR) {
+                printf("Could not read from terminal: %s\n", ssh_get_error(s.session));
+            }
             break;
         }
+        used += num_read;
+        s.input.counters.bytes_in += num_read;
+        s.input.counters.reads++;
     }
+    if(used == 0) {
+        return;
+    }
+    terminal_output_arrived(s.input);
+    output.resize(used);
+    s.term_unfed += used;
+    Session *sp = &s;
+    run_on_ui(s.app->io, [sp, output]() mutable { show_terminal_output(*sp, output); });
+}
+
+
+// Runs on the I/O thread, which is the only one that touches the session.
+gboolean session_has_data(GIOChannel *channel, GIOCondition cond, gpointer data) {
+    Session &s = *reinterpret_cast<Session*>(data);
+    // Reads everything the socket has. Channels of forwarded connections
+    // get their callbacks called and are served below, idle ones cost
+    // nothing.
+    ssh_event_dopoll(s.event, 0);
+    feed_terminal(s);
+    if(s.input.pending.used > 0) {
+        // The server may have made room in the window.
+        flush_terminal_input(s.input);
+    }
+    if(transfers_pending(s.sftp_win.transfers)) {
+        feed_sftp(s.sftp_win);
+    }
+    feed_forwards(s.ports);
     return TRUE;
 }
 
-gboolean key_pressed_cb(GtkWidget *widget, GdkEvent  *event, gpointer data) {
+// Finished disk operations may be all that a transfer was waiting for.
+// The disk threads are shared so any session may have been waiting.
+void disk_io_done(void *data) {
     App &a = *reinterpret_cast<App*>(data);
-    GdkEventKey *eventkey = reinterpret_cast<GdkEventKey*>(event);
-    a.pty.write(eventkey->string, eventkey->length); // FIXME, this is wrong
-    return TRUE;
+    for(auto s : a.live_sessions) {
+        if(transfers_pending(s->sftp_win.transfers)) {
+            feed_sftp(s->sftp_win);
+        }
+    }
 }
 
-void connect(App &app, const char *hostname, const unsigned int port, const char *username, const char *passphrase, int conn_type) {
-    SshSession &s = app.session;
-    ssh_options_set(s, SSH_OPTIONS_HOST, hostname);
-    ssh_options_set(s, SSH_OPTIONS_PORT, &port);
-    auto rc = ssh_connect(s);
-    if(rc != SSH_OK) {
-        printf("Could not connect: %s\n", ssh_get_error(s));
-        gtk_main_quit();
+// Typed keys and pastes both arrive here, already encoded the way the
+// remote terminal expects them.
+void terminal_commit(VteTerminal *, gchar *text, guint size, gpointer data) {
+    Session &s = *reinterpret_cast<Session*>(data);
+    if(!s.connected) {
         return;
     }
-    app.sftp_win.session = app.session;
-    auto state = ssh_is_server_known(s);
-    if(state != SSH_SERVER_KNOWN_OK) {
-        printf("Server is not previously known.\n");
-        gtk_main_quit();
+    std::string input(text, size);
+    gint64 typed_at = g_get_monotonic_time();
+    predict_input(s.echo, text, size);
+    Session *sp = &s;
+    run_on_io(s.app->io, [sp, input, typed_at]() {
+        queue_terminal_input(sp->input, input.data(), input.size(), typed_at);
+    });
+}
+
+Session* current_session(App &a) {
+    GtkWidget *page = gtk_notebook_get_nth_page(a.notebook, gtk_notebook_get_current_page(a.notebook));
+    for(const auto &s : a.sessions) {
+        if(s->page == page) {
+            return s.get();
+        }
+    }
+    return nullptr;
+}
+
+// Called on the I/O thread.
+void shutdown_session(Session &s) {
+    App &a = *s.app;
+    a.live_sessions.erase(std::remove(a.live_sessions.begin(), a.live_sessions.end(), &s), a.live_sessions.end());
+    cancel_connect(s.connector);
+    if(!s.session_watch) {
         return;
     }
-    if(conn_type == 0) {
-        rc = ssh_userauth_password(s, username, passphrase);
-    } else {
-        rc = ssh_userauth_autopubkey(s, passphrase);
+    thread_source_remove(s.session_watch);
+    g_io_channel_unref(s.session_channel);
+    cancel_transfers(s.sftp_win.transfers);
+    stop_listing(s.sftp_win);
+    close_control_socket(s.control);
+    std::vector<int> local_ports;
+    for(const auto &r : s.ports.rules) {
+        local_ports.push_back(r.first);
+    }
+    for(int port : local_ports) {
+        remove_forward_rule(s.ports, port);
+    }
+    close_terminal_input(s.input);
+    s.sftp_win.sftp = SftpSession();
+    s.pty = SshChannel();
+    ssh_event_remove_session(s.event, s.session);
+    ssh_event_free(s.event);
+    ssh_disconnect(s.session);
+}
+
+void close_session(Session *s) {
+    App &a = *s->app;
+    s->connected = false;
+    gtk_notebook_remove_page(a.notebook, gtk_notebook_page_num(a.notebook, s->page));
+    if(s->sftp_win.builder) {
+        gtk_widget_hide(GTK_WIDGET(s->sftp_win.sftp_window));
+    }
+    gtk_widget_hide(GTK_WIDGET(s->ports.forwardWindow));
+    gtk_widget_hide(GTK_WIDGET(s->ports.createWindow));
+    for(auto it = a.sessions.begin(); it != a.sessions.end(); ++it) {
+        if(it->get() == s) {
+            it->release();
+            a.sessions.erase(it);
+            break;
+        }
     }
-    if(rc != SSH_OK) {
-        printf("Could not connect: %s\n", ssh_get_error(s));
-        gtk_main_quit();
+    // Tasks that the I/O thread sent for this session before it shut
+    // down are run before this one, so nothing refers to it after.
+    IoThread *io = &a.io;
+    run_on_io(a.io, [s, io]() {
+        shutdown_session(*s);
+        run_on_ui(*io, [s]() {
+            if(s->term_tick) {
+                gtk_widget_remove_tick_callback(GTK_WIDGET(s->terminal), s->term_tick);
+            }
+            if(s->term_idle) {
+                g_source_remove(s->term_idle);
+            }
+            if(s->sftp_win.refresh_source) {
+                g_source_remove(s->sftp_win.refresh_source);
+            }
+            if(s->sftp_win.builder) {
+                gtk_widget_destroy(GTK_WIDGET(s->sftp_win.sftp_window));
+            }
+            gtk_widget_destroy(GTK_WIDGET(s->ports.forwardWindow));
+            gtk_widget_destroy(GTK_WIDGET(s->ports.createWindow));
+            gtk_widget_destroy(s->page);
+            g_object_unref(s->page);
+            delete s;
+        });
+    });
+}
+
+void close_tab_clicked(GtkButton *, gpointer data) {
+    close_session(reinterpret_cast<Session*>(data));
+}
+
+Session* new_session(App &a) {
+    std::unique_ptr<Session> s(new Session());
+    s->app = &a;
+    s->sftp_win.io = &a.io;
+    s->sftp_win.disk = &a.disk;
+    s->sftp_win.journal = &a.journal;
+    s->sftp_win.tuner = &a.tuner;
+    s->ports.io = &a.io;
+    build_port_gui(s->ports);
+
+    s->terminal = VTE_TERMINAL(vte_terminal_new());
+    vte_terminal_set_size(s->terminal, 80, 25);
+    vte_terminal_set_cursor_blink_mode(s->terminal, VTE_CURSOR_BLINK_OFF);
+    init_local_echo(s->echo, s->terminal);
+    g_signal_connect(GTK_WIDGET(s->terminal), "commit", G_CALLBACK(terminal_commit), s.get());
+    g_signal_connect_after(GTK_WIDGET(s->terminal), "map", G_CALLBACK(terminal_mapping_changed), s.get());
+    g_signal_connect_after(GTK_WIDGET(s->terminal), "unmap", G_CALLBACK(terminal_mapping_changed), s.get());
+    GtkWidget *scrollBar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(s->terminal)));
+    s->page = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    // Kept alive after the tab is closed until the I/O thread is done with it.
+    g_object_ref(s->page);
+    gtk_box_pack_start(GTK_BOX(s->page), GTK_WIDGET(s->terminal), TRUE, TRUE, 0);
+    gtk_box_pack_end(GTK_BOX(s->page), scrollBar, FALSE, TRUE, 0);
+
+    GtkWidget *tab = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 4);
+    s->label = GTK_LABEL(gtk_label_new("Not connected"));
+    GtkWidget *close_button = gtk_button_new_from_icon_name("window-close-symbolic", GTK_ICON_SIZE_MENU);
+    gtk_button_set_relief(GTK_BUTTON(close_button), GTK_RELIEF_NONE);
+    g_signal_connect(close_button, "clicked", G_CALLBACK(close_tab_clicked), s.get());
+    gtk_box_pack_start(GTK_BOX(tab), GTK_WIDGET(s->label), TRUE, TRUE, 0);
+    gtk_box_pack_end(GTK_BOX(tab), close_button, FALSE, FALSE, 0);
+    gtk_widget_show_all(tab);
+    gtk_widget_show_all(s->page);
+
+    Session *created = s.get();
+    a.sessions.push_back(std::move(s));
+    int index = gtk_notebook_append_page(a.notebook, created->page, tab);
+    gtk_notebook_set_tab_reorderable(a.notebook, created->page, TRUE);
+    gtk_notebook_set_current_page(a.notebook, index);
+    gtk_widget_grab_focus(GTK_WIDGET(created->terminal));
+    return created;
+}
+
+void show_message(App &a, GtkMessageType type, const char *title, const std::string &text) {
+    GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(a.mainWindow),
+                                               GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               type,
+                                               GTK_BUTTONS_CLOSE,
+                                               "%s", title);
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog), "%s", text.c_str());
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+}
+
+void connect_failed(Session &s, const std::string &error, const std::string &timings) {
+    s.connecting = false;
+    s.timings = timings;
+    std::string message = "Could not connect: " + error + "\r\n";
+    vte_terminal_feed(s.terminal, message.data(), message.size());
+    show_message(*s.app, GTK_MESSAGE_ERROR, "Could not connect", error + "\n\n" + timings);
+}
+
+// Called on the I/O thread once the shell is up or the handshake failed.
+void session_connected(Connector &c, bool ok, void *data) {
+    Session *s = reinterpret_cast<Session*>(data);
+    std::string timings = describe_timings(c.timings, ok ? CONNECT_DONE : c.failed_phase);
+    if(!ok) {
+        std::string error = std::string(connect_phase_name(c.failed_phase)) + " failed: " + c.error;
+        printf("Could not connect to %s: %s\n", c.host.c_str(), error.c_str());
+        // So that the tab can be used for the next attempt.
+        ssh_disconnect(s->session);
+        run_on_ui(s->app->io, [s, error, timings]() { connect_failed(*s, error, timings); });
         return;
     }
-    app.pty = s.open_shell();
-    app.session_channel = g_io_channel_unix_new(ssh_get_fd(s));
-    g_io_add_watch(app.session_channel, G_IO_IN, session_has_data, &app);
+    s->pty = std::move(c.pty);
+    s->sftp_win.session = s->session;
+    s->ports.session = s->session;
+    s->event = ssh_event_new();
+    ssh_event_add_session(s->event, s->session);
+    s->session_channel = g_io_channel_unix_new(ssh_get_fd(s->session));
+    s->app->live_sessions.push_back(s);
+    init_terminal_input(s->input, s->pty);
+    s->session_watch = thread_io_add_watch(s->session_channel, G_IO_IN, session_has_data, s);
+    // Other programs can open channels on the session through this.
+    std::string control_path = control_socket_path(c.username.c_str(), c.host.c_str(), c.port);
+    open_control_socket(s->control, s->ports, control_path.c_str());
+    s->pty_paused = false;
+    feed_terminal(*s);
+    run_on_ui(s->app->io, [s, timings]() {
+        s->connecting = false;
+        s->connected = true;
+        s->timings = timings;
+    });
+}
+
+void set_tab_title(App &a, Session &s, const char *title) {
+    gtk_label_set_text(s.label, title);
+    if(current_session(a) == &s) {
+        std::string window_title = std::string(title) + " - Unnamed SSH client";
+        gtk_window_set_title(GTK_WINDOW(a.mainWindow), window_title.c_str());
+    }
 }
 
 void open_connection(GtkMenuItem *, gpointer data) {
@@ -122,9 +498,32 @@ void open_connection(GtkMenuItem *, gpointer data) {
     const char *username_str = gtk_entry_get_text(GTK_ENTRY(username));
     const char *password_str = gtk_entry_get_text(GTK_ENTRY(password));
     gint active_mode = gtk_combo_box_get_active(GTK_COMBO_BOX(authentication));
-    connect(a, host_str, port_number, username_str, password_str, active_mode);
-    feed_terminal(a);
-    a.ports.session = a.session;
+    bool tune = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gtk_builder_get_object(a.connectionBuilder, "tune_check")));
+    // An empty tab, such as the one a new window starts with, is used
+    // rather than opening another.
+    Session *s = current_session(a);
+    if(!s || s->connected || s->connecting) {
+        s = new_session(a);
+    }
+    std::string title = std::string(username_str) + "@" + host_str;
+    set_tab_title(a, *s, title.c_str());
+    std::string message = "Connecting to " + title + "...\r\n";
+    vte_terminal_feed(s->terminal, message.data(), message.size());
+    s->connecting = true;
+    std::string hostname(host_str);
+    std::string user(username_str);
+    std::string passphrase(password_str);
+    // The handshake runs on the I/O thread, the UI stays live meanwhile.
+    run_on_io(a.io, [s, hostname, port_number, user, passphrase, active_mode, tune]() {
+        if(tune) {
+            tune_session(s->app->tuner, s->session, hostname.c_str());
+        }
+        s->wire_counter = ssh_counter_struct();
+        s->payload_counter = ssh_counter_struct();
+        ssh_set_counters(s->session, &s->wire_counter, &s->payload_counter);
+        start_connect(s->connector, s->app->dns, s->session, hostname.c_str(), port_number, user.c_str(),
+                      passphrase.c_str(), active_mode, session_connected, s);
+    });
     gtk_widget_destroy(GTK_WIDGET(gtk_builder_get_object(a.connectionBuilder, "connection_window")));
     g_object_unref(G_OBJECT(a.connectionBuilder));
     a.connectionBuilder = nullptr;
@@ -139,6 +538,10 @@ void connect_cancelled(GtkMenuItem *, gpointer data) {
 
 void launch_connection_dialog(GtkMenuItem *, gpointer data) {
     App &a = *reinterpret_cast<App*>(data);
+    if(a.connectionBuilder) {
+        gtk_window_present(GTK_WINDOW(gtk_builder_get_object(a.connectionBuilder, "connection_window")));
+        return;
+    }
     a.connectionBuilder = gtk_builder_new_from_string((const gchar*)connectiondialog, sizeof(connectiondialog));
     auto connectionWindow = GTK_WIDGET(gtk_builder_get_object(a.connectionBuilder, "connection_window"));
     gtk_entry_set_text(GTK_ENTRY(gtk_builder_get_object(a.connectionBuilder, "username_entry")), g_get_user_name());
@@ -147,80 +550,359 @@ void launch_connection_dialog(GtkMenuItem *, gpointer data) {
     gtk_widget_show_all(connectionWindow);
 }
 
+void new_tab_activated(GtkMenuItem *, gpointer data) {
+    new_session(*reinterpret_cast<App*>(data));
+}
+
+void close_tab_activated(GtkMenuItem *, gpointer data) {
+    Session *s = current_session(*reinterpret_cast<App*>(data));
+    if(s) {
+        close_session(s);
+    }
+}
+
+void copy_activated(GtkMenuItem *, gpointer data) {
+    Session *s = current_session(*reinterpret_cast<App*>(data));
+    if(s) {
+        vte_terminal_copy_clipboard_format(s->terminal, VTE_FORMAT_TEXT);
+    }
+}
+
+void paste_activated(GtkMenuItem *, gpointer data) {
+    Session *s = current_session(*reinterpret_cast<App*>(data));
+    if(s) {
+        vte_terminal_paste_clipboard(s->terminal);
+    }
+}
+
+// FIXME, applies to the current tab only, the check mark does not
+// follow tab switches.
+void local_echo_toggled(GtkCheckMenuItem *item, gpointer data) {
+    Session *s = current_session(*reinterpret_cast<App*>(data));
+    if(s) {
+        set_local_echo(s->echo, gtk_check_menu_item_get_active(item));
+    }
+}
+
+void show_latency(GtkMenuItem *, gpointer data) {
+    App &a = *reinterpret_cast<App*>(data);
+    Session *s = current_session(a);
+    if(!s || !s->connected) {
+        return;
+    }
+    App *app = &a;
+    run_on_io(a.io, [app, s]() {
+        std::string text = describe_latency(s->input.latency);
+        run_on_ui(app->io, [app, text]() {
+            show_message(*app, GTK_MESSAGE_INFO, "Keystroke to echo latency", text);
+        });
+    });
+}
+
+void show_timings(GtkMenuItem *, gpointer data) {
+    App &a = *reinterpret_cast<App*>(data);
+    Session *s = current_session(a);
+    if(!s || s->timings.empty()) {
+        return;
+    }
+    show_message(a, GTK_MESSAGE_INFO, "Connection timings", s->timings);
+}
+
+static MetricLabels with_label(MetricLabels labels, const char *name, const std::string &value) {
+    labels.emplace_back(name, value);
+    return labels;
+}
+
+static void add_direction_metric(MetricSet &set, const char *name, const char *help, const MetricLabels &labels,
+                                 uint64_t in, uint64_t out) {
+    add_metric(set, name, METRIC_COUNTER, help, with_label(labels, "direction", "in"), in);
+    add_metric(set, name, METRIC_COUNTER, help, with_label(labels, "direction", "out"), out);
+}
+
+static void add_channel_metrics(MetricSet &set, const MetricLabels &labels, const ChannelCounters &c, ssh_channel channel) {
+    add_direction_metric(set, "sshprog_channel_bytes_total", "Channel data, in is from the server.",
+                         labels, c.bytes_in, c.bytes_out);
+    add_direction_metric(set, "sshprog_channel_calls_total", "Successful channel reads (in) and writes (out).",
+                         labels, c.reads, c.writes);
+    add_metric(set, "sshprog_channel_window_bytes", METRIC_GAUGE, "What may be sent before the server makes room.",
+               labels, ssh_channel_window_size(channel));
+}
+
+static void add_buffer_metrics(MetricSet &set, const MetricLabels &labels, const char *buffer, const RingBuffer &r) {
+    MetricLabels l = with_label(labels, "buffer", buffer);
+    add_metric(set, "sshprog_buffer_used_bytes", METRIC_GAUGE, "Data waiting in a buffer.", l, r.used);
+    add_metric(set, "sshprog_buffer_size_bytes", METRIC_GAUGE, "Memory a buffer holds, it grows up to its limit.",
+               l, r.data.size());
+}
+
+static void collect_forward_rule(MetricSet &set, const MetricLabels &session, ForwardRule &rule, const std::string &port) {
+    MetricLabels labels = with_label(session, "port", port);
+    add_metric(set, "sshprog_forward_connections", METRIC_GAUGE, "Open forwarded connections.",
+               labels, rule.connections.size());
+    add_metric(set, "sshprog_forward_accepted_total", METRIC_COUNTER, "Connections accepted.", labels, rule.accepted);
+    ChannelCounters total = rule.closed;
+    for(auto fs : rule.connections) {
+        MetricLabels l = with_label(with_label(session, "channel", "forward"), "port", port);
+        l = with_label(l, "connection", std::to_string(fs->id));
+        add_channel_metrics(set, l, fs->counters, fs->channel);
+        add_buffer_metrics(set, l, "to_channel", fs->to_channel);
+        add_buffer_metrics(set, l, "to_network", fs->to_network);
+        total.bytes_in += fs->counters.bytes_in;
+        total.bytes_out += fs->counters.bytes_out;
+    }
+    add_direction_metric(set, "sshprog_forward_bytes_total", "Data of all connections ever accepted, in is from the server.",
+                         labels, total.bytes_in, total.bytes_out);
+}
+
+static void collect_transfers(MetricSet &set, const MetricLabels &session, TransferManager &tm) {
+    add_metric(set, "sshprog_transfer_jobs", METRIC_GAUGE, "Files being or waiting to be transferred.",
+               with_label(session, "state", "queued"), tm.queued.size());
+    add_metric(set, "sshprog_transfer_jobs", METRIC_GAUGE, "Files being or waiting to be transferred.",
+               with_label(session, "state", "active"), tm.active.size());
+    add_metric(set, "sshprog_transfer_walks", METRIC_GAUGE, "Directories being read.", session, tm.walks.size());
+    add_metric(set, "sshprog_transfer_bytes_total", METRIC_COUNTER, "File data transferred.", session, tm.bytes_moved);
+    add_metric(set, "sshprog_transfer_files_total", METRIC_COUNTER, "Files finished.",
+               with_label(session, "result", "done"), tm.files_done);
+    add_metric(set, "sshprog_transfer_files_total", METRIC_COUNTER, "Files finished.",
+               with_label(session, "result", "failed"), tm.files_failed);
+    add_metric(set, "sshprog_transfer_delta_saved_bytes_total", METRIC_COUNTER,
+               "File data that delta transfers did not need to send.", session, tm.delta_saved);
+    if(tm.sftp) {
+        add_metric(set, "sshprog_channel_window_bytes", METRIC_GAUGE, "What may be sent before the server makes room.",
+                   with_label(session, "channel", "sftp"), ssh_channel_window_size(tm.sftp->channel));
+    }
+    for(const auto &job : tm.active) {
+        MetricLabels l = with_label(session, "job", std::to_string(job->id));
+        l = with_label(l, "direction", transfer_direction_name(job->direction));
+        l = with_label(l, "file", job->remote_path);
+        add_metric(set, "sshprog_transfer_job_done_bytes", METRIC_GAUGE, "Progress of a running transfer.",
+                   l, job->transferred);
+        add_metric(set, "sshprog_transfer_job_size_bytes", METRIC_GAUGE, "Size of a running transfer.", l, job->size);
+        if(job->use_delta || !job_moves_data(*job)) {
+            continue;
+        }
+        bool download = job->direction == TRANSFER_DOWNLOAD;
+        add_metric(set, "sshprog_transfer_requests", METRIC_GAUGE, "SFTP requests waiting for their reply.",
+                   l, download ? job->download.requests.size() : job->upload.requests.size());
+        add_metric(set, "sshprog_transfer_disk_ops", METRIC_GAUGE, "Chunks waiting for the disk.",
+                   l, download ? job->download.writes.size() : job->upload.reads.size());
+        add_metric(set, "sshprog_transfer_reply_seconds", METRIC_GAUGE, "Smoothed time from request to reply.",
+                   l, (download ? job->download.reply_time : job->upload.reply_time)/1e6);
+    }
+}
+
+static void add_latency_metrics(MetricSet &set, const char *name, const char *help, const MetricLabels &labels,
+                                const LatencyHistogram &h) {
+    if(h.count == 0) {
+        return;
+    }
+    add_metric(set, name, METRIC_GAUGE, help, with_label(labels, "quantile", "0.5"), latency_percentile(h, 0.5)/1e6);
+    add_metric(set, name, METRIC_GAUGE, help, with_label(labels, "quantile", "0.99"), latency_percentile(h, 0.99)/1e6);
+    add_metric(set, name, METRIC_GAUGE, help, with_label(labels, "quantile", "1"), h.max/1e6);
+}
+
+// Called on the I/O thread, both for the metrics socket and the window.
+void collect_metrics(MetricSet &set, void *data) {
+    App &a = *reinterpret_cast<App*>(data);
+    add_metric(set, "sshprog_io_queued_tasks", METRIC_GAUGE, "Tasks passed between threads and not yet run.",
+               MetricLabels{{"queue", "to_io"}}, queued_tasks(a.io.to_io));
+    add_metric(set, "sshprog_io_queued_tasks", METRIC_GAUGE, "Tasks passed between threads and not yet run.",
+               MetricLabels{{"queue", "to_ui"}}, queued_tasks(a.io.to_ui));
+    add_latency_metrics(set, "sshprog_io_loop_lag_seconds", "How late the I/O thread's timers fire.",
+                        MetricLabels(), a.io_probe.lag);
+    add_metric(set, "sshprog_disk_spare_buffers", METRIC_GAUGE, "Disk buffers ready for reuse.",
+               MetricLabels(), a.disk.spare.size());
+    for(auto s : a.live_sessions) {
+        const Connector &c = s->connector;
+        MetricLabels session{{"session", c.username + "@" + c.host + ":" + std::to_string(c.port)}};
+        add_direction_metric(set, "sshprog_session_wire_bytes_total", "Bytes on the socket, after compression and encryption.",
+                             session, s->wire_counter.in_bytes, s->wire_counter.out_bytes);
+        add_direction_metric(set, "sshprog_session_payload_bytes_total", "Packet payload before compression and encryption.",
+                             session, s->payload_counter.in_bytes, s->payload_counter.out_bytes);
+        add_direction_metric(set, "sshprog_session_packets_total", "SSH packets.",
+                             session, s->payload_counter.in_packets, s->payload_counter.out_packets);
+
+        MetricLabels terminal = with_label(session, "channel", "terminal");
+        add_channel_metrics(set, terminal, s->input.counters, s->pty);
+        add_buffer_metrics(set, terminal, "input", s->input.pending);
+        add_latency_metrics(set, "sshprog_echo_latency_seconds", "Time from a keystroke to the next output.",
+                            session, s->input.latency);
+
+        for(auto &r : s->ports.rules) {
+            collect_forward_rule(set, session, *r.second, std::to_string(r.first));
+        }
+        if(s->control.rule.listener) {
+            collect_forward_rule(set, session, s->control.rule, "control");
+        }
+        collect_transfers(set, session, s->sftp_win.transfers);
+    }
+}
+
+void show_statistics(GtkMenuItem *, gpointer data) {
+    App &a = *reinterpret_cast<App*>(data);
+    show_stats_window(a.stats, a.io, collect_metrics, &a);
+}
+
 void open_sftp_window(GtkMenuItem *, gpointer data) {
     App &a = *reinterpret_cast<App*>(data);
-    build_sftp_win(a.sftp_win);
-    a.sftp_win.sftp = a.session.open_sftp_session();
-    open_sftp(a.sftp_win);
-    gtk_widget_show_all(GTK_WIDGET(a.sftp_win.sftp_window));
+    Session *s = current_session(a);
+    if(!s || !s->connected) {
+        return;
+    }
+    if(s->sftp_win.builder) {
+        gtk_window_present(s->sftp_win.sftp_window);
+        return;
+    }
+    build_sftp_win(s->sftp_win);
+    gtk_window_set_title(s->sftp_win.sftp_window, gtk_label_get_text(s->label));
+    bool delta = gtk_toggle_button_get_active(s->sftp_win.delta_check);
+    run_on_io(a.io, [s, delta]() {
+        s->sftp_win.sftp = s->session.open_sftp_session();
+        open_sftp(s->sftp_win, delta);
+    });
+    gtk_widget_show_all(GTK_WIDGET(s->sftp_win.sftp_window));
 }
 
 void open_forwardings_window(GtkMenuItem *, gpointer data) {
-    App &a = *reinterpret_cast<App*>(data);
-    gtk_widget_show_all(GTK_WIDGET(a.ports.forwardWindow));
+    Session *s = current_session(*reinterpret_cast<App*>(data));
+    if(!s || !s->connected) {
+        return;
+    }
+    gtk_window_set_title(s->ports.forwardWindow, gtk_label_get_text(s->label));
+    gtk_widget_show_all(GTK_WIDGET(s->ports.forwardWindow));
 }
 
+void tab_switched(GtkNotebook *, GtkWidget *page, guint, gpointer data) {
+    App &a = *reinterpret_cast<App*>(data);
+    for(const auto &s : a.sessions) {
+        if(s->page == page) {
+            set_tab_title(a, *s, gtk_label_get_text(s->label));
+            gtk_widget_grab_focus(GTK_WIDGET(s->terminal));
+            return;
+        }
+    }
+}
 
 void build_gui(App &app) {
-    GtkWidget *hbox;
     GtkWidget *vbox;
-    GtkWidget *scrollBar;
     GtkWidget *menubar;
     GtkWidget *filemenu;
+    GtkWidget *editmenu;
     GtkWidget *actionmenu;
+    GtkAccelGroup *accel;
 
     app.mainWindow = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-    build_port_gui(app.ports);
+    accel = gtk_accel_group_new();
+    gtk_window_add_accel_group(GTK_WINDOW(app.mainWindow), accel);
     gtk_window_set_title(GTK_WINDOW(app.mainWindow), "Unnamed SSH client");
     vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
-    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
 
     menubar = gtk_menu_bar_new();
     filemenu = gtk_menu_new();
     GtkWidget *fmenu = gtk_menu_item_new_with_label("File");
     gtk_menu_item_set_submenu(GTK_MENU_ITEM(fmenu), filemenu);
     auto connect = gtk_menu_item_new_with_label("Connect");
+    auto new_tab = gtk_menu_item_new_with_label("New tab");
+    auto close_tab = gtk_menu_item_new_with_label("Close tab");
     auto quit = gtk_menu_item_new_with_label("Quit");
+    gtk_widget_add_accelerator(new_tab, "activate", accel, GDK_KEY_T,
+                               (GdkModifierType)(GDK_CONTROL_MASK | GDK_SHIFT_MASK), GTK_ACCEL_VISIBLE);
+    gtk_widget_add_accelerator(close_tab, "activate", accel, GDK_KEY_W,
+                               (GdkModifierType)(GDK_CONTROL_MASK | GDK_SHIFT_MASK), GTK_ACCEL_VISIBLE);
     gtk_menu_shell_append(GTK_MENU_SHELL(filemenu), connect);
     g_signal_connect(connect, "activate", G_CALLBACK(launch_connection_dialog), &app);
+    gtk_menu_shell_append(GTK_MENU_SHELL(filemenu), new_tab);
+    g_signal_connect(new_tab, "activate", G_CALLBACK(new_tab_activated), &app);
+    gtk_menu_shell_append(GTK_MENU_SHELL(filemenu), close_tab);
+    g_signal_connect(close_tab, "activate", G_CALLBACK(close_tab_activated), &app);
     gtk_menu_shell_append(GTK_MENU_SHELL(filemenu), quit);
     g_signal_connect(quit, "activate", G_CALLBACK(gtk_main_quit), NULL);
     gtk_menu_shell_append(GTK_MENU_SHELL(menubar), fmenu);
 
+    editmenu = gtk_menu_new();
+    GtkWidget *emenu = gtk_menu_item_new_with_label("Edit");
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(emenu), editmenu);
+    auto copy = gtk_menu_item_new_with_label("Copy");
+    auto paste = gtk_menu_item_new_with_label("Paste");
+    gtk_widget_add_accelerator(copy, "activate", accel, GDK_KEY_C,
+                               (GdkModifierType)(GDK_CONTROL_MASK | GDK_SHIFT_MASK), GTK_ACCEL_VISIBLE);
+    gtk_widget_add_accelerator(paste, "activate", accel, GDK_KEY_V,
+                               (GdkModifierType)(GDK_CONTROL_MASK | GDK_SHIFT_MASK), GTK_ACCEL_VISIBLE);
+    gtk_menu_shell_append(GTK_MENU_SHELL(editmenu), copy);
+    gtk_menu_shell_append(GTK_MENU_SHELL(editmenu), paste);
+    auto local_echo = gtk_check_menu_item_new_with_label("Predict local echo");
+    gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(local_echo), TRUE);
+    gtk_menu_shell_append(GTK_MENU_SHELL(editmenu), local_echo);
+    g_signal_connect(local_echo, "toggled", G_CALLBACK(local_echo_toggled), &app);
+    g_signal_connect(copy, "activate", G_CALLBACK(copy_activated), &app);
+    g_signal_connect(paste, "activate", G_CALLBACK(paste_activated), &app);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menubar), emenu);
+
     actionmenu = gtk_menu_new();
     GtkWidget *amenu = gtk_menu_item_new_with_label("Actions");
     gtk_menu_item_set_submenu(GTK_MENU_ITEM(amenu), actionmenu);
     auto opensftp = gtk_menu_item_new_with_label("Open file transfer");
     auto openforward = gtk_menu_item_new_with_label("Open port forwardings");
+    auto latency = gtk_menu_item_new_with_label("Input latency");
+    auto timings = gtk_menu_item_new_with_label("Connection timings");
+    auto statistics = gtk_menu_item_new_with_label("Statistics");
     gtk_menu_shell_append(GTK_MENU_SHELL(actionmenu), opensftp);
     gtk_menu_shell_append(GTK_MENU_SHELL(actionmenu), openforward);
+    gtk_menu_shell_append(GTK_MENU_SHELL(actionmenu), latency);
+    gtk_menu_shell_append(GTK_MENU_SHELL(actionmenu), timings);
+    gtk_menu_shell_append(GTK_MENU_SHELL(actionmenu), statistics);
     g_signal_connect(opensftp, "activate", G_CALLBACK(open_sftp_window), &app);
     g_signal_connect(openforward, "activate", G_CALLBACK(open_forwardings_window), &app);
+    g_signal_connect(latency, "activate", G_CALLBACK(show_latency), &app);
+    g_signal_connect(timings, "activate", G_CALLBACK(show_timings), &app);
+    g_signal_connect(statistics, "activate", G_CALLBACK(show_statistics), &app);
     gtk_menu_shell_append(GTK_MENU_SHELL(menubar), amenu);
 
-    gtk_box_pack_start(GTK_BOX(vbox), menubar, FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(vbox), hbox, TRUE, TRUE, 0);
-
-    app.terminal = VTE_TERMINAL(vte_terminal_new());
-    vte_terminal_set_size(app.terminal, 80, 25);
-    vte_terminal_set_cursor_blink_mode(app.terminal, VTE_CURSOR_BLINK_OFF);
+    app.notebook = GTK_NOTEBOOK(gtk_notebook_new());
+    gtk_notebook_set_scrollable(app.notebook, TRUE);
+    g_signal_connect(app.notebook, "switch-page", G_CALLBACK(tab_switched), &app);
 
-    scrollBar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(app.terminal)));
-    gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(app.terminal), TRUE, TRUE, 0);
-    gtk_box_pack_end(GTK_BOX(hbox), scrollBar, FALSE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), menubar, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), GTK_WIDGET(app.notebook), TRUE, TRUE, 0);
     gtk_container_add(GTK_CONTAINER(app.mainWindow), vbox);
     g_signal_connect(app.mainWindow, "destroy", G_CALLBACK(gtk_main_quit), nullptr);
-    g_signal_connect(GTK_WIDGET(app.terminal), "key-press-event", G_CALLBACK(key_pressed_cb), &app);
+    new_session(app);
 }
 
 int main(int argc, char **argv) {
+    // Batch jobs need neither a display nor GTK's startup cost.
+    if(is_batch_mode(argc, argv)) {
+        return run_batch(argc, argv);
+    }
     struct App *app = new App();
 
     gtk_init(&argc, &argv);
+    start_algorithm_tuner(app->tuner);
+    start_io_thread(app->io);
+    run_on_io(app->io, [app]() {
+        init_disk_io(app->disk, disk_io_done, app);
+        open_journal(app->journal, app->disk);
+        start_loop_probe(app->io_probe);
+        std::string path = metrics_socket_path();
+        open_metrics_server(app->metrics, path.c_str(), collect_metrics, app);
+    });
     build_gui(*app);
 
     gtk_widget_show_all(app->mainWindow);
     gtk_main();
+    // Writes in flight must not outlive the disk threads.
+    run_on_io(app->io, [app]() {
+        for(auto s : app->live_sessions) {
+            cancel_transfers(s->sftp_win.transfers);
+            close_control_socket(s->control);
+        }
+        close_metrics_server(app->metrics);
+        stop_loop_probe(app->io_probe);
+        close_journal(app->journal);
+        close_disk_io(app->disk);
+    });
+    stop_io_thread(app->io);
+    stop_algorithm_tuner(app->tuner);
     delete app;
     return 0;
 }
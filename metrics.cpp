@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<metrics.hpp>
+#include<util.hpp>
+#include<gio/gunixsocketaddress.h>
+#include<glib/gstdio.h>
+#include<algorithm>
+#include<cmath>
+#include<cstring>
+#include<unistd.h>
+
+void add_metric(MetricSet &set, const char *name, MetricType type, const char *help,
+                const MetricLabels &labels, double value) {
+    auto it = std::find_if(set.metrics.begin(), set.metrics.end(),
+                           [name](const Metric &m) { return m.name == name; });
+    if(it == set.metrics.end()) {
+        set.metrics.push_back(Metric{name, type, help, std::vector<MetricSample>()});
+        it = set.metrics.end() - 1;
+    }
+    it->samples.push_back(MetricSample{labels, value});
+}
+
+std::string format_metric_value(double value) {
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    // Byte counters go past what %g shows exactly.
+    if(value == std::floor(value) && std::fabs(value) < 1e15) {
+        g_ascii_formatd(buf, sizeof(buf), "%.0f", value);
+    } else {
+        g_ascii_formatd(buf, sizeof(buf), "%.6g", value);
+    }
+    return buf;
+}
+
+static std::string escape_label(const std::string &value) {
+    std::string result;
+    for(char c : value) {
+        if(c == '\\' || c == '"') {
+            result += '\\';
+            result += c;
+        } else if(c == '\n') {
+            result += "\\n";
+        } else {
+            result += c;
+        }
+    }
+    return result;
+}
+
+std::string format_labels(const MetricLabels &labels) {
+    std::string result;
+    for(const auto &l : labels) {
+        if(!result.empty()) {
+            result += ",";
+        }
+        result += l.first + "=\"" + escape_label(l.second) + "\"";
+    }
+    return result;
+}
+
+std::string format_prometheus(const MetricSet &set) {
+    std::string result;
+    for(const auto &m : set.metrics) {
+        result += "# HELP " + m.name + " " + m.help + "\n";
+        result += "# TYPE " + m.name + (m.type == METRIC_COUNTER ? " counter\n" : " gauge\n");
+        for(const auto &s : m.samples) {
+            result += m.name;
+            if(!s.labels.empty()) {
+                result += "{" + format_labels(s.labels) + "}";
+            }
+            result += " " + format_metric_value(s.value) + "\n";
+        }
+    }
+    return result;
+}
+
+static std::string json_string(const std::string &s) {
+    std::string result = "\"";
+    for(char c : s) {
+        if(c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            result += buf;
+        } else {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+std::string format_json(const MetricSet &set) {
+    std::string result = "{\"metrics\":[";
+    for(size_t i=0; i<set.metrics.size(); i++) {
+        const Metric &m = set.metrics[i];
+        if(i > 0) {
+            result += ",";
+        }
+        result += "{\"name\":" + json_string(m.name);
+        result += ",\"type\":" + std::string(m.type == METRIC_COUNTER ? "\"counter\"" : "\"gauge\"");
+        result += ",\"help\":" + json_string(m.help) + ",\"samples\":[";
+        for(size_t j=0; j<m.samples.size(); j++) {
+            const MetricSample &s = m.samples[j];
+            if(j > 0) {
+                result += ",";
+            }
+            result += "{\"labels\":{";
+            for(size_t k=0; k<s.labels.size(); k++) {
+                if(k > 0) {
+                    result += ",";
+                }
+                result += json_string(s.labels[k].first) + ":" + json_string(s.labels[k].second);
+            }
+            result += "},\"value\":" + format_metric_value(s.value) + "}";
+        }
+        result += "]}";
+    }
+    return result + "]}\n";
+}
+
+static gboolean loop_probe_tick(gpointer data) {
+    LoopProbe &p = *reinterpret_cast<LoopProbe*>(data);
+    gint64 now = g_get_monotonic_time();
+    record_latency(p.lag, std::max<gint64>(now - p.due, 0));
+    p.due = now + LOOP_PROBE_INTERVAL_MS*1000;
+    return G_SOURCE_CONTINUE;
+}
+
+void start_loop_probe(LoopProbe &p) {
+    p.lag = LatencyHistogram();
+    p.due = g_get_monotonic_time() + LOOP_PROBE_INTERVAL_MS*1000;
+    p.source = thread_timeout_add(LOOP_PROBE_INTERVAL_MS, loop_probe_tick, &p);
+}
+
+void stop_loop_probe(LoopProbe &p) {
+    if(p.source) {
+        thread_source_remove(p.source);
+        p.source = 0;
+    }
+}
+
+std::string metrics_socket_path() {
+    std::string name = "metrics-" + std::to_string(getpid());
+    gchar *path = g_build_filename(g_get_user_runtime_dir(), "sshprog", name.c_str(), nullptr);
+    std::string result(path);
+    g_free(path);
+    return result;
+}
+
+static void drop_request(MetricsRequest *req) {
+    auto &requests = req->parent->requests;
+    if(req->watch) {
+        thread_source_remove(req->watch);
+    }
+    g_io_channel_unref(req->channel);
+    g_io_stream_close(G_IO_STREAM(req->connection), nullptr, nullptr);
+    g_object_unref(G_OBJECT(req->connection));
+    for(auto it = requests.begin(); it != requests.end(); ++it) {
+        if(it->get() == req) {
+            requests.erase(it);
+            return;
+        }
+    }
+}
+
+static gboolean reply_writable(GIOChannel *, GIOCondition, gpointer data) {
+    MetricsRequest *req = reinterpret_cast<MetricsRequest*>(data);
+    GOutputStream *ostream = g_io_stream_get_output_stream(G_IO_STREAM(req->connection));
+    while(req->reply_pos < req->reply.size()) {
+        GError *err = nullptr;
+        gssize written = g_pollable_output_stream_write_nonblocking(G_POLLABLE_OUTPUT_STREAM(ostream),
+                                                                   req->reply.data() + req->reply_pos,
+                                                                   req->reply.size() - req->reply_pos,
+                                                                   nullptr, &err);
+        if(written < 0) {
+            bool again = g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+            if(!again) {
+                printf("Error writing metrics: %s\n", err->message);
+            }
+            g_error_free(err);
+            if(again) {
+                return TRUE;
+            }
+            break;
+        }
+        req->reply_pos += written;
+    }
+    req->watch = 0;
+    drop_request(req);
+    return FALSE;
+}
+
+static std::string http_reply(const char *status, const char *content_type, const std::string &body) {
+    return std::string("HTTP/1.0 ") + status + "\r\nContent-Type: " + content_type +
+        "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+}
+
+// Returns false until the whole request has arrived.
+static bool build_reply(MetricsRequest &req) {
+    MetricsServer &ms = *req.parent;
+    auto line_end = req.text.find('\n');
+    if(line_end == std::string::npos) {
+        return false;
+    }
+    std::string line = req.text.substr(0, line_end);
+    if(!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    bool http = line.compare(0, 4, "GET ") == 0;
+    // The headers are read through so that closing does not reset the
+    // connection under the client.
+    if(http && req.text.find("\r\n\r\n") == std::string::npos && req.text.find("\n\n") == std::string::npos) {
+        return false;
+    }
+    std::string format = line;
+    if(http) {
+        auto path_end = line.find(' ', 4);
+        std::string path = line.substr(4, path_end == std::string::npos ? std::string::npos : path_end - 4);
+        format = path == "/metrics" ? "prometheus" : path == "/metrics.json" ? "json" : "";
+    } else if(format.empty()) {
+        format = "prometheus";
+    }
+    if(format != "prometheus" && format != "json") {
+        req.reply = http ? http_reply("404 Not Found", "text/plain", "Try /metrics or /metrics.json.\n")
+                         : "error unknown format\n";
+        return true;
+    }
+    MetricSet set;
+    ms.collect(set, ms.collect_data);
+    if(format == "json") {
+        std::string body = format_json(set);
+        req.reply = http ? http_reply("200 OK", "application/json", body) : body;
+    } else {
+        std::string body = format_prometheus(set);
+        req.reply = http ? http_reply("200 OK", "text/plain; version=0.0.4", body) : body;
+    }
+    return true;
+}
+
+static gboolean request_readable(GIOChannel *, GIOCondition, gpointer data) {
+    MetricsRequest *req = reinterpret_cast<MetricsRequest*>(data);
+    GInputStream *istream = g_io_stream_get_input_stream(G_IO_STREAM(req->connection));
+    while(true) {
+        char buf[1024];
+        GError *err = nullptr;
+        gssize r = g_pollable_input_stream_read_nonblocking(G_POLLABLE_INPUT_STREAM(istream),
+                                                           buf, sizeof(buf), nullptr, &err);
+        if(r < 0) {
+            bool again = g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+            if(!again) {
+                printf("Error reading metrics request: %s\n", err->message);
+            }
+            g_error_free(err);
+            if(again) {
+                return TRUE;
+            }
+            break;
+        }
+        if(r == 0) {
+            // A client that closes its end after a bare line still
+            // gets its reply.
+            if(!req->text.empty() && req->text.back() != '\n') {
+                req->text.push_back('\n');
+            }
+            if(!build_reply(*req)) {
+                break;
+            }
+        } else {
+            req->text.append(buf, r);
+            if(req->text.size() > METRICS_MAX_REQUEST) {
+                break;
+            }
+            if(!build_reply(*req)) {
+                continue;
+            }
+        }
+        req->reply_pos = 0;
+        req->watch = thread_io_add_watch(req->channel, (GIOCondition)(G_IO_OUT | G_IO_HUP | G_IO_ERR), reply_writable, req);
+        return FALSE;
+    }
+    // Returning FALSE removes the watch.
+    req->watch = 0;
+    drop_request(req);
+    return FALSE;
+}
+
+static gboolean metrics_incoming(GSocketService *, GSocketConnection *connection, GObject *, gpointer user_data) {
+    MetricsServer &ms = *reinterpret_cast<MetricsServer*>(user_data);
+    ms.requests.emplace_back(new MetricsRequest());
+    MetricsRequest *req = ms.requests.back().get();
+    req->parent = &ms;
+    req->connection = connection;
+    g_object_ref(G_OBJECT(connection));
+    req->channel = g_io_channel_unix_new(g_socket_get_fd(g_socket_connection_get_socket(connection)));
+    req->watch = thread_io_add_watch(req->channel, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), request_readable, req);
+    return TRUE;
+}
+
+bool open_metrics_server(MetricsServer &ms, const char *path, MetricsCollector collect, void *data) {
+    gchar *dir = g_path_get_dirname(path);
+    int rc = g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    if(rc != 0) {
+        printf("Could not create directory for %s.\n", path);
+        return false;
+    }
+    // The name has our pid in it, so anything there is stale.
+    g_unlink(path);
+    GSocketAddress *address = g_unix_socket_address_new(path);
+    ms.service = g_socket_service_new();
+    GError *err = nullptr;
+    bool ok = g_socket_listener_add_address(G_SOCKET_LISTENER(ms.service), address, G_SOCKET_TYPE_STREAM,
+                                            G_SOCKET_PROTOCOL_DEFAULT, nullptr, nullptr, &err);
+    g_object_unref(G_OBJECT(address));
+    if(!ok) {
+        printf("Could not listen on %s: %s\n", path, err->message);
+        g_error_free(err);
+        g_object_unref(G_OBJECT(ms.service));
+        ms.service = nullptr;
+        return false;
+    }
+    g_chmod(path, 0600);
+    ms.path = path;
+    ms.collect = collect;
+    ms.collect_data = data;
+    g_signal_connect(G_OBJECT(ms.service), "incoming", G_CALLBACK(metrics_incoming), &ms);
+    return true;
+}
+
+void close_metrics_server(MetricsServer &ms) {
+    if(!ms.service) {
+        return;
+    }
+    g_socket_service_stop(ms.service);
+    g_socket_listener_close(G_SOCKET_LISTENER(ms.service));
+    g_object_unref(G_OBJECT(ms.service));
+    ms.service = nullptr;
+    g_unlink(ms.path.c_str());
+    while(!ms.requests.empty()) {
+        drop_request(ms.requests.back().get());
+    }
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<terminput.hpp>
+#include<gio/gio.h>
+#include<memory>
+#include<string>
+#include<utility>
+#include<vector>
+
+// Longest request a metrics client may send, headers included.
+static const constexpr size_t METRICS_MAX_REQUEST = 8192;
+// How often the event loop checks how late it runs.
+static const constexpr guint LOOP_PROBE_INTERVAL_MS = 100;
+
+enum MetricType {
+    METRIC_COUNTER, // Only grows, rates are taken from it.
+    METRIC_GAUGE,
+};
+
+typedef std::vector<std::pair<std::string, std::string>> MetricLabels;
+
+struct MetricSample {
+    MetricLabels labels;
+    double value;
+};
+
+struct Metric {
+    std::string name;
+    MetricType type;
+    std::string help;
+    std::vector<MetricSample> samples;
+};
+
+/*
+ * A snapshot of every metric, gathered in one go on the I/O thread and
+ * then formatted or shown wherever it is needed.
+ */
+struct MetricSet {
+    std::vector<Metric> metrics;
+};
+
+// Samples of the same name go under one metric, the first call gives
+// its type and help.
+void add_metric(MetricSet &set, const char *name, MetricType type, const char *help,
+                const MetricLabels &labels, double value);
+std::string format_prometheus(const MetricSet &set);
+std::string format_json(const MetricSet &set);
+// Locale independent, integers without a fraction.
+std::string format_metric_value(double value);
+// name="value",... as in the Prometheus format.
+std::string format_labels(const MetricLabels &labels);
+
+/*
+ * Measures how late a timer fires on the loop it was started on. Work
+ * that hogs the loop shows up here before anywhere else.
+ */
+struct LoopProbe {
+    guint source;
+    gint64 due;
+    LatencyHistogram lag;
+};
+
+void start_loop_probe(LoopProbe &p);
+void stop_loop_probe(LoopProbe &p);
+
+typedef void (*MetricsCollector)(MetricSet &set, void *data);
+
+struct MetricsServer;
+
+// A client that has connected and is sending its request or getting
+// its reply.
+struct MetricsRequest {
+    MetricsServer *parent;
+    GSocketConnection *connection;
+    GIOChannel *channel;
+    guint watch;
+    std::string text;
+    std::string reply;
+    size_t reply_pos;
+};
+
+/*
+ * Serves the metrics over a Unix socket. A client either sends one
+ * line, "prometheus" or "json", or a HTTP GET for /metrics or
+ * /metrics.json, so that curl --unix-socket works. It gets the text
+ * and the connection is closed.
+ *
+ * Lives on the I/O thread, where the collector is called.
+ */
+struct MetricsServer {
+    GSocketService *service;
+    std::string path;
+    MetricsCollector collect;
+    void *collect_data;
+    std::vector<std::unique_ptr<MetricsRequest>> requests;
+};
+
+// $XDG_RUNTIME_DIR/sshprog/metrics-<pid>
+std::string metrics_socket_path();
+
+bool open_metrics_server(MetricsServer &ms, const char *path, MetricsCollector collect, void *data);
+void close_metrics_server(MetricsServer &ms);
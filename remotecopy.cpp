@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<remotecopy.hpp>
+#include<glib.h>
+#include<algorithm>
+#include<cstdio>
+
+static std::string copy_command(const RemoteCopy &rc) {
+    gchar *from = g_shell_quote(rc.from.c_str());
+    gchar *to = g_shell_quote(rc.to.c_str());
+    // -p keeps modes and times, as a rename would.
+    std::string cmd = std::string(rc.move ? "mv -- " : "cp -pR -- ") + from + " " + to;
+    g_free(from);
+    g_free(to);
+    return cmd;
+}
+
+bool start_remote_copy(RemoteCopy &rc, ssh_session session, sftp_session sftp,
+                       const char *from, const char *to, bool move) {
+    rc.session = session;
+    rc.channel = SshChannel();
+    rc.from = from;
+    rc.to = to;
+    rc.move = move;
+    rc.done = false;
+    rc.errors.clear();
+    rc.size = 0;
+    sftp_attributes attr = sftp_lstat(sftp, from);
+    if(!attr) {
+        printf("Could not find %s: %s\n", from, ssh_get_error(session));
+        return false;
+    }
+    if(attr->type == SSH_FILEXFER_TYPE_REGULAR) {
+        rc.size = attr->size;
+    }
+    sftp_attributes_free(attr);
+    // cp and mv would put the file inside an existing directory and
+    // replace an existing file, neither of which was asked for.
+    attr = sftp_lstat(sftp, to);
+    if(attr) {
+        sftp_attributes_free(attr);
+        printf("Could not copy %s: %s already exists.\n", from, to);
+        return false;
+    }
+    if(move && sftp_rename(sftp, from, to) == SSH_OK) {
+        rc.done = true;
+        return true;
+    }
+    std::string cmd = copy_command(rc);
+    rc.channel = open_exec_channel(session, cmd.c_str());
+    return rc.channel != nullptr;
+}
+
+bool feed_remote_copy(RemoteCopy &rc) {
+    if(rc.done) {
+        return true;
+    }
+    char buf[4096];
+    for(int is_stderr=0; is_stderr<2; is_stderr++) {
+        int num_read;
+        while((num_read = ssh_channel_read_nonblocking(rc.channel, buf, sizeof(buf), is_stderr)) > 0) {
+            if(is_stderr) {
+                size_t room = REMOTE_COPY_MAX_ERRORS - std::min(rc.errors.size(), REMOTE_COPY_MAX_ERRORS);
+                rc.errors.append(buf, std::min<size_t>(num_read, room));
+            }
+        }
+        if(num_read == SSH_ERROR) {
+            printf("Could not read from remote %s: %s\n", rc.move ? "mv" : "cp", ssh_get_error(rc.session));
+            return false;
+        }
+    }
+    // The exit status comes before the channel is closed.
+    if(!ssh_channel_is_closed(rc.channel)) {
+        return true;
+    }
+    int status = ssh_channel_get_exit_status(rc.channel);
+    if(status != 0) {
+        printf("Remote %s of %s failed with status %d: %s\n", rc.move ? "mv" : "cp",
+               rc.from.c_str(), status, rc.errors.c_str());
+        return false;
+    }
+    rc.done = true;
+    return true;
+}
+
+void finish_remote_copy(RemoteCopy &rc) {
+    // FIXME, a cp that is still running is not stopped by closing
+    // its channel.
+    rc.channel = SshChannel();
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<ssh_util.hpp>
+#include<string>
+
+// How much of the remote command's complaints is kept for the log.
+static const constexpr size_t REMOTE_COPY_MAX_ERRORS = 4096;
+
+/*
+ * Copies or moves a file or directory from one place on the server to
+ * another without the data passing through us.
+ *
+ * Moves are tried as an SFTP rename first. libssh uses the
+ * posix-rename@openssh.com extension for it when the server has it.
+ * Renames do not work across file systems, in which case, as for all
+ * copies, cp or mv is run over an exec channel on the same session.
+ *
+ * FIXME, servers with the copy-data extension could copy within the
+ * SFTP session, but libssh has no way of sending it.
+ */
+struct RemoteCopy {
+    ssh_session session; // A non-owning pointer.
+    SshChannel channel;  // Null if the rename did the job.
+    std::string from;
+    std::string to;
+    bool move;
+    bool done;
+    std::string errors; // What the command wrote to stderr.
+    uint64_t size;      // Zero for directories.
+};
+
+// Fails if the destination exists.
+bool start_remote_copy(RemoteCopy &rc, ssh_session session, sftp_session sftp,
+                       const char *from, const char *to, bool move);
+// Returns false on failure, the copy is complete once done is set.
+bool feed_remote_copy(RemoteCopy &rc);
+void finish_remote_copy(RemoteCopy &rc);
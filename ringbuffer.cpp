@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<ringbuffer.hpp>
+
+#include<algorithm>
+#include<cstring>
+
+void ring_init(RingBuffer &r, size_t initial, size_t limit) {
+    size_t size = std::max<size_t>(std::min(initial, limit), 1);
+    // A recycled buffer of the right size is used as it is.
+    if(r.data.size() != size) {
+        r.data.assign(size, 0);
+    }
+    r.start = 0;
+    r.used = 0;
+    r.limit = std::max(limit, r.data.size());
+}
+
+void ring_clear(RingBuffer &r) {
+    r.start = 0;
+    r.used = 0;
+}
+
+void ring_recycle(RingBuffer &r, size_t keep) {
+    if(r.data.size() > keep) {
+        std::vector<char>().swap(r.data);
+    }
+    ring_clear(r);
+}
+
+size_t ring_free(const RingBuffer &r) {
+    return r.limit - r.used;
+}
+
+// Moves the contents to the front of a bigger buffer.
+static void ring_grow(RingBuffer &r, size_t capacity) {
+    std::vector<char> bigger(capacity);
+    size_t first = std::min(r.used, r.data.size() - r.start);
+    memcpy(bigger.data(), r.data.data() + r.start, first);
+    memcpy(bigger.data() + first, r.data.data(), r.used - first);
+    r.data.swap(bigger);
+    r.start = 0;
+}
+
+char* ring_write_ptr(RingBuffer &r, size_t want, size_t &len) {
+    size_t capacity = r.data.size();
+    if(capacity - r.used < want && capacity < r.limit) {
+        size_t new_capacity = capacity;
+        while(new_capacity - r.used < want && new_capacity < r.limit) {
+            new_capacity = std::min(new_capacity*2, r.limit);
+        }
+        ring_grow(r, new_capacity);
+        capacity = new_capacity;
+    }
+    size_t end = (r.start + r.used) % capacity;
+    if(r.used == capacity) {
+        len = 0;
+    } else if(end >= r.start) {
+        len = capacity - end;
+    } else {
+        len = r.start - end;
+    }
+    return r.data.data() + end;
+}
+
+void ring_commit(RingBuffer &r, size_t n) {
+    r.used += n;
+}
+
+const char* ring_read_ptr(const RingBuffer &r, size_t &len) {
+    len = std::min(r.used, r.data.size() - r.start);
+    return r.data.data() + r.start;
+}
+
+void ring_consume(RingBuffer &r, size_t n) {
+    r.used -= n;
+    if(r.used == 0) {
+        // Keeps the next writes contiguous.
+        r.start = 0;
+    } else {
+        r.start = (r.start + n) % r.data.size();
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<vector>
+#include<cstddef>
+
+/*
+ * A byte queue that starts small and doubles in size when it fills up,
+ * until it reaches its limit. Data is written and read in place through
+ * the contiguous regions that the accessors return, so that it can be
+ * handed directly to read and write calls.
+ */
+struct RingBuffer {
+    std::vector<char> data;
+    size_t start;
+    size_t used;
+    size_t limit;
+};
+
+void ring_init(RingBuffer &r, size_t initial, size_t limit);
+void ring_clear(RingBuffer &r);
+// Empties the buffer for its next user. The memory is kept if the
+// buffer is no bigger than keep, otherwise it is freed.
+void ring_recycle(RingBuffer &r, size_t keep);
+size_t ring_free(const RingBuffer &r);
+
+// Grows the buffer so that want bytes fit if the limit allows. The
+// region returned may still be shorter because of wrapping, len is
+// zero only if the buffer is full.
+char* ring_write_ptr(RingBuffer &r, size_t want, size_t &len);
+void ring_commit(RingBuffer &r, size_t n);
+
+const char* ring_read_ptr(const RingBuffer &r, size_t &len);
+void ring_consume(RingBuffer &r, size_t n);
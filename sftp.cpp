@@ -17,6 +17,7 @@
 
 #include<glades.hpp>
 #include<sftp.hpp>
+#include<cipherbench.hpp>
 
 
 #include<fcntl.h>
@@ -24,38 +25,7 @@
 #include<glib/gstdio.h>
 #include<vector>
 #include<algorithm>
-
-struct DirEntry {
-    std::string name;
-    bool is_dir;
-    uint64_t size;
-
-    // Sort by directoryness, then by name.
-    bool operator<(const DirEntry &other) const {
-        if(&other == this) {
-            return false;
-        }
-        if(is_dir && !other.is_dir) {
-            return true;
-        }
-        if(other.is_dir && !is_dir) {
-            return false;
-        }
-        if(name == ".") { // Each directory has only one of these.
-            return true;
-        }
-        if(other.name == ".") {
-            return false;
-        }
-        if(name == "..") {
-            return true;
-        }
-        if(other.name == "..") {
-            return false;
-        }
-        return name < other.name;
-    }
-};
+#include<cmath>
 
 enum SftpViewColumns {
     IS_DIR_COLUMN,
@@ -64,73 +34,329 @@ enum SftpViewColumns {
     N_COLUMNS,
 };
 
+enum TransferViewColumns {
+    TRANSFER_NAME_COLUMN,
+    TRANSFER_PROGRESS_COLUMN,
+    TRANSFER_STATUS_COLUMN,
+    TRANSFER_N_COLUMNS,
+};
+
 void upload_file(SftpWindow &sftp_win, const char *fname);
+void invalidate_listings(SftpWindow &s, const std::string &remote_path);
 
-void feed_sftp_download(SftpWindow &sftp_win) {
-    ssize_t bytes_written, bytes_read;
-    bytes_read = sftp_async_read(sftp_win.remote_file, sftp_win.buf, SFTP_BUF_SIZE, sftp_win.async_request);
-    if(bytes_read == SSH_AGAIN) {
-        return;
+const char* transfer_status_text(TransferStatus status) {
+    switch(status) {
+    case TRANSFER_QUEUED: return "Queued";
+    case TRANSFER_RUNNING: return "Running";
+    case TRANSFER_DONE: return "Done";
+    case TRANSFER_FAILED: return "Failed";
+    }
+    return "";
+}
+
+// A copy of what the transfer view shows, jobs live on the I/O thread.
+struct TransferUpdate {
+    int id;
+    TransferDirection direction;
+    std::string remote_path;
+    std::string source_path;
+    TransferStatus status;
+    uint64_t size;
+    uint64_t transferred;
+};
+
+void show_transfer(SftpWindow &sftp_win, const TransferUpdate &job) {
+    GtkTreeIter iter;
+    auto row = sftp_win.transfer_rows.find(job.id);
+    if(row == sftp_win.transfer_rows.end()) {
+        const char *arrow = job.direction == TRANSFER_DOWNLOAD ? "\u2193 " : job.direction == TRANSFER_UPLOAD ? "\u2191 " : "\u2192 ";
+        std::string name = arrow + split_filename(job.remote_path.c_str());
+        gtk_list_store_append(sftp_win.transfer_list, &iter);
+        gtk_list_store_set(sftp_win.transfer_list, &iter, TRANSFER_NAME_COLUMN, name.c_str(), -1);
+        GtkTreePath *path = gtk_tree_model_get_path(GTK_TREE_MODEL(sftp_win.transfer_list), &iter);
+        sftp_win.transfer_rows[job.id] = gtk_tree_row_reference_new(GTK_TREE_MODEL(sftp_win.transfer_list), path);
+        gtk_tree_path_free(path);
+    } else {
+        GtkTreePath *path = gtk_tree_row_reference_get_path(row->second);
+        if(!path) {
+            return;
+        }
+        gtk_tree_model_get_iter(GTK_TREE_MODEL(sftp_win.transfer_list), &iter, path);
+        gtk_tree_path_free(path);
+    }
+    int percent = job.status == TRANSFER_DONE ? 100 : 0;
+    if(job.status == TRANSFER_RUNNING && job.size > 0) {
+        percent = (int)(100*job.transferred / job.size);
     }
-    if(bytes_read == 0) {
-        goto cleanup;
+    gtk_list_store_set(sftp_win.transfer_list, &iter,
+                       TRANSFER_PROGRESS_COLUMN, percent,
+                       TRANSFER_STATUS_COLUMN, transfer_status_text(job.status),
+                       -1);
+    if(job.status == TRANSFER_DONE && job.direction != TRANSFER_DOWNLOAD) {
+        invalidate_listings(sftp_win, job.remote_path);
     }
-    if(bytes_read < 0) {
-        printf("Error reading file: %s\n", ssh_get_error(sftp_win.session));
-        goto cleanup;
+    if(job.status == TRANSFER_DONE && job.direction == TRANSFER_REMOTE_MOVE) {
+        invalidate_listings(sftp_win, job.source_path);
     }
-    sftp_win.downloaded_bytes += bytes_read;
-    gtk_progress_bar_set_fraction(sftp_win.progress, ((double)(sftp_win.downloaded_bytes)) / sftp_win.download_size);
-    bytes_written = g_output_stream_write(G_OUTPUT_STREAM(sftp_win.download_file), sftp_win.buf, bytes_read, nullptr, nullptr);
-    if(bytes_written != bytes_read) {
-        printf("Could not write to file.");
-        goto cleanup;
+    if(job.status == TRANSFER_DONE || job.status == TRANSFER_FAILED) {
+        // The row stays visible but will not be updated any more.
+        gtk_tree_row_reference_free(sftp_win.transfer_rows[job.id]);
+        sftp_win.transfer_rows.erase(job.id);
     }
-    sftp_win.async_request = sftp_async_read_begin(sftp_win.remote_file, SFTP_BUF_SIZE);
-    return; // There is more data to transfer.
+}
 
-cleanup:
-    g_object_unref(G_OBJECT(sftp_win.download_file));
-    sftp_win.remote_file = SftpFile();
-    sftp_win.downloading = false;
-    gtk_widget_set_sensitive(GTK_WIDGET(sftp_win.sftp_window), TRUE);
-    gtk_progress_bar_set_fraction(sftp_win.progress, 0);
+// Called on the I/O thread.
+void transfer_changed(const TransferJob &job, void *data) {
+    SftpWindow &sftp_win = *reinterpret_cast<SftpWindow*>(data);
+    // Delta transfers send much less than the file size, copies on the
+    // server send nothing.
+    if(job.status == TRANSFER_DONE && !job.use_delta && job_moves_data(job) && job.size >= LINK_SAMPLE_MIN) {
+        gint64 elapsed = g_get_monotonic_time() - job.started;
+        char *host = nullptr;
+        if(elapsed > 0 && ssh_options_get(sftp_win.session, SSH_OPTIONS_HOST, &host) == SSH_OK) {
+            record_link_speed(*sftp_win.tuner, host, job.size*1e6/elapsed);
+            ssh_string_free_char(host);
+        }
+    }
+    TransferUpdate update{job.id, job.direction, job.remote_path, job.source_path, job.status, job.size, job.transferred};
+    run_on_ui(*sftp_win.io, [&sftp_win, update]() { show_transfer(sftp_win, update); });
 }
 
+// Called on the I/O thread.
 void feed_sftp(SftpWindow &sftp_win) {
-    /*
-    if(sftp_win.remote_file == nullptr) {
+    // Both directions are driven by replies arriving on the session socket.
+    feed_transfers(sftp_win.transfers);
+    uint64_t total_size = 0;
+    uint64_t total_transferred = 0;
+    for(const auto &job : sftp_win.transfers.active) {
+        total_size += job->size;
+        total_transferred += job->transferred;
+    }
+    double fraction = total_size > 0 ? ((double)total_transferred) / total_size : 0;
+    // Most calls move the bar by less than a pixel.
+    if(fabs(fraction - sftp_win.shown_fraction) < 0.001 && (fraction != 0 || sftp_win.shown_fraction == 0)) {
+        return;
+    }
+    sftp_win.shown_fraction = fraction;
+    GtkProgressBar *progress = sftp_win.progress;
+    run_on_ui(*sftp_win.io, [progress, fraction]() { gtk_progress_bar_set_fraction(progress, fraction); });
+}
+
+std::string child_path(const std::string &dir, const std::string &name) {
+    if(name == ".") {
+        return dir;
+    }
+    if(name == "..") {
+        auto slash = dir.rfind('/');
+        // Relative paths are only used if the server could not tell us
+        // where we are.
+        if(slash == std::string::npos || dir.compare(slash + 1, std::string::npos, "..") == 0) {
+            return dir + "/..";
+        }
+        if(slash == 0) {
+            return "/";
+        }
+        return dir.substr(0, slash);
+    }
+    if(!dir.empty() && dir.back() == '/') {
+        return dir + name;
+    }
+    return dir + "/" + name;
+}
+
+DirEntry file_row_entry(GtkTreeModel *model, GtkTreeIter *iter) {
+    gboolean is_dir;
+    gchar *name;
+    guint64 size;
+    gtk_tree_model_get(model, iter, IS_DIR_COLUMN, &is_dir, NAME_COLUMN, &name, SIZE_COLUMN, &size, -1);
+    DirEntry e{name ? name : "", is_dir == TRUE, size};
+    g_free(name);
+    return e;
+}
+
+gint compare_file_rows(GtkTreeModel *model, GtkTreeIter *a, GtkTreeIter *b, gpointer) {
+    DirEntry ea = file_row_entry(model, a);
+    DirEntry eb = file_row_entry(model, b);
+    if(ea < eb) {
+        return -1;
+    }
+    if(eb < ea) {
+        return 1;
+    }
+    return 0;
+}
+
+void append_file_rows(SftpWindow &s, const std::vector<DirEntry> &entries, size_t first) {
+    // The store is sorted, so rows end up in their place as they arrive.
+    for(size_t i=first; i<entries.size(); i++) {
+        const DirEntry &e = entries[i];
+        gtk_list_store_insert_with_values(s.file_list, nullptr, -1,
+                                          IS_DIR_COLUMN, (gboolean) e.is_dir,
+                                          NAME_COLUMN, e.name.c_str(),
+                                          SIZE_COLUMN, e.size,
+                                          -1);
+    }
+}
+
+// Called on the I/O thread.
+void stop_listing(SftpWindow &s) {
+    if(s.listing_source) {
+        thread_source_remove(s.listing_source);
+        s.listing_source = 0;
+    }
+    s.listing_dir = SftpDir();
+    s.listing_path.clear();
+}
+
+void prune_dir_cache(SftpWindow &s) {
+    while(s.dir_cache.size() > SFTP_DIR_CACHE_MAX) {
+        auto oldest = s.dir_cache.end();
+        for(auto it = s.dir_cache.begin(); it != s.dir_cache.end(); ++it) {
+            if(it->first == s.dirname || !it->second.complete) {
+                continue;
+            }
+            if(oldest == s.dir_cache.end() || it->second.fetched < oldest->second.fetched) {
+                oldest = it;
+            }
+        }
+        if(oldest == s.dir_cache.end()) {
+            return;
+        }
+        s.dir_cache.erase(oldest);
+    }
+}
+
+void listing_batch(SftpWindow &s, unsigned int generation, const std::string &path,
+                   const std::vector<DirEntry> &entries, bool done, bool ok) {
+    if(generation != s.listing_generation) {
+        // The user has already moved on.
+        return;
+    }
+    append_file_rows(s, entries, 0);
+    // The entry is gone if an upload made it stale while it was read.
+    auto it = s.dir_cache.find(path);
+    if(it == s.dir_cache.end()) {
+        return;
+    }
+    DirListing &listing = it->second;
+    listing.entries.insert(listing.entries.end(), entries.begin(), entries.end());
+    if(!done) {
         return;
-    }*/
-    if(sftp_win.downloading) {
-        feed_sftp_download(sftp_win);
     }
-    /* The event model is asymmetrical. Upload is handled with an idle callback.
-    if(sftp_wind.uploading) {
-        feed_sftp_upload(sftp_win);
+    if(ok) {
+        listing.complete = true;
+        listing.fetched = g_get_monotonic_time();
+        prune_dir_cache(s);
+    } else {
+        s.dir_cache.erase(it);
+    }
+}
+
+// Every readdir is a round trip, so only a batch is read before other
+// traffic gets to run again. Runs on the I/O thread.
+gboolean list_dir_step(gpointer data) {
+    SftpWindow &s = *reinterpret_cast<SftpWindow*>(data);
+    std::vector<DirEntry> entries;
+    bool done = false;
+    for(int i=0; i<SFTP_LIST_BATCH; i++) {
+        sftp_attributes attr = sftp_readdir(s.sftp, s.listing_dir);
+        if(!attr) {
+            done = true;
+            break;
+        }
+        entries.push_back(DirEntry{attr->name, attr->type == SSH_FILEXFER_TYPE_DIRECTORY, attr->size});
+        sftp_attributes_free(attr);
+    }
+    bool ok = true;
+    if(done && !sftp_dir_eof(s.listing_dir)) {
+        printf("Could not read directory %s: %s\n", s.listing_path.c_str(), ssh_get_error(s.session));
+        ok = false;
+    }
+    unsigned int generation = s.io_listing_generation;
+    std::string path = s.listing_path;
+    run_on_ui(*s.io, [&s, generation, path, entries, done, ok]() {
+        listing_batch(s, generation, path, entries, done, ok);
+    });
+    if(!done) {
+        return G_SOURCE_CONTINUE;
     }
-    */
+    s.listing_source = 0;
+    stop_listing(s);
+    return G_SOURCE_REMOVE;
+}
+
+// Called on the I/O thread.
+void start_listing(SftpWindow &s, const std::string &path, unsigned int generation) {
+    stop_listing(s);
+    s.listing_dir = s.sftp.open_directory(path.c_str());
+    if(s.listing_dir == nullptr) {
+        run_on_ui(*s.io, [&s, generation, path]() {
+            listing_batch(s, generation, path, std::vector<DirEntry>(), true, false);
+        });
+        return;
+    }
+    s.listing_path = path;
+    s.io_listing_generation = generation;
+    s.listing_source = thread_idle_add(list_dir_step, &s);
 }
 
 void load_sftp_dir_data(SftpWindow &s, const char *newdir) {
-    s.dirname = newdir;
+    // The argument may point into s.dirname.
+    std::string path(newdir);
+    s.listing_generation++;
+    // Part of a directory must not be mistaken for all of it later.
+    for(auto it = s.dir_cache.begin(); it != s.dir_cache.end();) {
+        if(it->second.complete) {
+            ++it;
+        } else {
+            it = s.dir_cache.erase(it);
+        }
+    }
+    s.dirname = path;
+    gtk_window_set_title(s.sftp_window, path.c_str());
     gtk_list_store_clear(s.file_list);
-    SftpDir dir = s.sftp.open_directory(newdir);
-    SftpAttributes attribute;
-    GtkTreeIter iter;
-    std::vector<DirEntry> entries;
-    while((attribute = sftp_readdir(s.sftp, dir))) {
-        DirEntry e = {attribute->name, attribute->type == SSH_FILEXFER_TYPE_DIRECTORY, attribute->size};
-        entries.push_back(std::move(e));
+    auto cached = s.dir_cache.find(path);
+    if(cached != s.dir_cache.end() &&
+       g_get_monotonic_time() - cached->second.fetched < SFTP_DIR_CACHE_TTL*G_USEC_PER_SEC) {
+        run_on_io(*s.io, [&s]() { stop_listing(s); });
+        // Filling a model that is not on screen is a lot faster.
+        gtk_tree_view_set_model(s.file_view, nullptr);
+        append_file_rows(s, cached->second.entries, 0);
+        gtk_tree_view_set_model(s.file_view, GTK_TREE_MODEL(s.file_list));
+        return;
     }
-    std::sort(entries.begin(), entries.end());
-    for(const auto &e : entries) {
-        gtk_list_store_append(s.file_list, &iter);
-        gtk_list_store_set(s.file_list, &iter,
-                           IS_DIR_COLUMN, (gboolean) e.is_dir,
-                           NAME_COLUMN, e.name.c_str(),
-                           SIZE_COLUMN, e.size,
-                          -1);
+    DirListing &listing = s.dir_cache[path];
+    listing.entries.clear();
+    listing.complete = false;
+    listing.fetched = 0;
+    unsigned int generation = s.listing_generation;
+    run_on_io(*s.io, [&s, path, generation]() { start_listing(s, path, generation); });
+}
+
+gboolean refresh_timeout(gpointer data) {
+    SftpWindow &s = *reinterpret_cast<SftpWindow*>(data);
+    s.refresh_source = 0;
+    load_sftp_dir_data(s, s.dirname.c_str());
+    return G_SOURCE_REMOVE;
+}
+
+// A new file may also have created the directories it is in.
+void invalidate_listings(SftpWindow &s, const std::string &remote_path) {
+    std::string dir = remote_path;
+    bool current = false;
+    while(dir != "/") {
+        auto slash = dir.rfind('/');
+        if(slash == std::string::npos) {
+            break;
+        }
+        dir = slash == 0 ? "/" : dir.substr(0, slash);
+        s.dir_cache.erase(dir);
+        if(dir == s.dirname) {
+            current = true;
+        }
+    }
+    if(current && s.refresh_source == 0) {
+        s.refresh_source = g_timeout_add(SFTP_REFRESH_DELAY_MS, refresh_timeout, &s);
     }
 }
 
@@ -194,6 +420,62 @@ std::string get_file_to_upload(GtkWindow *parent_window) {
     return result;
 }
 
+std::string get_folder(GtkWindow *parent_window, const char *title, const char *accept_label) {
+    std::string result;
+    GtkWidget *dialog;
+    GtkFileChooser *chooser;
+    gint res;
+
+    dialog = gtk_file_chooser_dialog_new(title,
+                                         parent_window,
+                                         GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+                                         "_Cancel",
+                                          GTK_RESPONSE_CANCEL,
+                                         accept_label,
+                                         GTK_RESPONSE_ACCEPT,
+                                         NULL);
+    chooser = GTK_FILE_CHOOSER (dialog);
+    res = gtk_dialog_run(GTK_DIALOG (dialog));
+    if(res == GTK_RESPONSE_ACCEPT) {
+        char *filename;
+        filename = gtk_file_chooser_get_filename(chooser);
+        result = filename;
+        g_free (filename);
+    }
+
+    gtk_widget_destroy (dialog);
+
+    return result;
+}
+
+void download_entry(SftpWindow &sftp_win, const DirEntry &e) {
+    std::string full_remote_path = child_path(sftp_win.dirname, e.name);
+    if(e.is_dir) {
+        if(e.name == "." || e.name == "..") {
+            return;
+        }
+        std::string local_dir = get_folder(sftp_win.sftp_window, "Download Into", "_Download");
+        if(local_dir.empty()) {
+            return;
+        }
+        std::string local_path = local_dir + "/" + e.name;
+        run_on_io(*sftp_win.io, [&sftp_win, full_remote_path, local_path]() {
+            queue_download_tree(sftp_win.transfers, full_remote_path.c_str(), local_path.c_str());
+            feed_sftp(sftp_win);
+        });
+        return;
+    }
+    std::string full_local_path = get_output_file_name(sftp_win.sftp_window, e.name);
+    if(full_local_path.empty()) {
+        return;
+    }
+    uint64_t size = e.size;
+    run_on_io(*sftp_win.io, [&sftp_win, full_remote_path, full_local_path, size]() {
+        queue_download(sftp_win.transfers, full_remote_path.c_str(), full_local_path.c_str(), size);
+        feed_sftp(sftp_win);
+    });
+}
+
 void download_clicked(GtkButton *, gpointer data) {
     SftpWindow *sftp_win = reinterpret_cast<SftpWindow*>(data);
     GtkTreeSelection *sel = gtk_tree_view_get_selection(GTK_TREE_VIEW(sftp_win->file_view));
@@ -202,56 +484,101 @@ void download_clicked(GtkButton *, gpointer data) {
         // No entry is selected, bail out.
         return;
     }
-    GValue val = G_VALUE_INIT;
-    gtk_tree_model_get_value(GTK_TREE_MODEL(sftp_win->file_list), &iter, NAME_COLUMN, &val);
-    g_assert(G_VALUE_HOLDS_STRING(&val));
-    std::string fname(g_value_get_string(&val));
-    g_value_unset(&val);
-    gtk_tree_model_get_value(GTK_TREE_MODEL(sftp_win->file_list), &iter, IS_DIR_COLUMN, &val);
-    bool is_dir = g_value_get_boolean(&val) == TRUE;
-    g_value_unset(&val);
-    gtk_tree_model_get_value(GTK_TREE_MODEL(sftp_win->file_list), &iter, SIZE_COLUMN, &val);
-    sftp_win->download_size = g_value_get_uint64(&val);
-    g_value_unset(&val);
-    if(is_dir) {
-        // FIXME download full directories.
+    download_entry(*sftp_win, file_row_entry(GTK_TREE_MODEL(sftp_win->file_list), &iter));
+}
+
+void refresh_clicked(GtkButton *, gpointer data) {
+    SftpWindow *sftp_win = reinterpret_cast<SftpWindow*>(data);
+    sftp_win->dir_cache.erase(sftp_win->dirname);
+    load_sftp_dir_data(*sftp_win, sftp_win->dirname.c_str());
+}
+
+void upload_clicked(GtkButton *, gpointer data) {
+    SftpWindow *sftp_win = reinterpret_cast<SftpWindow*>(data);
+    std::string fname = get_file_to_upload(sftp_win->sftp_window);
+    if(fname.empty()) {
         return;
     }
-    std::string full_remote_path = fname; // FIXME, path
-    std::string full_local_path = get_output_file_name(sftp_win->sftp_window, fname);
-    if(full_local_path.empty()) {
+    upload_file(*sftp_win, fname.c_str());
+}
+
+void upload_dir_clicked(GtkButton *, gpointer data) {
+    SftpWindow *sftp_win = reinterpret_cast<SftpWindow*>(data);
+    std::string dirname = get_folder(sftp_win->sftp_window, "Upload Directory", "_Upload");
+    if(dirname.empty()) {
+        return;
+    }
+    std::string remote_name = child_path(sftp_win->dirname, split_filename(dirname.c_str()));
+    run_on_io(*sftp_win->io, [sftp_win, dirname, remote_name]() {
+        queue_upload_tree(sftp_win->transfers, dirname.c_str(), remote_name.c_str());
+        feed_sftp(*sftp_win);
+    });
+}
+
+std::string get_remote_destination(GtkWindow *parent_window, const char *title, const char *accept_label,
+                                   const std::string &initial) {
+    std::string result;
+    GtkWidget *dialog = gtk_dialog_new_with_buttons(title,
+                                                    parent_window,
+                                                    GTK_DIALOG_MODAL,
+                                                    "_Cancel",
+                                                    GTK_RESPONSE_CANCEL,
+                                                    accept_label,
+                                                    GTK_RESPONSE_ACCEPT,
+                                                    NULL);
+    GtkWidget *entry = gtk_entry_new();
+    gtk_entry_set_text(GTK_ENTRY(entry), initial.c_str());
+    gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_ACCEPT);
+    gtk_container_add(GTK_CONTAINER(gtk_dialog_get_content_area(GTK_DIALOG(dialog))), entry);
+    gtk_widget_show_all(dialog);
+    if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        result = gtk_entry_get_text(GTK_ENTRY(entry));
+    }
+    gtk_widget_destroy(dialog);
+    return result;
+}
+
+// The destination is asked for as a full path so that the entry can
+// also be renamed or put in another directory.
+void copy_on_server(SftpWindow &sftp_win, bool move) {
+    GtkTreeSelection *sel = gtk_tree_view_get_selection(GTK_TREE_VIEW(sftp_win.file_view));
+    GtkTreeIter iter;
+    if(!gtk_tree_selection_get_selected(sel, nullptr, &iter)) {
         return;
     }
-    auto remote_file = sftp_open(sftp_win->sftp, full_remote_path.c_str(), O_RDONLY, 0);
-    if(remote_file == nullptr) {
-        printf("Could not open file: %s\n", ssh_get_error(sftp_win->session));
+    DirEntry e = file_row_entry(GTK_TREE_MODEL(sftp_win.file_list), &iter);
+    if(e.name == "." || e.name == "..") {
         return;
     }
-    sftp_file_set_nonblocking(remote_file);
-    GFile *gf = g_file_new_for_path(full_local_path.c_str());
-    sftp_win->download_file = g_file_replace(gf, nullptr, FALSE, G_FILE_CREATE_NONE, nullptr, nullptr);
-    g_object_unref(G_OBJECT(gf));
-    if(!sftp_win->download_file) {
-        printf("Could not open local file.");
+    std::string from = child_path(sftp_win.dirname, e.name);
+    std::string to = get_remote_destination(sftp_win.sftp_window, move ? "Move To" : "Copy To",
+                                            move ? "_Move" : "_Copy", from);
+    if(to.empty() || to == from) {
         return;
     }
-    g_assert(!sftp_win->uploading);
-    int async_request = sftp_async_read_begin(remote_file, SFTP_BUF_SIZE);
-    sftp_win->remote_file = std::move(remote_file);
-    sftp_win->async_request = async_request;
-    sftp_win->downloading = true;
-    sftp_win->downloaded_bytes = 0;
-    gtk_progress_bar_set_fraction(sftp_win->progress, 0);
-    gtk_widget_set_sensitive(GTK_WIDGET(sftp_win->sftp_window), FALSE);
+    run_on_io(*sftp_win.io, [&sftp_win, from, to, move]() {
+        if(move) {
+            queue_remote_move(sftp_win.transfers, from.c_str(), to.c_str());
+        } else {
+            queue_remote_copy(sftp_win.transfers, from.c_str(), to.c_str());
+        }
+        feed_sftp(sftp_win);
+    });
 }
 
-void upload_clicked(GtkButton *, gpointer data) {
+void copy_clicked(GtkButton *, gpointer data) {
+    copy_on_server(*reinterpret_cast<SftpWindow*>(data), false);
+}
+
+void move_clicked(GtkButton *, gpointer data) {
+    copy_on_server(*reinterpret_cast<SftpWindow*>(data), true);
+}
+
+void delta_toggled(GtkToggleButton *button, gpointer data) {
     SftpWindow *sftp_win = reinterpret_cast<SftpWindow*>(data);
-    std::string fname = get_file_to_upload(sftp_win->sftp_window);
-    if(fname.empty()) {
-        return;
-    }
-    upload_file(*sftp_win, fname.c_str());
+    bool delta = gtk_toggle_button_get_active(button);
+    run_on_io(*sftp_win->io, [sftp_win, delta]() { sftp_win->transfers.delta = delta; });
 }
 
 void sftp_row_activated(GtkTreeView       *tree_view,
@@ -259,23 +586,67 @@ void sftp_row_activated(GtkTreeView       *tree_view,
                         GtkTreeViewColumn *column,
                         gpointer          data) {
     SftpWindow *sftp_win = reinterpret_cast<SftpWindow*>(data);
-    // FIXME download or cd.
+    GtkTreeIter iter;
+    if(!gtk_tree_model_get_iter(GTK_TREE_MODEL(sftp_win->file_list), &iter, path)) {
+        return;
+    }
+    DirEntry e = file_row_entry(GTK_TREE_MODEL(sftp_win->file_list), &iter);
+    if(!e.is_dir) {
+        download_entry(*sftp_win, e);
+        return;
+    }
+    if(e.name == ".") {
+        sftp_win->dir_cache.erase(sftp_win->dirname);
+    }
+    load_sftp_dir_data(*sftp_win, child_path(sftp_win->dirname, e.name).c_str());
 }
 
-void open_sftp(SftpWindow &sftp_win) {
-    load_sftp_dir_data(sftp_win, ".");
+// Called on the I/O thread.
+void open_sftp(SftpWindow &sftp_win, bool delta) {
+    stop_listing(sftp_win);
+    sftp_win.shown_fraction = 0;
+    init_transfer_manager(sftp_win.transfers, *sftp_win.disk, sftp_win.journal, sftp_win.session, sftp_win.sftp,
+                          transfer_changed, &sftp_win);
+    sftp_win.transfers.delta = delta;
+    // Absolute paths make going up and the listing cache work.
+    char *home = sftp_canonicalize_path(sftp_win.sftp, ".");
+    std::string dir(home ? home : ".");
+    if(home) {
+        ssh_string_free_char(home);
+    }
+    run_on_ui(*sftp_win.io, [&sftp_win, dir]() { load_sftp_dir_data(sftp_win, dir.c_str()); });
+    // Continue whatever the previous run did not finish.
+    if(transfers_pending(sftp_win.transfers)) {
+        feed_sftp(sftp_win);
+    }
 }
 
 void build_sftp_win(SftpWindow &sftp_win) {
+    // The listings of an earlier session are of no use.
+    sftp_win.listing_generation++;
+    sftp_win.dir_cache.clear();
+    if(sftp_win.refresh_source) {
+        g_source_remove(sftp_win.refresh_source);
+        sftp_win.refresh_source = 0;
+    }
     sftp_win.dirname = ".";
     sftp_win.builder = gtk_builder_new_from_string((const gchar*)sftpwindow, sizeof(sftpwindow));
     sftp_win.sftp_window = GTK_WINDOW(gtk_builder_get_object(sftp_win.builder, "sftp_window"));
     sftp_win.file_view = GTK_TREE_VIEW(gtk_builder_get_object(sftp_win.builder, "fileview"));
     sftp_win.file_list = gtk_list_store_new(N_COLUMNS, G_TYPE_BOOLEAN, G_TYPE_STRING, G_TYPE_UINT64);
+    sftp_win.refresh_button = GTK_BUTTON(gtk_builder_get_object(sftp_win.builder, "refresh_button"));
     sftp_win.download_button = GTK_BUTTON(gtk_builder_get_object(sftp_win.builder, "download_button"));
     sftp_win.upload_button = GTK_BUTTON(gtk_builder_get_object(sftp_win.builder, "upload_button"));
+    sftp_win.upload_dir_button = GTK_BUTTON(gtk_builder_get_object(sftp_win.builder, "upload_dir_button"));
+    sftp_win.copy_button = GTK_BUTTON(gtk_builder_get_object(sftp_win.builder, "copy_button"));
+    sftp_win.move_button = GTK_BUTTON(gtk_builder_get_object(sftp_win.builder, "move_button"));
+    sftp_win.delta_check = GTK_TOGGLE_BUTTON(gtk_builder_get_object(sftp_win.builder, "delta_check"));
     sftp_win.progress = GTK_PROGRESS_BAR(gtk_builder_get_object(sftp_win.builder, "transfer_progress"));
+    sftp_win.transfer_view = GTK_TREE_VIEW(gtk_builder_get_object(sftp_win.builder, "transferview"));
+    sftp_win.transfer_list = gtk_list_store_new(TRANSFER_N_COLUMNS, G_TYPE_STRING, G_TYPE_INT, G_TYPE_STRING);
 
+    gtk_tree_sortable_set_sort_func(GTK_TREE_SORTABLE(sftp_win.file_list), NAME_COLUMN, compare_file_rows, nullptr, nullptr);
+    gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(sftp_win.file_list), NAME_COLUMN, GTK_SORT_ASCENDING);
     gtk_tree_view_set_model(sftp_win.file_view, GTK_TREE_MODEL(sftp_win.file_list));
     gtk_tree_view_append_column(sftp_win.file_view,
                 gtk_tree_view_column_new_with_attributes("Filename",
@@ -283,73 +654,33 @@ void build_sftp_win(SftpWindow &sftp_win) {
     gtk_tree_view_append_column(sftp_win.file_view,
                 gtk_tree_view_column_new_with_attributes("Size",
                 gtk_cell_renderer_text_new(), "text", SIZE_COLUMN, nullptr));
+    gtk_tree_view_set_model(sftp_win.transfer_view, GTK_TREE_MODEL(sftp_win.transfer_list));
+    gtk_tree_view_append_column(sftp_win.transfer_view,
+                gtk_tree_view_column_new_with_attributes("Transfer",
+                gtk_cell_renderer_text_new(), "text", TRANSFER_NAME_COLUMN, nullptr));
+    gtk_tree_view_append_column(sftp_win.transfer_view,
+                gtk_tree_view_column_new_with_attributes("Progress",
+                gtk_cell_renderer_progress_new(), "value", TRANSFER_PROGRESS_COLUMN, nullptr));
+    gtk_tree_view_append_column(sftp_win.transfer_view,
+                gtk_tree_view_column_new_with_attributes("Status",
+                gtk_cell_renderer_text_new(), "text", TRANSFER_STATUS_COLUMN, nullptr));
+    g_signal_connect(GTK_WIDGET(sftp_win.refresh_button), "clicked", G_CALLBACK(refresh_clicked), &sftp_win);
     g_signal_connect(GTK_WIDGET(sftp_win.download_button), "clicked", G_CALLBACK(download_clicked), &sftp_win);
     g_signal_connect(GTK_WIDGET(sftp_win.upload_button), "clicked", G_CALLBACK(upload_clicked), &sftp_win);
+    g_signal_connect(GTK_WIDGET(sftp_win.upload_dir_button), "clicked", G_CALLBACK(upload_dir_clicked), &sftp_win);
+    g_signal_connect(GTK_WIDGET(sftp_win.copy_button), "clicked", G_CALLBACK(copy_clicked), &sftp_win);
+    g_signal_connect(GTK_WIDGET(sftp_win.move_button), "clicked", G_CALLBACK(move_clicked), &sftp_win);
+    g_signal_connect(GTK_WIDGET(sftp_win.delta_check), "toggled", G_CALLBACK(delta_toggled), &sftp_win);
     g_signal_connect(GTK_WIDGET(sftp_win.file_view), "row-activated", G_CALLBACK(sftp_row_activated), &sftp_win);
-    sftp_win.uploading = false;
-    sftp_win.downloading = false;
-}
-
-gboolean async_uploader(gpointer data) {
-    SftpWindow &sftp_win = *reinterpret_cast<SftpWindow*>(data);
-    ssize_t current_written = 0;
-    auto current_chunk_size = std::min(SFTP_UPLOAD_CHUNK_SIZE, sftp_win.upload_size - sftp_win.uploaded_bytes);
-    if(current_chunk_size == 0) {
-        // All of input file has been read. Time to stop.
-        goto cleanup;
-    }
-
-    current_written = sftp_write(sftp_win.remote_file,
-                                 g_mapped_file_get_contents(sftp_win.upload_file) + sftp_win.uploaded_bytes,
-                                 current_chunk_size);
-    if(current_written < 0) {
-        printf("Writing failed: %s", ssh_get_error(sftp_win.session));
-        goto cleanup;
-    }
-    sftp_win.uploaded_bytes += current_written;
-    gtk_progress_bar_set_fraction(sftp_win.progress, ((double)(sftp_win.uploaded_bytes)) / sftp_win.upload_size);
-    return G_SOURCE_CONTINUE;
-
-cleanup:
-    g_mapped_file_unref(sftp_win.upload_file);
-    sftp_win.upload_file = nullptr;
-    sftp_win.remote_file = SftpFile();
-    sftp_win.uploading = false;
-    gtk_progress_bar_set_fraction(sftp_win.progress, 0);
-    gtk_widget_set_sensitive(GTK_WIDGET(sftp_win.sftp_window), TRUE);
-    return G_SOURCE_REMOVE;
+    // The window belongs to its session tab, closing it only hides it.
+    g_signal_connect(GTK_WIDGET(sftp_win.sftp_window), "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), nullptr);
 }
 
 void upload_file(SftpWindow &sftp_win, const char *fname) {
-    g_assert(!sftp_win.downloading);
-    GError *err = nullptr;
-    struct stat buf;
-    mode_t fmode = S_IRWXU;
-    if(stat(fname, &buf) == 0) {
-        fmode = buf.st_mode;
-    }
-    sftp_win.upload_file = g_mapped_file_new(fname, FALSE, &err);
-    if(err) {
-        printf("Mmap fail: %s.\n", err->message);
-        g_error_free(err);
-        return;
-    }
-    sftp_win.upload_size = g_mapped_file_get_length(sftp_win.upload_file);
-    if(!sftp_win.upload_file) {
-        printf("Could not open file: %s\n", fname);
-        return;
-    }
-
-    std::string remote_name = sftp_win.dirname + "/" + split_filename(fname);
-    /* FIXME, maybe we should write to a temp file and rename atomically? */
-    auto remote_file = sftp_open(sftp_win.sftp, remote_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, fmode);
-    if(remote_file == nullptr) {
-        g_object_unref(G_OBJECT(sftp_win.upload_file));
-        printf("Could not open remote file %s.\n", ssh_get_error(sftp_win.session));
-        return;
-    }
-    sftp_win.remote_file = SftpFile(remote_file);
-    g_idle_add(async_uploader, &sftp_win);
-    sftp_win.uploading = true;
-    sftp_win.uploaded_bytes = 0;
+    std::string remote_name = child_path(sftp_win.dirname, split_filename(fname));
+    std::string local_name(fname);
+    run_on_io(*sftp_win.io, [&sftp_win, local_name, remote_name]() {
+        queue_upload(sftp_win.transfers, local_name.c_str(), remote_name.c_str());
+        feed_sftp(sftp_win);
+    });
 }
@@ -19,40 +19,102 @@
 
 
 #include<ssh_util.hpp>
+#include<iothread.hpp>
 
 #include<gtk/gtk.h>
-#include<ssh_util.hpp>
+#include<transfer.hpp>
+#include<cipherbench.hpp>
 #include<string>
+#include<vector>
+#include<map>
+#include<cstdint>
+
+// Listings younger than this many seconds are shown from the cache.
+static const constexpr gint64 SFTP_DIR_CACHE_TTL = 60;
+// How many directory listings are remembered.
+static const constexpr size_t SFTP_DIR_CACHE_MAX = 32;
+// Entries read from the server before the UI gets to run again.
+static const constexpr int SFTP_LIST_BATCH = 256;
+// Finished uploads are collected this long before the view is reloaded.
+static const constexpr guint SFTP_REFRESH_DELAY_MS = 500;
+
+struct DirEntry {
+    std::string name;
+    bool is_dir;
+    uint64_t size;
 
-static const constexpr int SFTP_BUF_SIZE = 4*1024;
-static const constexpr uint64_t SFTP_UPLOAD_CHUNK_SIZE = 1024;
+    // Sort by directoryness, then by name.
+    bool operator<(const DirEntry &other) const {
+        if(&other == this) {
+            return false;
+        }
+        if(is_dir && !other.is_dir) {
+            return true;
+        }
+        if(other.is_dir && !is_dir) {
+            return false;
+        }
+        if(name == ".") { // Each directory has only one of these.
+            return true;
+        }
+        if(other.name == ".") {
+            return false;
+        }
+        if(name == "..") {
+            return true;
+        }
+        if(other.name == "..") {
+            return false;
+        }
+        return name < other.name;
+    }
+};
+
+struct DirListing {
+    std::vector<DirEntry> entries;
+    bool complete;
+    gint64 fetched; // Monotonic time.
+};
 
 struct SftpWindow {
     GtkBuilder *builder;
     GtkWindow *sftp_window;
     GtkTreeView *file_view;
     GtkListStore *file_list;
+    GtkButton *refresh_button;
     GtkButton *download_button;
     GtkButton *upload_button;
+    GtkButton *upload_dir_button;
+    GtkButton *copy_button;
+    GtkButton *move_button;
+    GtkToggleButton *delta_check;
     GtkProgressBar *progress;
-    ssh_session session; // A non-owning pointer.
-    SftpSession sftp;
-    SftpFile remote_file;
-    int async_request;
+    GtkTreeView *transfer_view;
+    GtkListStore *transfer_list;
+    std::map<int, GtkTreeRowReference*> transfer_rows;
     std::string dirname;
-    GMappedFile *upload_file;
-    GFileOutputStream *download_file;
-    char buf[SFTP_BUF_SIZE];
-    bool downloading;
-    bool uploading;
-
-    uint64_t download_size;
-    uint64_t downloaded_bytes;
+    // Only the main thread touches the cache. Batches of a listing that
+    // arrive after the user has moved on carry an old generation.
+    std::map<std::string, DirListing> dir_cache;
+    unsigned int listing_generation;
+    guint refresh_source;
+    IoThread *io;
 
-    uint64_t upload_size;
-    uint64_t uploaded_bytes;
+    // Everything below belongs to the I/O thread.
+    ssh_session session; // A non-owning pointer.
+    DiskIo *disk;        // Ditto.
+    TransferJournal *journal; // Ditto.
+    AlgorithmTuner *tuner;    // Ditto.
+    SftpSession sftp;
+    TransferManager transfers;
+    SftpDir listing_dir;
+    std::string listing_path;
+    unsigned int io_listing_generation;
+    guint listing_source;
+    double shown_fraction;
 };
 
-void open_sftp(SftpWindow &sftp_win);
+void open_sftp(SftpWindow &sftp_win, bool delta);
 void feed_sftp(SftpWindow &sftp_win);
+void stop_listing(SftpWindow &sftp_win);
 void build_sftp_win(SftpWindow &sftp_win);
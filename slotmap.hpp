@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<deque>
+#include<cstddef>
+#include<cstdint>
+
+static const constexpr uint32_t SLOT_NONE = UINT32_MAX;
+
+struct SlotHandle {
+    uint32_t index;
+    uint32_t generation;
+};
+
+/*
+ * Objects that keep their address for as long as they are in use and
+ * are referred to by handles which go stale once the object is removed.
+ * Removed slots are reused along with whatever memory their object
+ * still holds, so adding and removing are O(1) and allocate nothing
+ * once the map has grown to its working size.
+ *
+ * Objects are not destroyed when their slot is freed, so whoever adds
+ * one must set all of its fields.
+ */
+template<typename T>
+struct SlotMap {
+    struct Slot {
+        T item;
+        uint32_t generation; // Odd while in use.
+        uint32_t next_free;
+    };
+
+    // A deque does not move its elements when it grows.
+    std::deque<Slot> slots;
+    uint32_t free_head = SLOT_NONE;
+    size_t live = 0;
+
+    SlotHandle add() {
+        uint32_t index;
+        if(free_head != SLOT_NONE) {
+            index = free_head;
+            free_head = slots[index].next_free;
+        } else {
+            index = (uint32_t)slots.size();
+            slots.emplace_back();
+        }
+        Slot &s = slots[index];
+        s.generation++;
+        live++;
+        return SlotHandle{index, s.generation};
+    }
+
+    // Null if the handle is stale.
+    T* get(SlotHandle h) {
+        if(h.index >= slots.size() || slots[h.index].generation != h.generation) {
+            return nullptr;
+        }
+        return &slots[h.index].item;
+    }
+
+    bool remove(SlotHandle h) {
+        if(!get(h)) {
+            return false;
+        }
+        Slot &s = slots[h.index];
+        s.generation++;
+        s.next_free = free_head;
+        free_head = h.index;
+        live--;
+        return true;
+    }
+};
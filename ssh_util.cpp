@@ -29,6 +29,10 @@ SshSession::~SshSession() {
 }
 
 SshChannel SshSession::open_shell() {
+    return open_shell_channel(session);
+}
+
+SshChannel open_shell_channel(ssh_session session) {
     SshChannel channel(session, ssh_channel_new(session));
     if(channel == nullptr) {
         printf("Could not open channel: %s\n", ssh_get_error(session));
@@ -57,6 +61,48 @@ SshChannel SshSession::open_shell() {
     return channel;
 }
 
+SshChannel SshSession::open_exec(const char *command) {
+    return open_exec_channel(session, command);
+}
+
+SshChannel open_exec_channel(ssh_session session, const char *command) {
+    SshChannel channel(session, ssh_channel_new(session));
+    if(channel == nullptr) {
+        printf("Could not open channel: %s\n", ssh_get_error(session));
+        return SshChannel();
+    }
+    auto rc = ssh_channel_open_session(channel);
+    if(rc != SSH_OK) {
+        printf("Could not open session: %s\n", ssh_get_error(session));
+        return SshChannel();
+    }
+    rc = ssh_channel_request_exec(channel, command);
+    if(rc != SSH_OK) {
+        printf("Could not run remote command: %s\n", ssh_get_error(session));
+        return SshChannel();
+    }
+    return channel;
+}
+
+SshChannel open_subsystem_channel(ssh_session session, const char *subsystem) {
+    SshChannel channel(session, ssh_channel_new(session));
+    if(channel == nullptr) {
+        printf("Could not open channel: %s\n", ssh_get_error(session));
+        return SshChannel();
+    }
+    auto rc = ssh_channel_open_session(channel);
+    if(rc != SSH_OK) {
+        printf("Could not open session: %s\n", ssh_get_error(session));
+        return SshChannel();
+    }
+    rc = ssh_channel_request_subsystem(channel, subsystem);
+    if(rc != SSH_OK) {
+        printf("Could not start subsystem %s: %s\n", subsystem, ssh_get_error(session));
+        return SshChannel();
+    }
+    return channel;
+}
+
 SftpSession SshSession::open_sftp_session() {
     SftpSession s(session, sftp_new(session));
     if(s == nullptr) {
@@ -19,11 +19,28 @@
 
 #include<libssh/libssh.h>
 #include<libssh/sftp.h>
+#include<cstdint>
 
 class SshChannel;
 class SftpSession;
 class SftpDir;
 
+/*
+ * Data through one channel, counted by whoever reads or writes it. The
+ * channel API hides message boundaries so each successful read or write
+ * is counted as one call instead.
+ */
+struct ChannelCounters {
+    uint64_t bytes_in; // From the server.
+    uint64_t bytes_out;
+    uint64_t reads;
+    uint64_t writes;
+};
+
+SshChannel open_shell_channel(ssh_session session);
+SshChannel open_exec_channel(ssh_session session, const char *command);
+SshChannel open_subsystem_channel(ssh_session session, const char *subsystem);
+
 class SshSession final {
 private:
     ssh_session session;
@@ -47,6 +64,7 @@ public:
     }
 
     SshChannel open_shell();
+    SshChannel open_exec(const char *command);
     operator ssh_session() { return session; }
 
     SftpSession open_sftp_session();
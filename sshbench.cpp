@@ -0,0 +1,1053 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the engine without any GUI. A private sshd is started on
+ * loopback with fresh keys, and a proxy in front of it adds the round
+ * trip time and bandwidth limit asked for. The same connector, transfer
+ * manager and port forward code that the client uses then run against
+ * it on a plain main loop. Results are printed as JSON.
+ */
+
+#include<connector.hpp>
+#include<transfer.hpp>
+#include<forwards.hpp>
+#include<diskio.hpp>
+#include<ssh_util.hpp>
+#include<util.hpp>
+#include<glib/gstdio.h>
+#include<sys/socket.h>
+#include<sys/wait.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<poll.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<signal.h>
+#include<algorithm>
+#include<cerrno>
+#include<cmath>
+#include<cstdio>
+#include<cstring>
+#include<deque>
+#include<memory>
+#include<string>
+#include<vector>
+
+// Largest read the proxy does at once.
+static const constexpr size_t SHAPER_CHUNK = 64*1024;
+// Data held per direction before the proxy stops reading, like a
+// socket buffer on a real link.
+static const constexpr size_t SHAPER_MAX_QUEUED = 4*1024*1024;
+// How long sshd gets to start listening.
+static const constexpr gint64 SSHD_START_US = 10*G_USEC_PER_SEC;
+// No single measurement may take longer than this.
+static const constexpr gint64 BENCH_TIMEOUT_US = 300*G_USEC_PER_SEC;
+// Data that arrives while libssh is busy elsewhere does not wake the
+// socket watch, so the session is also served this often.
+static const constexpr guint BENCH_TICK_MS = 50;
+static const constexpr size_t BENCH_IO_SIZE = 64*1024;
+static const constexpr char *FLOOD_MARKER = "sshbench-flood-done";
+
+static const char *phase_keys[CONNECT_DONE] = {
+    "dns", "tcp", "kex", "hostkey", "auth", "channel", "pty", "shell",
+};
+
+struct BenchOptions {
+    gchar *sshd;
+    gint rtt_ms;
+    gint bandwidth_kib;
+    gint setups;
+    gint flood_mib;
+    gint sftp_mib;
+    gint forward_mib;
+    gint forward_connections;
+    gchar *output;
+};
+
+static BenchOptions opts = {nullptr, 0, 0, 5, 16, 64, 64, 200, nullptr};
+
+static GOptionEntry option_entries[] = {
+    {"sshd", 0, 0, G_OPTION_ARG_FILENAME, &opts.sshd, "Absolute path of sshd", "PATH"},
+    {"rtt", 0, 0, G_OPTION_ARG_INT, &opts.rtt_ms, "Added round trip time", "MS"},
+    {"bandwidth", 0, 0, G_OPTION_ARG_INT, &opts.bandwidth_kib, "Link bandwidth each way, 0 for unlimited", "KIB/S"},
+    {"setups", 0, 0, G_OPTION_ARG_INT, &opts.setups, "Connections whose setup is timed", "N"},
+    {"flood", 0, 0, G_OPTION_ARG_INT, &opts.flood_mib, "Terminal output to read", "MIB"},
+    {"sftp", 0, 0, G_OPTION_ARG_INT, &opts.sftp_mib, "Size of the file sent each way", "MIB"},
+    {"forward", 0, 0, G_OPTION_ARG_INT, &opts.forward_mib, "Data sent through a port forward", "MIB"},
+    {"forward-connections", 0, 0, G_OPTION_ARG_INT, &opts.forward_connections, "Connections made through the forward", "N"},
+    {"output", 'o', 0, G_OPTION_ARG_FILENAME, &opts.output, "Write the results here instead of stdout", "FILE"},
+    {nullptr, 0, 0, G_OPTION_ARG_NONE, nullptr, nullptr, nullptr},
+};
+
+struct ShapedChunk {
+    gint64 due;
+    std::vector<char> data;
+    size_t pos;
+};
+
+// One direction of a proxied connection.
+struct ShapedPipe {
+    int from;
+    int to;
+    std::deque<ShapedChunk> chunks;
+    size_t queued;
+    gint64 link_free; // When the simulated link has sent what it has.
+    bool eof;
+    bool shut;
+};
+
+struct ShapedConnection {
+    ShapedPipe up;   // Client to server.
+    ShapedPipe down;
+};
+
+/*
+ * A TCP proxy in front of sshd. Every chunk is held for half the round
+ * trip time, and for as long as it takes to send at the set bandwidth.
+ * Runs in a thread of its own so that it does not compete with the
+ * client for the main loop.
+ */
+struct Shaper {
+    int listen_fd;
+    int port;
+    int target_port;
+    gint64 delay_us;
+    double bytes_per_us; // Zero for unlimited.
+    int stop_pipe[2];
+    std::vector<std::unique_ptr<ShapedConnection>> connections;
+    GThread *thread;
+};
+
+struct SshdFixture {
+    std::string dir;
+    int port;
+    GPid pid;
+    std::string known_hosts;
+    std::string client_key;
+};
+
+// Accepts connections and reads them until the other end is done.
+struct DiscardServer {
+    int listen_fd;
+    int port;
+    GThread *thread;
+};
+
+// Driven from a thread of its own through the forwarded port.
+struct ForwardLoad {
+    int port;
+    uint64_t bytes;
+    int connections;
+    bool ok;
+    gint64 throughput_us;
+    gint64 connections_us;
+    bool done; // Set on the main thread.
+    GThread *thread;
+};
+
+struct Bench {
+    SshdFixture sshd;
+    Shaper shaper;
+    DnsCache dns;
+    DiskIo disk;
+
+    std::unique_ptr<SshSession> session;
+    SshChannel pty;
+    ssh_event event;
+    GIOChannel *session_channel;
+    guint session_watch;
+    SftpSession sftp;
+    TransferManager transfers;
+    PortForwardings ports;
+
+    bool connect_done;
+    bool connect_ok;
+    std::string connect_error;
+    bool job_done;
+    bool job_ok;
+    bool flooding;
+    bool flood_done;
+    uint64_t flood_bytes;
+    std::string flood_tail;
+
+    std::vector<std::pair<std::string, double>> results;
+    std::vector<std::string> errors;
+};
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int listen_loopback(int &port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0 ||
+       getsockname(fd, (struct sockaddr*)&addr, &len) != 0) {
+        close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// FIXME, another process may take the port before it is used.
+static int free_port() {
+    int port = 0;
+    int fd = listen_loopback(port);
+    if(fd < 0) {
+        return 0;
+    }
+    close(fd);
+    return port;
+}
+
+static int connect_loopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+    while(len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if(w < 0 && errno == EINTR) {
+            continue;
+        }
+        if(w <= 0) {
+            return false;
+        }
+        buf += w;
+        len -= w;
+    }
+    return true;
+}
+
+// Reads until end of file. False on errors.
+static bool drain(int fd) {
+    char buf[BENCH_IO_SIZE];
+    while(true) {
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if(r < 0 && errno == EINTR) {
+            continue;
+        }
+        if(r <= 0) {
+            return r == 0;
+        }
+    }
+}
+
+static bool shaper_read(Shaper &sh, ShapedPipe &p) {
+    if(p.eof || p.queued >= SHAPER_MAX_QUEUED) {
+        return true;
+    }
+    ShapedChunk chunk;
+    chunk.data.resize(SHAPER_CHUNK);
+    chunk.pos = 0;
+    ssize_t r = read(p.from, chunk.data.data(), chunk.data.size());
+    if(r < 0) {
+        return errno == EAGAIN || errno == EINTR;
+    }
+    if(r == 0) {
+        p.eof = true;
+        return true;
+    }
+    chunk.data.resize(r);
+    gint64 now = g_get_monotonic_time();
+    p.link_free = std::max(p.link_free, now);
+    if(sh.bytes_per_us > 0) {
+        p.link_free += (gint64)(r/sh.bytes_per_us);
+    }
+    chunk.due = p.link_free + sh.delay_us;
+    p.queued += r;
+    p.chunks.push_back(std::move(chunk));
+    return true;
+}
+
+static bool shaper_write(ShapedPipe &p, gint64 now) {
+    while(!p.chunks.empty() && p.chunks.front().due <= now) {
+        ShapedChunk &chunk = p.chunks.front();
+        ssize_t w = write(p.to, chunk.data.data() + chunk.pos, chunk.data.size() - chunk.pos);
+        if(w < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        chunk.pos += w;
+        if(chunk.pos < chunk.data.size()) {
+            return true;
+        }
+        p.queued -= chunk.data.size();
+        p.chunks.pop_front();
+    }
+    if(p.eof && p.chunks.empty() && !p.shut) {
+        shutdown(p.to, SHUT_WR);
+        p.shut = true;
+    }
+    return true;
+}
+
+// Adds what the pipe waits for to the poll events of its two ends.
+static void shaper_wants(const ShapedPipe &p, gint64 now, short &from_events, short &to_events, gint64 &wake) {
+    if(!p.eof && p.queued < SHAPER_MAX_QUEUED) {
+        from_events |= POLLIN;
+    }
+    if(p.chunks.empty()) {
+        return;
+    }
+    gint64 due = p.chunks.front().due;
+    if(due <= now) {
+        to_events |= POLLOUT;
+    } else if(wake < 0 || due < wake) {
+        wake = due;
+    }
+}
+
+static void shaper_accept(Shaper &sh) {
+    int client = accept4(sh.listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if(client < 0) {
+        return;
+    }
+    int server = connect_loopback(sh.target_port);
+    if(server < 0) {
+        printf("Proxy could not reach sshd: %s\n", strerror(errno));
+        close(client);
+        return;
+    }
+    set_nonblocking(client);
+    set_nonblocking(server);
+    std::unique_ptr<ShapedConnection> c(new ShapedConnection());
+    c->up.from = client;
+    c->up.to = server;
+    c->down.from = server;
+    c->down.to = client;
+    sh.connections.push_back(std::move(c));
+}
+
+static gpointer shaper_thread(gpointer data) {
+    Shaper &sh = *reinterpret_cast<Shaper*>(data);
+    std::vector<struct pollfd> fds;
+    while(true) {
+        gint64 now = g_get_monotonic_time();
+        gint64 wake = -1;
+        fds.clear();
+        fds.push_back({sh.stop_pipe[0], POLLIN, 0});
+        fds.push_back({sh.listen_fd, POLLIN, 0});
+        for(const auto &c : sh.connections) {
+            short client_events = 0;
+            short server_events = 0;
+            shaper_wants(c->up, now, client_events, server_events, wake);
+            shaper_wants(c->down, now, server_events, client_events, wake);
+            fds.push_back({c->up.from, client_events, 0});
+            fds.push_back({c->down.from, server_events, 0});
+        }
+        int timeout = wake < 0 ? -1 : (int)((wake - now + 999)/1000);
+        if(poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+            printf("Proxy poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if(fds[0].revents) {
+            break;
+        }
+        // Connections added here are not in fds yet.
+        size_t polled = sh.connections.size();
+        if(fds[1].revents & POLLIN) {
+            shaper_accept(sh);
+        }
+        now = g_get_monotonic_time();
+        for(size_t i=polled; i-- > 0;) {
+            ShapedConnection &c = *sh.connections[i];
+            short readable = POLLIN | POLLHUP | POLLERR;
+            bool ok = true;
+            if(fds[2+2*i].revents & readable) {
+                ok = shaper_read(sh, c.up);
+            }
+            if(ok && (fds[3+2*i].revents & readable)) {
+                ok = shaper_read(sh, c.down);
+            }
+            ok = ok && shaper_write(c.up, now) && shaper_write(c.down, now);
+            if(!ok || (c.up.shut && c.down.shut)) {
+                close(c.up.from);
+                close(c.down.from);
+                sh.connections.erase(sh.connections.begin() + i);
+            }
+        }
+    }
+    for(const auto &c : sh.connections) {
+        close(c->up.from);
+        close(c->down.from);
+    }
+    sh.connections.clear();
+    return nullptr;
+}
+
+static bool start_shaper(Shaper &sh, int target_port) {
+    sh.target_port = target_port;
+    sh.delay_us = opts.rtt_ms*1000/2;
+    sh.bytes_per_us = opts.bandwidth_kib*1024.0/G_USEC_PER_SEC;
+    sh.listen_fd = listen_loopback(sh.port);
+    if(sh.listen_fd < 0 || pipe(sh.stop_pipe) != 0) {
+        printf("Could not start proxy: %s\n", strerror(errno));
+        return false;
+    }
+    sh.thread = g_thread_new("shaper", shaper_thread, &sh);
+    return true;
+}
+
+static void stop_shaper(Shaper &sh) {
+    if(!sh.thread) {
+        return;
+    }
+    char c = 0;
+    write_all(sh.stop_pipe[1], &c, 1);
+    g_thread_join(sh.thread);
+    sh.thread = nullptr;
+    close(sh.stop_pipe[0]);
+    close(sh.stop_pipe[1]);
+    close(sh.listen_fd);
+}
+
+static bool run_command(const std::vector<std::string> &args) {
+    std::vector<gchar*> argv;
+    for(const auto &a : args) {
+        argv.push_back(const_cast<gchar*>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+    gint status;
+    GError *err = nullptr;
+    if(!g_spawn_sync(nullptr, argv.data(), nullptr, G_SPAWN_SEARCH_PATH, nullptr, nullptr,
+                     nullptr, nullptr, &status, &err)) {
+        printf("Could not run %s: %s\n", args[0].c_str(), err->message);
+        g_error_free(err);
+        return false;
+    }
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%s failed.\n", args[0].c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool write_file(const std::string &path, const std::string &contents) {
+    GError *err = nullptr;
+    if(!g_file_set_contents(path.c_str(), contents.data(), contents.size(), &err)) {
+        printf("Could not write %s: %s\n", path.c_str(), err->message);
+        g_error_free(err);
+        return false;
+    }
+    return true;
+}
+
+static std::string read_file(const std::string &path) {
+    gchar *contents = nullptr;
+    gsize len = 0;
+    std::string result;
+    if(g_file_get_contents(path.c_str(), &contents, &len, nullptr)) {
+        result.assign(contents, len);
+        g_free(contents);
+    }
+    return result;
+}
+
+// The fixture directory has no subdirectories.
+static void remove_dir(const std::string &dir) {
+    GDir *d = g_dir_open(dir.c_str(), 0, nullptr);
+    if(!d) {
+        return;
+    }
+    const gchar *name;
+    while((name = g_dir_read_name(d))) {
+        gchar *path = g_build_filename(dir.c_str(), name, nullptr);
+        g_unlink(path);
+        g_free(path);
+    }
+    g_dir_close(d);
+    g_rmdir(dir.c_str());
+}
+
+static bool start_sshd(SshdFixture &f, const char *sshd_path) {
+    GError *err = nullptr;
+    gchar *dir = g_dir_make_tmp("sshbench-XXXXXX", &err);
+    if(!dir) {
+        printf("Could not create a directory: %s\n", err->message);
+        g_error_free(err);
+        return false;
+    }
+    f.dir = dir;
+    g_free(dir);
+    // Journals and caches go here rather than in the user's home.
+    g_setenv("XDG_DATA_HOME", f.dir.c_str(), TRUE);
+    g_setenv("XDG_CACHE_HOME", f.dir.c_str(), TRUE);
+    std::string host_key = f.dir + "/host_key";
+    f.client_key = f.dir + "/client_key";
+    for(const auto &key : {host_key, f.client_key}) {
+        if(!run_command({"ssh-keygen", "-q", "-t", "ed25519", "-N", "", "-C", "sshbench", "-f", key})) {
+            return false;
+        }
+    }
+    std::string authorized_keys = f.dir + "/authorized_keys";
+    if(!write_file(authorized_keys, read_file(f.client_key + ".pub"))) {
+        return false;
+    }
+    f.port = free_port();
+    std::string config = f.dir + "/sshd_config";
+    std::string text =
+        "Port " + std::to_string(f.port) + "\n"
+        "ListenAddress 127.0.0.1\n"
+        "HostKey " + host_key + "\n"
+        "AuthorizedKeysFile " + authorized_keys + "\n"
+        "PidFile none\n"
+        "StrictModes no\n"
+        "PasswordAuthentication no\n"
+        "KbdInteractiveAuthentication no\n"
+        "AllowTcpForwarding yes\n"
+        "Subsystem sftp internal-sftp\n"
+        "LogLevel ERROR\n";
+    if(!write_file(config, text)) {
+        return false;
+    }
+    // sshd only runs from an absolute path.
+    std::vector<std::string> args{sshd_path, "-D", "-e", "-f", config};
+    std::vector<gchar*> argv;
+    for(const auto &a : args) {
+        argv.push_back(const_cast<gchar*>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+    if(!g_spawn_async(nullptr, argv.data(), nullptr, G_SPAWN_DO_NOT_REAP_CHILD, nullptr, nullptr, &f.pid, &err)) {
+        printf("Could not start %s: %s\n", sshd_path, err->message);
+        g_error_free(err);
+        return false;
+    }
+    gint64 deadline = g_get_monotonic_time() + SSHD_START_US;
+    while(true) {
+        int fd = connect_loopback(f.port);
+        if(fd >= 0) {
+            close(fd);
+            return true;
+        }
+        if(g_get_monotonic_time() > deadline || waitpid(f.pid, nullptr, WNOHANG) == f.pid) {
+            printf("sshd did not start.\n");
+            f.pid = 0;
+            return false;
+        }
+        g_usleep(20000);
+    }
+}
+
+static void stop_sshd(SshdFixture &f) {
+    if(f.pid) {
+        kill(f.pid, SIGTERM);
+        waitpid(f.pid, nullptr, 0);
+        g_spawn_close_pid(f.pid);
+        f.pid = 0;
+    }
+    if(!f.dir.empty()) {
+        remove_dir(f.dir);
+    }
+}
+
+// The client connects through the proxy, so that is the port recorded.
+static bool write_known_hosts(SshdFixture &f, int port) {
+    f.known_hosts = f.dir + "/known_hosts";
+    std::string line = "[127.0.0.1]:" + std::to_string(port) + " " + read_file(f.dir + "/host_key.pub");
+    return write_file(f.known_hosts, line);
+}
+
+static gpointer discard_thread(gpointer data) {
+    DiscardServer &ds = *reinterpret_cast<DiscardServer*>(data);
+    while(true) {
+        int fd = accept4(ds.listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            // The listener was shut down.
+            return nullptr;
+        }
+        drain(fd);
+        close(fd);
+    }
+}
+
+static bool start_discard(DiscardServer &ds) {
+    ds.listen_fd = listen_loopback(ds.port);
+    if(ds.listen_fd < 0) {
+        return false;
+    }
+    ds.thread = g_thread_new("discard", discard_thread, &ds);
+    return true;
+}
+
+static void stop_discard(DiscardServer &ds) {
+    if(!ds.thread) {
+        return;
+    }
+    shutdown(ds.listen_fd, SHUT_RDWR);
+    g_thread_join(ds.thread);
+    close(ds.listen_fd);
+    ds.thread = nullptr;
+}
+
+static void serve_session(Bench &b);
+
+static gboolean bench_tick(gpointer data) {
+    serve_session(*reinterpret_cast<Bench*>(data));
+    return G_SOURCE_CONTINUE;
+}
+
+static bool wait_for(Bench &b, const bool &flag) {
+    guint tick = thread_timeout_add(BENCH_TICK_MS, bench_tick, &b);
+    gint64 deadline = g_get_monotonic_time() + BENCH_TIMEOUT_US;
+    while(!flag && g_get_monotonic_time() < deadline) {
+        g_main_context_iteration(nullptr, TRUE);
+    }
+    thread_source_remove(tick);
+    return flag;
+}
+
+static void add_result(Bench &b, const std::string &name, double value) {
+    b.results.emplace_back(name, value);
+}
+
+static void add_error(Bench &b, const std::string &what) {
+    printf("%s\n", what.c_str());
+    b.errors.push_back(what);
+}
+
+static void read_flood(Bench &b) {
+    char buf[BENCH_IO_SIZE];
+    while(true) {
+        int num_read = b.pty.read(buf, sizeof(buf));
+        if(num_read <= 0) {
+            return;
+        }
+        if(!b.flooding) {
+            continue;
+        }
+        b.flood_bytes += num_read;
+        // The marker may be split between reads.
+        b.flood_tail.append(buf, num_read);
+        if(b.flood_tail.find(FLOOD_MARKER) != std::string::npos) {
+            b.flooding = false;
+            b.flood_done = true;
+        }
+        size_t keep = strlen(FLOOD_MARKER);
+        if(b.flood_tail.size() > keep) {
+            b.flood_tail.erase(0, b.flood_tail.size() - keep);
+        }
+    }
+}
+
+// What the client does when the session socket has data.
+static void serve_session(Bench &b) {
+    if(!b.event) {
+        return;
+    }
+    ssh_event_dopoll(b.event, 0);
+    read_flood(b);
+    if(transfers_pending(b.transfers)) {
+        feed_transfers(b.transfers);
+    }
+    feed_forwards(b.ports);
+}
+
+static gboolean session_has_data(GIOChannel *, GIOCondition, gpointer data) {
+    serve_session(*reinterpret_cast<Bench*>(data));
+    return TRUE;
+}
+
+static void disk_io_done(void *data) {
+    Bench &b = *reinterpret_cast<Bench*>(data);
+    if(transfers_pending(b.transfers)) {
+        feed_transfers(b.transfers);
+    }
+}
+
+static void bench_connected(Connector &c, bool ok, void *data) {
+    Bench &b = *reinterpret_cast<Bench*>(data);
+    b.connect_ok = ok;
+    if(!ok) {
+        b.connect_error = std::string(connect_phase_name(c.failed_phase)) + " failed: " + c.error;
+    }
+    b.connect_done = true;
+}
+
+static bool connect_session(Bench &b, SshSession &session, Connector &c) {
+    bool process_config = false;
+    ssh_options_set(session, SSH_OPTIONS_PROCESS_CONFIG, &process_config);
+    ssh_options_set(session, SSH_OPTIONS_KNOWNHOSTS, b.sshd.known_hosts.c_str());
+    ssh_options_set(session, SSH_OPTIONS_IDENTITY, b.sshd.client_key.c_str());
+    b.connect_done = false;
+    start_connect(c, b.dns, session, "127.0.0.1", b.shaper.port, g_get_user_name(), "", 1, bench_connected, &b);
+    if(!wait_for(b, b.connect_done)) {
+        cancel_connect(c);
+        add_error(b, "Connecting timed out.");
+        return false;
+    }
+    if(!b.connect_ok) {
+        add_error(b, "Could not connect: " + b.connect_error);
+        return false;
+    }
+    return true;
+}
+
+// Connects a few times and keeps the last session for the other tests.
+static bool bench_connect(Bench &b) {
+    gint64 totals[CONNECT_DONE] = {0};
+    int runs = std::max(opts.setups, 1);
+    for(int i=0; i<runs; i++) {
+        std::unique_ptr<SshSession> session(new SshSession());
+        Connector c = Connector();
+        if(!connect_session(b, *session, c)) {
+            ssh_disconnect(*session);
+            return false;
+        }
+        for(int p=0; p<CONNECT_DONE; p++) {
+            totals[p] += c.timings.phase_us[p];
+        }
+        if(b.session) {
+            b.pty = SshChannel();
+            ssh_disconnect(*b.session);
+        }
+        b.session = std::move(session);
+        b.pty = std::move(c.pty);
+    }
+    gint64 total = 0;
+    for(int p=0; p<CONNECT_DONE; p++) {
+        add_result(b, std::string("connect_") + phase_keys[p] + "_us", (double)totals[p]/runs);
+        total += totals[p];
+    }
+    add_result(b, "connect_total_us", (double)total/runs);
+    ssh_session session = *b.session;
+    b.event = ssh_event_new();
+    ssh_event_add_session(b.event, session);
+    b.session_channel = g_io_channel_unix_new(ssh_get_fd(session));
+    b.session_watch = thread_io_add_watch(b.session_channel, G_IO_IN, session_has_data, &b);
+    return true;
+}
+
+static void bench_flood(Bench &b) {
+    uint64_t size = (uint64_t)opts.flood_mib*1024*1024;
+    // The quotes keep the echoed command line from matching the marker.
+    std::string command = "head -c " + std::to_string(size) + " /dev/zero | tr '\\0' x; echo; echo sshbench-flood-''done\n";
+    // Whatever the shell printed at startup is not counted.
+    read_flood(b);
+    b.flood_bytes = 0;
+    b.flood_tail.clear();
+    b.flood_done = false;
+    b.flooding = true;
+    gint64 start = g_get_monotonic_time();
+    if(b.pty.write(&command[0], command.size()) != (int)command.size()) {
+        b.flooding = false;
+        add_error(b, std::string("Could not write to terminal: ") + ssh_get_error(*b.session));
+        return;
+    }
+    if(!wait_for(b, b.flood_done)) {
+        b.flooding = false;
+        add_error(b, "Terminal flood timed out.");
+        return;
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+    add_result(b, "terminal_flood_bytes_per_sec", b.flood_bytes*1e6/elapsed);
+}
+
+static void job_changed(const TransferJob &job, void *data) {
+    Bench &b = *reinterpret_cast<Bench*>(data);
+    if(job.status == TRANSFER_DONE || job.status == TRANSFER_FAILED) {
+        b.job_ok = job.status == TRANSFER_DONE;
+        b.job_done = true;
+    }
+}
+
+static bool make_test_file(const std::string &path, uint64_t size) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if(!f) {
+        return false;
+    }
+    // Random so that compression can not make the link look faster.
+    std::vector<guint32> block(BENCH_IO_SIZE/sizeof(guint32));
+    GRand *rand = g_rand_new();
+    uint64_t written = 0;
+    bool ok = true;
+    while(ok && written < size) {
+        for(auto &w : block) {
+            w = g_rand_int(rand);
+        }
+        size_t n = (size_t)std::min<uint64_t>(BENCH_IO_SIZE, size - written);
+        ok = fwrite(block.data(), 1, n, f) == n;
+        written += n;
+    }
+    g_rand_free(rand);
+    return fclose(f) == 0 && ok;
+}
+
+static void run_transfer(Bench &b, bool upload, const std::string &from, const std::string &to, uint64_t size) {
+    const char *what = upload ? "upload" : "download";
+    b.job_done = false;
+    b.job_ok = false;
+    gint64 start = g_get_monotonic_time();
+    if(upload) {
+        queue_upload(b.transfers, from.c_str(), to.c_str());
+    } else {
+        queue_download(b.transfers, from.c_str(), to.c_str(), size);
+    }
+    feed_transfers(b.transfers);
+    if(!wait_for(b, b.job_done)) {
+        cancel_transfers(b.transfers);
+        add_error(b, std::string("SFTP ") + what + " timed out.");
+        return;
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+    if(!b.job_ok) {
+        add_error(b, std::string("SFTP ") + what + " failed.");
+        return;
+    }
+    add_result(b, std::string("sftp_") + what + "_bytes_per_sec", size*1e6/elapsed);
+}
+
+static void bench_sftp(Bench &b) {
+    b.sftp = b.session->open_sftp_session();
+    if(b.sftp == nullptr) {
+        add_error(b, "Could not start SFTP.");
+        return;
+    }
+    // The test files are of no interest to the user's journal.
+    init_transfer_manager(b.transfers, b.disk, nullptr, *b.session, b.sftp, job_changed, &b);
+    uint64_t size = (uint64_t)opts.sftp_mib*1024*1024;
+    // The server runs as this user so remote paths are local ones too.
+    std::string source = b.sshd.dir + "/source";
+    std::string uploaded = b.sshd.dir + "/uploaded";
+    std::string downloaded = b.sshd.dir + "/downloaded";
+    if(!make_test_file(source, size)) {
+        add_error(b, "Could not create the test file.");
+        return;
+    }
+    run_transfer(b, true, source, uploaded, size);
+    run_transfer(b, false, uploaded, downloaded, size);
+    g_unlink(source.c_str());
+    g_unlink(uploaded.c_str());
+    g_unlink(downloaded.c_str());
+}
+
+static gboolean load_finished(gpointer data) {
+    reinterpret_cast<ForwardLoad*>(data)->done = true;
+    return G_SOURCE_REMOVE;
+}
+
+static bool send_through(int port, const std::vector<char> &block, uint64_t bytes) {
+    int fd = connect_loopback(port);
+    if(fd < 0) {
+        return false;
+    }
+    bool ok = true;
+    for(uint64_t sent=0; ok && sent<bytes; sent+=block.size()) {
+        ok = write_all(fd, block.data(), (size_t)std::min<uint64_t>(block.size(), bytes - sent));
+    }
+    // The forward closes once the far end has read everything.
+    ok = ok && shutdown(fd, SHUT_WR) == 0 && drain(fd);
+    close(fd);
+    return ok;
+}
+
+static gpointer forward_load_thread(gpointer data) {
+    ForwardLoad &load = *reinterpret_cast<ForwardLoad*>(data);
+    std::vector<char> block(BENCH_IO_SIZE, 'x');
+    gint64 start = g_get_monotonic_time();
+    load.ok = send_through(load.port, block, load.bytes);
+    load.throughput_us = g_get_monotonic_time() - start;
+    start = g_get_monotonic_time();
+    for(int i=0; load.ok && i<load.connections; i++) {
+        load.ok = send_through(load.port, block, 0);
+    }
+    load.connections_us = g_get_monotonic_time() - start;
+    g_main_context_invoke(nullptr, load_finished, &load);
+    return nullptr;
+}
+
+static void bench_forward(Bench &b) {
+    DiscardServer ds = DiscardServer();
+    if(!start_discard(ds)) {
+        add_error(b, "Could not start the forward target.");
+        return;
+    }
+    b.ports.session = *b.session;
+    int local_port = free_port();
+    if(local_port == 0 || !add_forward_rule(b.ports, local_port, ds.port, "127.0.0.1")) {
+        stop_discard(ds);
+        add_error(b, "Could not set up the port forward.");
+        return;
+    }
+    ForwardLoad load = ForwardLoad();
+    load.port = local_port;
+    load.bytes = (uint64_t)opts.forward_mib*1024*1024;
+    load.connections = opts.forward_connections;
+    load.thread = g_thread_new("forward load", forward_load_thread, &load);
+    if(!wait_for(b, load.done)) {
+        // The thread is stuck in a socket call, closing the forward
+        // gets it out.
+        remove_forward_rule(b.ports, local_port);
+        stop_discard(ds);
+        g_thread_join(load.thread);
+        add_error(b, "Port forward timed out.");
+        return;
+    }
+    g_thread_join(load.thread);
+    remove_forward_rule(b.ports, local_port);
+    stop_discard(ds);
+    if(!load.ok) {
+        add_error(b, "Port forward failed.");
+        return;
+    }
+    add_result(b, "forward_bytes_per_sec", load.bytes*1e6/load.throughput_us);
+    if(load.connections > 0) {
+        add_result(b, "forward_connections_per_sec", load.connections*1e6/load.connections_us);
+    }
+}
+
+static std::string json_string(const std::string &s) {
+    std::string result = "\"";
+    for(char c : s) {
+        if(c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            result += escaped;
+        } else {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+static std::string json_number(double value) {
+    if(!std::isfinite(value)) {
+        return "null";
+    }
+    // Not printf, the decimal separator must not follow the locale.
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    return g_ascii_dtostr(buf, sizeof(buf), value);
+}
+
+static std::string results_json(const Bench &b) {
+    std::string json = "{\n  \"config\": {\n";
+    const std::pair<const char*, int> config[] = {
+        {"rtt_ms", opts.rtt_ms},
+        {"bandwidth_kib", opts.bandwidth_kib},
+        {"setups", opts.setups},
+        {"flood_mib", opts.flood_mib},
+        {"sftp_mib", opts.sftp_mib},
+        {"forward_mib", opts.forward_mib},
+        {"forward_connections", opts.forward_connections},
+    };
+    for(size_t i=0; i<G_N_ELEMENTS(config); i++) {
+        json += std::string("    ") + json_string(config[i].first) + ": " + std::to_string(config[i].second);
+        json += i + 1 < G_N_ELEMENTS(config) ? ",\n" : "\n";
+    }
+    json += "  },\n  \"results\": {\n";
+    for(size_t i=0; i<b.results.size(); i++) {
+        json += "    " + json_string(b.results[i].first) + ": " + json_number(b.results[i].second);
+        json += i + 1 < b.results.size() ? ",\n" : "\n";
+    }
+    json += "  },\n  \"errors\": [";
+    for(size_t i=0; i<b.errors.size(); i++) {
+        json += (i ? ", " : "") + json_string(b.errors[i]);
+    }
+    return json + "]\n}\n";
+}
+
+int main(int argc, char **argv) {
+    GOptionContext *ctx = g_option_context_new("- measure SSH client performance");
+    g_option_context_add_main_entries(ctx, option_entries, nullptr);
+    GError *err = nullptr;
+    if(!g_option_context_parse(ctx, &argc, &argv, &err)) {
+        printf("%s\n", err->message);
+        g_error_free(err);
+        g_option_context_free(ctx);
+        return 2;
+    }
+    g_option_context_free(ctx);
+    // The engine reports problems on stdout, which is kept for the
+    // results alone.
+    fflush(stdout);
+    int json_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    // A failing test must not take the whole run down with it.
+    signal(SIGPIPE, SIG_IGN);
+    ssh_init();
+    std::unique_ptr<Bench> b(new Bench());
+    b->ports.io = nullptr;
+    bool ready = start_sshd(b->sshd, opts.sshd ? opts.sshd : "/usr/sbin/sshd") &&
+                 start_shaper(b->shaper, b->sshd.port) &&
+                 write_known_hosts(b->sshd, b->shaper.port) &&
+                 init_disk_io(b->disk, disk_io_done, b.get());
+    if(!ready) {
+        add_error(*b, "Could not set up the test server.");
+    } else if(bench_connect(*b)) {
+        bench_flood(*b);
+        bench_sftp(*b);
+        bench_forward(*b);
+    }
+    cancel_transfers(b->transfers);
+    b->sftp = SftpSession();
+    if(b->session_watch) {
+        thread_source_remove(b->session_watch);
+        g_io_channel_unref(b->session_channel);
+    }
+    if(b->event) {
+        ssh_event_free(b->event);
+    }
+    b->pty = SshChannel();
+    if(b->session) {
+        ssh_disconnect(*b->session);
+        b->session.reset();
+    }
+    close_disk_io(b->disk);
+    stop_shaper(b->shaper);
+    stop_sshd(b->sshd);
+    std::string json = results_json(*b);
+    bool ok = b->errors.empty();
+    fflush(stdout);
+    if(opts.output) {
+        ok = write_file(opts.output, json) && ok;
+    } else {
+        write_all(json_fd, json.data(), json.size());
+    }
+    close(json_fd);
+    ssh_finalize();
+    return ok ? 0 : 1;
+}
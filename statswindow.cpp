@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<statswindow.hpp>
+#include<cstring>
+
+enum StatsColumns {
+    STATS_NAME_COLUMN,
+    STATS_LABELS_COLUMN,
+    STATS_VALUE_COLUMN,
+    STATS_RATE_COLUMN,
+    STATS_N_COLUMNS,
+};
+
+static bool ends_with(const std::string &s, const char *suffix) {
+    size_t len = strlen(suffix);
+    return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+}
+
+// Sizes and times in the units people read them in.
+static std::string format_value(const std::string &name, double value) {
+    if(ends_with(name, "_bytes") || ends_with(name, "_bytes_total")) {
+        gchar *size = g_format_size((guint64)value);
+        std::string result(size);
+        g_free(size);
+        return result;
+    }
+    if(ends_with(name, "_seconds")) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.1f ms", value*1000);
+        return buf;
+    }
+    return format_metric_value(value);
+}
+
+static void show_snapshot(StatsWindow &sw, const MetricSet &set) {
+    gint64 now = g_get_monotonic_time();
+    double elapsed = (now - sw.previous_time)/1e6;
+    std::unordered_map<std::string, double> current;
+    GtkTreeModel *model = GTK_TREE_MODEL(sw.store);
+    GtkTreeIter iter;
+    // Rows are updated in place so that the view keeps its scroll
+    // position and selection.
+    bool have_row = gtk_tree_model_get_iter_first(model, &iter);
+    for(const auto &m : set.metrics) {
+        for(const auto &s : m.samples) {
+            std::string labels = format_labels(s.labels);
+            std::string rate;
+            if(m.type == METRIC_COUNTER) {
+                std::string key = m.name + "{" + labels + "}";
+                auto prev = sw.previous.find(key);
+                if(prev != sw.previous.end() && elapsed > 0 && s.value >= prev->second) {
+                    rate = format_value(m.name, (s.value - prev->second)/elapsed) + "/s";
+                }
+                current[key] = s.value;
+            }
+            if(!have_row) {
+                gtk_list_store_append(sw.store, &iter);
+            }
+            gtk_list_store_set(sw.store, &iter,
+                               STATS_NAME_COLUMN, m.name.c_str(),
+                               STATS_LABELS_COLUMN, labels.c_str(),
+                               STATS_VALUE_COLUMN, format_value(m.name, s.value).c_str(),
+                               STATS_RATE_COLUMN, rate.c_str(),
+                               -1);
+            have_row = have_row && gtk_tree_model_iter_next(model, &iter);
+        }
+    }
+    while(have_row) {
+        have_row = gtk_list_store_remove(sw.store, &iter);
+    }
+    sw.previous.swap(current);
+    sw.previous_time = now;
+}
+
+static gboolean refresh_stats(gpointer data) {
+    StatsWindow *sw = reinterpret_cast<StatsWindow*>(data);
+    // A busy I/O thread is not given more work on top.
+    if(sw->refreshing) {
+        return G_SOURCE_CONTINUE;
+    }
+    sw->refreshing = true;
+    run_on_io(*sw->io, [sw]() {
+        MetricSet set;
+        sw->collect(set, sw->collect_data);
+        run_on_ui(*sw->io, [sw, set]() {
+            sw->refreshing = false;
+            if(sw->refresh_source) {
+                show_snapshot(*sw, set);
+            }
+        });
+    });
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean stats_window_deleted(GtkWidget *widget, GdkEvent *, gpointer data) {
+    StatsWindow &sw = *reinterpret_cast<StatsWindow*>(data);
+    g_source_remove(sw.refresh_source);
+    sw.refresh_source = 0;
+    // Rates start over when the window is opened again.
+    sw.previous.clear();
+    gtk_widget_hide(widget);
+    return TRUE;
+}
+
+static void build_stats_window(StatsWindow &sw) {
+    sw.window = GTK_WINDOW(gtk_window_new(GTK_WINDOW_TOPLEVEL));
+    gtk_window_set_title(sw.window, "Statistics");
+    gtk_window_set_default_size(sw.window, 800, 600);
+    sw.store = gtk_list_store_new(STATS_N_COLUMNS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+    GtkTreeView *view = GTK_TREE_VIEW(gtk_tree_view_new_with_model(GTK_TREE_MODEL(sw.store)));
+    gtk_tree_view_append_column(view,
+                gtk_tree_view_column_new_with_attributes("Metric",
+                gtk_cell_renderer_text_new(), "text", STATS_NAME_COLUMN, nullptr));
+    gtk_tree_view_append_column(view,
+                gtk_tree_view_column_new_with_attributes("Labels",
+                gtk_cell_renderer_text_new(), "text", STATS_LABELS_COLUMN, nullptr));
+    gtk_tree_view_append_column(view,
+                gtk_tree_view_column_new_with_attributes("Value",
+                gtk_cell_renderer_text_new(), "text", STATS_VALUE_COLUMN, nullptr));
+    gtk_tree_view_append_column(view,
+                gtk_tree_view_column_new_with_attributes("Rate",
+                gtk_cell_renderer_text_new(), "text", STATS_RATE_COLUMN, nullptr));
+    GtkWidget *scroll = gtk_scrolled_window_new(nullptr, nullptr);
+    gtk_container_add(GTK_CONTAINER(scroll), GTK_WIDGET(view));
+    gtk_container_add(GTK_CONTAINER(sw.window), scroll);
+    g_signal_connect(sw.window, "delete-event", G_CALLBACK(stats_window_deleted), &sw);
+}
+
+void show_stats_window(StatsWindow &sw, IoThread &io, MetricsCollector collect, void *data) {
+    if(!sw.window) {
+        sw.io = &io;
+        sw.collect = collect;
+        sw.collect_data = data;
+        build_stats_window(sw);
+    }
+    if(!sw.refresh_source) {
+        sw.refresh_source = g_timeout_add(STATS_REFRESH_MS, refresh_stats, &sw);
+        refresh_stats(&sw);
+    }
+    gtk_widget_show_all(GTK_WIDGET(sw.window));
+    gtk_window_present(sw.window);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<metrics.hpp>
+#include<iothread.hpp>
+#include<gtk/gtk.h>
+#include<string>
+#include<unordered_map>
+
+static const constexpr guint STATS_REFRESH_MS = 1000;
+
+/*
+ * Shows the same metrics as the metrics socket, refreshed every second
+ * while the window is open. Counters also get their rate since the
+ * previous refresh.
+ */
+struct StatsWindow {
+    GtkWindow *window;
+    GtkListStore *store;
+    guint refresh_source;
+    bool refreshing; // A snapshot is on its way from the I/O thread.
+
+    IoThread *io;
+    MetricsCollector collect; // Called on the I/O thread.
+    void *collect_data;
+
+    // Counter values by metric and labels, from the previous refresh.
+    std::unordered_map<std::string, double> previous;
+    gint64 previous_time;
+};
+
+void show_stats_window(StatsWindow &sw, IoThread &io, MetricsCollector collect, void *data);
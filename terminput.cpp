@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<terminput.hpp>
+#include<util.hpp>
+
+#include<algorithm>
+#include<cstring>
+#include<cstdio>
+
+void record_latency(LatencyHistogram &h, gint64 usec) {
+    int bucket = 0;
+    while(bucket < LATENCY_BUCKETS-1 && usec >= ((gint64)2 << bucket)) {
+        bucket++;
+    }
+    h.buckets[bucket]++;
+    h.count++;
+    h.max = std::max(h.max, usec);
+}
+
+gint64 latency_percentile(const LatencyHistogram &h, double fraction) {
+    if(h.count == 0) {
+        return 0;
+    }
+    uint64_t wanted = (uint64_t)(fraction*h.count);
+    uint64_t seen = 0;
+    for(int i=0; i<LATENCY_BUCKETS-1; i++) {
+        seen += h.buckets[i];
+        if(seen > wanted) {
+            return std::min((gint64)2 << i, h.max);
+        }
+    }
+    return h.max;
+}
+
+std::string describe_latency(const LatencyHistogram &h) {
+    if(h.count == 0) {
+        return "No keystrokes have been echoed yet.";
+    }
+    char line[128];
+    std::string result;
+    snprintf(line, sizeof(line), "%llu keystrokes, median %.1f ms, 99%% %.1f ms, max %.1f ms\n\n",
+             (unsigned long long)h.count,
+             latency_percentile(h, 0.5)/1000.0,
+             latency_percentile(h, 0.99)/1000.0,
+             h.max/1000.0);
+    result += line;
+    for(int i=0; i<LATENCY_BUCKETS; i++) {
+        if(h.buckets[i] == 0) {
+            continue;
+        }
+        if(i == LATENCY_BUCKETS-1) {
+            snprintf(line, sizeof(line), "%9.1f ms -          : %llu\n",
+                     ((gint64)1 << i)/1000.0, (unsigned long long)h.buckets[i]);
+        } else {
+            snprintf(line, sizeof(line), "%9.1f ms - %7.1f ms: %llu\n",
+                     (i == 0 ? 0 : (gint64)1 << i)/1000.0, ((gint64)2 << i)/1000.0,
+                     (unsigned long long)h.buckets[i]);
+        }
+        result += line;
+    }
+    return result;
+}
+
+static gboolean continue_flush(gpointer data) {
+    TerminalInput &in = *reinterpret_cast<TerminalInput*>(data);
+    in.flush_source = 0;
+    flush_terminal_input(in);
+    return G_SOURCE_REMOVE;
+}
+
+static void release_held(TerminalInput &in) {
+    if(in.hold_source) {
+        thread_source_remove(in.hold_source);
+        in.hold_source = 0;
+    }
+    if(in.held_at) {
+        in.echo_wait = in.held_at;
+        in.held_at = 0;
+    }
+    flush_terminal_input(in);
+}
+
+static gboolean hold_expired(gpointer data) {
+    TerminalInput &in = *reinterpret_cast<TerminalInput*>(data);
+    in.hold_source = 0;
+    release_held(in);
+    return G_SOURCE_REMOVE;
+}
+
+void init_terminal_input(TerminalInput &in, ssh_channel channel) {
+    in.channel = channel;
+    ring_init(in.pending, INPUT_BUFFER_INITIAL, INPUT_BUFFER_MAX);
+    in.echo_wait = 0;
+    in.held_at = 0;
+    in.hold_source = 0;
+    in.flush_source = 0;
+    memset(in.latency.buckets, 0, sizeof(in.latency.buckets));
+    in.latency.count = 0;
+    in.latency.max = 0;
+    in.counters = ChannelCounters();
+}
+
+void close_terminal_input(TerminalInput &in) {
+    if(in.hold_source) {
+        thread_source_remove(in.hold_source);
+        in.hold_source = 0;
+    }
+    if(in.flush_source) {
+        thread_source_remove(in.flush_source);
+        in.flush_source = 0;
+    }
+    ring_clear(in.pending);
+    in.channel = nullptr;
+}
+
+void queue_terminal_input(TerminalInput &in, const char *text, size_t len, gint64 typed_at) {
+    if(!in.channel) {
+        return;
+    }
+    size_t done = 0;
+    while(done < len) {
+        size_t space;
+        char *buf = ring_write_ptr(in.pending, len - done, space);
+        if(space == 0) {
+            printf("Terminal input buffer is full, dropping %zu bytes.\n", len - done);
+            break;
+        }
+        size_t n = std::min(space, len - done);
+        memcpy(buf, text + done, n);
+        ring_commit(in.pending, n);
+        done += n;
+    }
+    if(len > INPUT_KEYSTROKE_MAX) {
+        flush_terminal_input(in);
+        return;
+    }
+    gint64 now = g_get_monotonic_time();
+    if(in.echo_wait && now - in.echo_wait < INPUT_HOLD_US) {
+        // Typed faster than the server answers, so this goes out with
+        // the echo of the previous keystroke rather than on its own.
+        if(!in.held_at) {
+            in.held_at = typed_at;
+            guint remaining = (guint)((in.echo_wait + INPUT_HOLD_US - now)/1000) + 1;
+            in.hold_source = thread_timeout_add(remaining, hold_expired, &in);
+        }
+        return;
+    }
+    if(!in.echo_wait) {
+        in.echo_wait = typed_at;
+    }
+    flush_terminal_input(in);
+}
+
+bool flush_terminal_input(TerminalInput &in) {
+    if(!in.channel || in.held_at) {
+        return true;
+    }
+    size_t written = 0;
+    while(in.pending.used > 0 && written < INPUT_FLUSH_MAX) {
+        // Writing more than the window would block until the server
+        // makes room.
+        uint32_t window = ssh_channel_window_size(in.channel);
+        if(window == 0) {
+            // The window adjust wakes up the session, which calls us.
+            return true;
+        }
+        size_t len;
+        const char *buf = ring_read_ptr(in.pending, len);
+        len = std::min<size_t>(std::min<size_t>(len, window), INPUT_FLUSH_MAX - written);
+        auto written_bytes = ssh_channel_write(in.channel, buf, len);
+        if(written_bytes == SSH_ERROR) {
+            printf("Error writing: %s\n", ssh_get_error(ssh_channel_get_session(in.channel)));
+            return false;
+        }
+        if(written_bytes == 0) {
+            return true;
+        }
+        ring_consume(in.pending, written_bytes);
+        written += written_bytes;
+        in.counters.bytes_out += written_bytes;
+        in.counters.writes++;
+    }
+    if(in.pending.used > 0 && in.flush_source == 0) {
+        // The rest of a big paste, after other traffic has had a turn.
+        in.flush_source = thread_idle_add(continue_flush, &in);
+    }
+    return true;
+}
+
+void terminal_output_arrived(TerminalInput &in) {
+    if(in.echo_wait) {
+        gint64 latency = g_get_monotonic_time() - in.echo_wait;
+        if(latency < INPUT_ECHO_TIMEOUT_US) {
+            record_latency(in.latency, latency);
+        }
+        in.echo_wait = 0;
+    }
+    if(in.held_at) {
+        release_held(in);
+    }
+}
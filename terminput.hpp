@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<ringbuffer.hpp>
+#include<ssh_util.hpp>
+#include<libssh/libssh.h>
+#include<glib.h>
+#include<string>
+#include<cstdint>
+
+// Input longer than this in one go is a paste rather than typing.
+static const constexpr size_t INPUT_KEYSTROKE_MAX = 8;
+// Keystrokes typed this soon after one that has not been echoed yet
+// wait for the echo and go out together.
+static const constexpr gint64 INPUT_HOLD_US = 30000;
+// An echo that comes later than this was probably not one.
+static const constexpr gint64 INPUT_ECHO_TIMEOUT_US = 2*G_USEC_PER_SEC;
+// Written at a time before other channels get their turn.
+static const constexpr size_t INPUT_FLUSH_MAX = 64*1024;
+static const constexpr size_t INPUT_BUFFER_INITIAL = 4*1024;
+static const constexpr size_t INPUT_BUFFER_MAX = 64*1024*1024;
+
+static const constexpr int LATENCY_BUCKETS = 24;
+
+/*
+ * Bucket i counts latencies of 2^i up to 2^(i+1) microseconds, the
+ * last one everything longer.
+ */
+struct LatencyHistogram {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    gint64 max;
+};
+
+void record_latency(LatencyHistogram &h, gint64 usec);
+// Upper bound of the bucket the given fraction of samples falls into.
+gint64 latency_percentile(const LatencyHistogram &h, double fraction);
+std::string describe_latency(const LatencyHistogram &h);
+
+/*
+ * Text typed or pasted into the terminal on its way to the server.
+ * It is never written beyond the channel window, so a large paste
+ * goes out as the server makes room and nothing blocks. Pastes already
+ * carry the bracketed paste markers if the remote side asked for them.
+ *
+ * The time from a keystroke to the next output from the server is
+ * recorded as its echo latency.
+ */
+struct TerminalInput {
+    ssh_channel channel; // A non-owning pointer.
+    RingBuffer pending;
+    gint64 echo_wait; // When the keystroke waiting for its echo was typed.
+    gint64 held_at;   // When the first held keystroke was typed.
+    guint hold_source;
+    guint flush_source;
+    LatencyHistogram latency;
+    // Of the whole terminal channel, output is counted where it is read.
+    ChannelCounters counters;
+};
+
+void init_terminal_input(TerminalInput &in, ssh_channel channel);
+void close_terminal_input(TerminalInput &in);
+void queue_terminal_input(TerminalInput &in, const char *text, size_t len, gint64 typed_at);
+// Call when the channel window may have grown.
+bool flush_terminal_input(TerminalInput &in);
+void terminal_output_arrived(TerminalInput &in);
@@ -0,0 +1,1073 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<transfer.hpp>
+#include<util.hpp>
+
+#include<glib/gstdio.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/stat.h>
+#include<cerrno>
+#include<cstring>
+#include<cstdio>
+#include<algorithm>
+
+// Room for the SFTP and SSH packet headers of one write request.
+static const constexpr uint32_t SFTP_WRITE_OVERHEAD = 1024;
+
+// Servers without the limits extension get libssh's conservative defaults.
+static uint32_t clamp_chunk_size(uint64_t limit) {
+    if(limit == 0) {
+        return SFTP_FALLBACK_CHUNK_SIZE;
+    }
+    return (uint32_t) std::min<uint64_t>(limit, SFTP_MAX_CHUNK_SIZE);
+}
+
+uint32_t negotiate_read_size(sftp_session sftp) {
+    uint32_t size = SFTP_FALLBACK_CHUNK_SIZE;
+    sftp_limits_t limits = sftp_limits(sftp);
+    if(limits) {
+        size = clamp_chunk_size(limits->max_read_length);
+        sftp_limits_free(limits);
+    }
+    return size;
+}
+
+uint32_t negotiate_write_size(sftp_session sftp) {
+    uint32_t size = SFTP_FALLBACK_CHUNK_SIZE;
+    sftp_limits_t limits = sftp_limits(sftp);
+    if(limits) {
+        size = clamp_chunk_size(limits->max_write_length);
+        sftp_limits_free(limits);
+    }
+    return size;
+}
+
+// Each sample counts for an eighth, as in TCP's round trip estimate.
+static void update_reply_time(gint64 &reply_time, gint64 sent) {
+    gint64 sample = g_get_monotonic_time() - sent;
+    reply_time = reply_time == 0 ? sample : reply_time + (sample - reply_time)/8;
+}
+
+static bool issue_read(SftpDownload &dl, uint64_t offset, uint32_t size, bool urgent) {
+    // Requests go out at the file offset libssh keeps, which only needs
+    // moving for the rest of a short read. Seeking is local, it sends
+    // nothing.
+    if(sftp_tell64(dl.remote_file) != offset && sftp_seek64(dl.remote_file, offset) < 0) {
+        printf("Could not seek remote file: %s\n", ssh_get_error(dl.session));
+        return false;
+    }
+    ReadRequest r{nullptr, offset, size, g_get_monotonic_time()};
+    if(sftp_aio_begin_read(dl.remote_file, size, &r.aio) < 0) {
+        printf("Could not request file data: %s\n", ssh_get_error(dl.session));
+        return false;
+    }
+    if(urgent) {
+        dl.requests.push_front(r);
+    } else {
+        dl.requests.push_back(r);
+    }
+    return true;
+}
+
+static bool fill_read_window(SftpDownload &dl) {
+    // Requesting past the end is wasteful, but one request at the end is
+    // needed so that we see the EOF of files that grew.
+    while(!dl.eof && (int)(dl.requests.size() + dl.writes.size()) < dl.max_requests && dl.next_offset <= dl.size) {
+        if(!issue_read(dl, dl.next_offset, dl.chunk_size, false)) {
+            return false;
+        }
+        dl.next_offset += dl.chunk_size;
+    }
+    return true;
+}
+
+bool start_download(SftpDownload &dl, DiskIo &io, ssh_session session, sftp_session sftp,
+                    const char *remote_path, const char *local_path,
+                    uint64_t size, uint64_t offset, int max_requests) {
+    dl.session = session;
+    dl.io = &io;
+    dl.local_fd = -1;
+    auto remote_file = sftp_open(sftp, remote_path, O_RDONLY, 0);
+    if(remote_file == nullptr) {
+        printf("Could not open file: %s\n", ssh_get_error(session));
+        return false;
+    }
+    sftp_file_set_nonblocking(remote_file);
+    int fd = open(local_path, O_WRONLY | O_CREAT | O_CLOEXEC | (offset == 0 ? O_TRUNC : 0), 0666);
+    if(fd >= 0 && offset > 0 && ftruncate(fd, offset) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    if(fd < 0) {
+        sftp_close(remote_file);
+        printf("Could not open local file.\n");
+        return false;
+    }
+    // Running out of space is better found out now than after an hour.
+    if(size > offset && !preallocate_file(fd, offset, size - offset)) {
+        close(fd);
+        sftp_close(remote_file);
+        return false;
+    }
+    dl.local_fd = fd;
+    dl.remote_file = SftpFile(remote_file);
+    dl.requests.clear();
+    dl.writes.clear();
+    dl.chunk_size = negotiate_read_size(sftp);
+    dl.max_requests = std::max(max_requests, 1);
+    dl.next_offset = offset;
+    dl.eof = false;
+    dl.reply_time = 0;
+    dl.size = size;
+    dl.transferred = offset;
+    if(!fill_read_window(dl)) {
+        finish_download(dl);
+        return false;
+    }
+    return true;
+}
+
+static bool reap_writes(SftpDownload &dl) {
+    for(auto it = dl.writes.begin(); it != dl.writes.end();) {
+        const DiskOp &op = **it;
+        if(!op.done) {
+            ++it;
+            continue;
+        }
+        if(op.result != op.len) {
+            printf("Could not write to file: %s\n", strerror(op.result < 0 ? -op.result : ENOSPC));
+            return false;
+        }
+        dl.transferred += op.len;
+        release_disk_op(*dl.io, std::move(*it));
+        it = dl.writes.erase(it);
+    }
+    return true;
+}
+
+TransferStatus feed_download(SftpDownload &dl) {
+    while(!dl.requests.empty()) {
+        ReadRequest &front = dl.requests.front();
+        // The reply goes straight into the buffer of the disk write.
+        auto op = acquire_disk_op(*dl.io, front.size);
+        ssize_t bytes_read = sftp_aio_wait_read(&front.aio, op->buf.data(), front.size);
+        if(bytes_read == SSH_AGAIN) {
+            release_disk_op(*dl.io, std::move(op));
+            break;
+        }
+        // The aio handle has been released in all other cases.
+        ReadRequest r = front;
+        dl.requests.pop_front();
+        update_reply_time(dl.reply_time, r.sent);
+        if(bytes_read < 0) {
+            release_disk_op(*dl.io, std::move(op));
+            printf("Error reading file: %s\n", ssh_get_error(dl.session));
+            return TRANSFER_FAILED;
+        }
+        if(bytes_read == 0) {
+            // Everything after this is also past the end, the remaining
+            // replies are only drained.
+            dl.eof = true;
+        }
+        if(dl.eof) {
+            release_disk_op(*dl.io, std::move(op));
+            continue;
+        }
+        if(r.offset + bytes_read > dl.size) {
+            dl.size = r.offset + bytes_read;
+        }
+        if((uint32_t)bytes_read < r.size) {
+            // The server gave us less than we asked for. The rest must
+            // arrive before any of the later requests.
+            if(!issue_read(dl, r.offset + bytes_read, r.size - bytes_read, true)) {
+                release_disk_op(*dl.io, std::move(op));
+                return TRANSFER_FAILED;
+            }
+        }
+        DiskOp &w = *op;
+        dl.writes.push_back(std::move(op));
+        submit_disk_write(*dl.io, w, dl.local_fd, r.offset, bytes_read);
+    }
+    if(!reap_writes(dl)) {
+        return TRANSFER_FAILED;
+    }
+    if(!fill_read_window(dl)) {
+        return TRANSFER_FAILED;
+    }
+    if(dl.requests.empty() && dl.writes.empty()) {
+        return TRANSFER_DONE;
+    }
+    return TRANSFER_RUNNING;
+}
+
+uint64_t download_confirmed(const SftpDownload &dl) {
+    // Everything below the lowest chunk still on its way is on disk.
+    uint64_t confirmed = std::min(dl.next_offset, dl.size);
+    for(const auto &r : dl.requests) {
+        confirmed = std::min(confirmed, r.offset);
+    }
+    for(const auto &w : dl.writes) {
+        confirmed = std::min(confirmed, w->offset);
+    }
+    return confirmed;
+}
+
+void finish_download(SftpDownload &dl) {
+    // Closing the file discards replies to requests that are still out.
+    for(auto &r : dl.requests) {
+        sftp_aio_free(r.aio);
+    }
+    dl.requests.clear();
+    dl.remote_file = SftpFile();
+    for(auto &w : dl.writes) {
+        wait_disk_op(*dl.io, *w);
+        release_disk_op(*dl.io, std::move(w));
+    }
+    dl.writes.clear();
+    if(dl.local_fd >= 0) {
+        close(dl.local_fd);
+        dl.local_fd = -1;
+    }
+}
+
+static void fill_read_ahead(SftpUpload &ul) {
+    // Streams have to be read one chunk at a time to keep the order.
+    size_t depth = ul.streaming ? 1 : ul.max_requests;
+    while(!ul.read_eof && ul.reads.size() < depth && (ul.streaming || ul.read_offset < ul.size)) {
+        uint32_t chunk = ul.chunk_size;
+        uint64_t offset = DISK_STREAM_OFFSET;
+        if(!ul.streaming) {
+            chunk = (uint32_t) std::min<uint64_t>(chunk, ul.size - ul.read_offset);
+            offset = ul.read_offset;
+            ul.read_offset += chunk;
+        }
+        auto op = acquire_disk_op(*ul.io, chunk);
+        DiskOp &r = *op;
+        ul.reads.push_back(std::move(op));
+        submit_disk_read(*ul.io, r, ul.local_fd, offset, chunk);
+    }
+}
+
+static bool fill_write_window(SftpUpload &ul) {
+    fill_read_ahead(ul);
+    while(!ul.reads.empty() && ul.reads.front()->done && (int)ul.requests.size() < ul.max_requests) {
+        const DiskOp &r = *ul.reads.front();
+        if(r.result < 0) {
+            printf("Could not read file: %s\n", strerror(-r.result));
+            return false;
+        }
+        uint32_t chunk = (uint32_t) r.result;
+        if(ul.streaming && chunk == 0) {
+            ul.read_eof = true;
+            release_disk_op(*ul.io, std::move(ul.reads.front()));
+            ul.reads.pop_front();
+            continue;
+        }
+        if(!ul.streaming && chunk < r.len) {
+            printf("File shrank while it was being uploaded.\n");
+            return false;
+        }
+        // Writing into a full channel window would block the main loop
+        // until the server catches up. Wait for the window adjust instead.
+        if(ssh_channel_window_size(ul.sftp->channel) < chunk + SFTP_WRITE_OVERHEAD) {
+            break;
+        }
+        if(sftp_seek64(ul.remote_file, ul.next_offset) < 0) {
+            printf("Could not seek remote file: %s\n", ssh_get_error(ul.session));
+            return false;
+        }
+        // The data is copied into the packet, so the buffer can be reused
+        // right away.
+        WriteRequest w{nullptr, ul.next_offset, chunk, g_get_monotonic_time()};
+        if(sftp_aio_begin_write(ul.remote_file, r.buf.data(), chunk, &w.aio) < 0) {
+            printf("Could not send file data: %s\n", ssh_get_error(ul.session));
+            return false;
+        }
+        ul.requests.push_back(w);
+        ul.next_offset += chunk;
+        if(ul.streaming) {
+            ul.size = ul.next_offset;
+        }
+        release_disk_op(*ul.io, std::move(ul.reads.front()));
+        ul.reads.pop_front();
+        fill_read_ahead(ul);
+    }
+    return true;
+}
+
+bool start_upload(SftpUpload &ul, DiskIo &io, ssh_session session, sftp_session sftp,
+                  const char *local_path, const char *remote_path,
+                  uint64_t offset, int max_requests) {
+    struct stat buf;
+    ul.local_fd = -1;
+    int fd = open(local_path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &buf) != 0) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        printf("Could not open local file %s.\n", local_path);
+        return false;
+    }
+    ul.session = session;
+    ul.sftp = sftp;
+    ul.io = &io;
+    ul.streaming = !S_ISREG(buf.st_mode);
+    mode_t fmode = ul.streaming ? (S_IRUSR | S_IWUSR) : buf.st_mode;
+    // A stream can not be rewound, so it always starts from the top.
+    if(ul.streaming) {
+        offset = 0;
+    } else {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    auto remote_file = sftp_open(sftp, remote_path, O_WRONLY | O_CREAT | (offset == 0 ? O_TRUNC : 0), fmode);
+    if(remote_file == nullptr) {
+        close(fd);
+        printf("Could not open remote file %s.\n", ssh_get_error(session));
+        return false;
+    }
+    sftp_file_set_nonblocking(remote_file);
+    ul.local_fd = fd;
+    ul.remote_file = SftpFile(remote_file);
+    ul.requests.clear();
+    ul.reads.clear();
+    ul.chunk_size = negotiate_write_size(sftp);
+    ul.max_requests = std::max(max_requests, 1);
+    ul.size = ul.streaming ? 0 : buf.st_size;
+    ul.next_offset = std::min<uint64_t>(offset, ul.size);
+    ul.read_offset = ul.next_offset;
+    ul.read_eof = false;
+    ul.reply_time = 0;
+    ul.transferred = ul.next_offset;
+    if(!fill_write_window(ul)) {
+        finish_upload(ul);
+        return false;
+    }
+    return true;
+}
+
+TransferStatus feed_upload(SftpUpload &ul) {
+    for(auto it = ul.requests.begin(); it != ul.requests.end();) {
+        auto written = sftp_aio_wait_write(&it->aio);
+        if(written == SSH_AGAIN) {
+            ++it;
+            continue;
+        }
+        // The aio handle has been released in both of the remaining cases.
+        it->aio = nullptr;
+        update_reply_time(ul.reply_time, it->sent);
+        if(written < 0 || (uint64_t)written != it->size) {
+            printf("Writing failed: %s\n", ssh_get_error(ul.session));
+            return TRANSFER_FAILED;
+        }
+        ul.transferred += written;
+        it = ul.requests.erase(it);
+    }
+    if(!fill_write_window(ul)) {
+        return TRANSFER_FAILED;
+    }
+    bool all_read = ul.streaming ? ul.read_eof : ul.next_offset >= ul.size;
+    if(ul.requests.empty() && ul.reads.empty() && all_read) {
+        return TRANSFER_DONE;
+    }
+    return TRANSFER_RUNNING;
+}
+
+uint64_t upload_confirmed(const SftpUpload &ul) {
+    // Requests are issued in offset order and removed once acknowledged.
+    if(ul.requests.empty()) {
+        return ul.next_offset;
+    }
+    return ul.requests.front().offset;
+}
+
+void finish_upload(SftpUpload &ul) {
+    for(auto &w : ul.requests) {
+        if(w.aio) {
+            sftp_aio_free(w.aio);
+        }
+    }
+    ul.requests.clear();
+    ul.remote_file = SftpFile();
+    for(auto &r : ul.reads) {
+        wait_disk_op(*ul.io, *r);
+        release_disk_op(*ul.io, std::move(r));
+    }
+    ul.reads.clear();
+    if(ul.local_fd >= 0) {
+        close(ul.local_fd);
+        ul.local_fd = -1;
+    }
+}
+
+static std::string session_key(ssh_session session) {
+    char *host = nullptr;
+    char *user = nullptr;
+    unsigned int port = 22;
+    ssh_options_get(session, SSH_OPTIONS_HOST, &host);
+    ssh_options_get(session, SSH_OPTIONS_USER, &user);
+    ssh_options_get_port(session, &port);
+    std::string key = std::string(user ? user : "") + "@" + (host ? host : "") + ":" + std::to_string(port);
+    if(host) {
+        ssh_string_free_char(host);
+    }
+    if(user) {
+        ssh_string_free_char(user);
+    }
+    return key;
+}
+
+static int queue_job(TransferManager &tm, TransferDirection direction, const char *local_path,
+                     const char *remote_path, const char *source_path, uint64_t size);
+
+void init_transfer_manager(TransferManager &tm, DiskIo &io, TransferJournal *journal,
+                           ssh_session session, sftp_session sftp,
+                           TransferCallback job_changed, void *callback_data) {
+    tm.session = session;
+    tm.sftp = sftp;
+    tm.max_active = SFTP_DEFAULT_MAX_ACTIVE;
+    tm.max_requests = SFTP_DEFAULT_MAX_REQUESTS;
+    tm.max_walks = SFTP_DEFAULT_MAX_WALKS;
+    tm.delta = false;
+    tm.next_id = 0;
+    tm.next_to_feed = 0;
+    tm.idle_source = 0;
+    tm.bytes_moved = 0;
+    tm.files_done = 0;
+    tm.files_failed = 0;
+    tm.delta_saved = 0;
+    tm.job_changed = job_changed;
+    tm.callback_data = callback_data;
+    tm.io = &io;
+    tm.journal = journal;
+    tm.session_key = session_key(session);
+    if(!tm.journal) {
+        return;
+    }
+    for(const auto &e : journal_entries(*tm.journal, tm.session_key)) {
+        queue_job(tm, e.upload ? TRANSFER_UPLOAD : TRANSFER_DOWNLOAD,
+                  e.local_path.c_str(), e.remote_path.c_str(), "", e.size);
+    }
+}
+
+static int queue_job(TransferManager &tm, TransferDirection direction, const char *local_path,
+                     const char *remote_path, const char *source_path, uint64_t size) {
+    std::unique_ptr<TransferJob> job(new TransferJob());
+    job->id = tm.next_id++;
+    job->direction = direction;
+    job->local_path = local_path;
+    job->remote_path = remote_path;
+    job->source_path = source_path;
+    job->journaled_offset = 0;
+    job->use_delta = false;
+    job->status = TRANSFER_QUEUED;
+    job->size = size;
+    job->transferred = 0;
+    int id = job->id;
+    if(tm.job_changed) {
+        tm.job_changed(*job, tm.callback_data);
+    }
+    tm.queued.push_back(std::move(job));
+    return id;
+}
+
+int queue_download(TransferManager &tm, const char *remote_path, const char *local_path, uint64_t size) {
+    return queue_job(tm, TRANSFER_DOWNLOAD, local_path, remote_path, "", size);
+}
+
+int queue_upload(TransferManager &tm, const char *local_path, const char *remote_path) {
+    return queue_job(tm, TRANSFER_UPLOAD, local_path, remote_path, "", 0);
+}
+
+int queue_remote_copy(TransferManager &tm, const char *from, const char *to) {
+    return queue_job(tm, TRANSFER_REMOTE_COPY, "", to, from, 0);
+}
+
+int queue_remote_move(TransferManager &tm, const char *from, const char *to) {
+    return queue_job(tm, TRANSFER_REMOTE_MOVE, "", to, from, 0);
+}
+
+bool job_moves_data(const TransferJob &job) {
+    return job.direction == TRANSFER_DOWNLOAD || job.direction == TRANSFER_UPLOAD;
+}
+
+const char* transfer_direction_name(TransferDirection direction) {
+    switch(direction) {
+    case TRANSFER_DOWNLOAD: return "download";
+    case TRANSFER_UPLOAD: return "upload";
+    case TRANSFER_REMOTE_COPY: return "copy";
+    case TRANSFER_REMOTE_MOVE: return "move";
+    }
+    return "";
+}
+
+bool transfers_pending(const TransferManager &tm) {
+    return !tm.queued.empty() || !tm.active.empty() || !tm.walks.empty();
+}
+
+static int requests_per_job(const TransferManager &tm) {
+    return std::max(tm.max_requests / std::max((int)tm.active.size(), 1), 1);
+}
+
+// How much of the temporary file is already there.
+static uint64_t partial_size(TransferManager &tm, const TransferJob &job) {
+    uint64_t size = 0;
+    if(job.direction == TRANSFER_UPLOAD) {
+        sftp_attributes attr = sftp_stat(tm.sftp, job.temp_path.c_str());
+        if(attr) {
+            size = attr->size;
+            sftp_attributes_free(attr);
+        }
+    } else {
+        struct stat st;
+        if(stat(job.temp_path.c_str(), &st) == 0) {
+            size = st.st_size;
+        }
+    }
+    return size;
+}
+
+// Adds large jobs to the journal and tells the offset to resume from.
+// Fails if another session is transferring the same file.
+static bool journal_job(TransferManager &tm, TransferJob &job, uint64_t &offset) {
+    offset = 0;
+    if(!tm.journal) {
+        return true;
+    }
+    JournalEntry entry;
+    entry.upload = job.direction == TRANSFER_UPLOAD;
+    entry.local_path = job.local_path;
+    entry.remote_path = job.remote_path;
+    entry.size = 0;
+    entry.mtime = 0;
+    entry.offset = 0;
+    if(entry.upload) {
+        struct stat st;
+        if(stat(job.local_path.c_str(), &st) != 0 || (uint64_t)st.st_size < SFTP_JOURNAL_MIN_SIZE) {
+            return true;
+        }
+        entry.size = st.st_size;
+        entry.mtime = st.st_mtime;
+    } else {
+        // The listing already told us the size, only large files are
+        // worth the round trip.
+        if(job.size < SFTP_JOURNAL_MIN_SIZE) {
+            return true;
+        }
+        sftp_attributes attr = sftp_stat(tm.sftp, job.remote_path.c_str());
+        if(!attr) {
+            return true;
+        }
+        entry.size = attr->size;
+        entry.mtime = attr->mtime;
+        sftp_attributes_free(attr);
+    }
+    entry.id = journal_id(tm.session_key, entry.upload, job.local_path, job.remote_path);
+    JournalEntry old;
+    // Only continue if the source is still the same version. The journal
+    // may be ahead of the file if we crashed before the data hit the disk.
+    if(journal_lookup(*tm.journal, tm.session_key, entry.id, old) && old.size == entry.size && old.mtime == entry.mtime) {
+        entry.offset = std::min(old.offset, partial_size(tm, job));
+    }
+    if(!journal_add(*tm.journal, tm.session_key, entry)) {
+        printf("%s is already being transferred by another session.\n", job.remote_path.c_str());
+        return false;
+    }
+    job.journal_id = entry.id;
+    job.journaled_offset = entry.offset;
+    offset = entry.offset;
+    return true;
+}
+
+static bool start_plain(TransferManager &tm, TransferJob &job) {
+    bool download = job.direction == TRANSFER_DOWNLOAD;
+    job.temp_path = (download ? job.local_path : job.remote_path) + SFTP_PARTIAL_SUFFIX;
+    uint64_t offset;
+    bool ok = journal_job(tm, job, offset);
+    if(ok && download) {
+        ok = start_download(job.download, *tm.io, tm.session, tm.sftp, job.remote_path.c_str(),
+                            job.temp_path.c_str(), job.size, offset, requests_per_job(tm));
+        job.size = job.download.size;
+        job.transferred = job.download.transferred;
+    } else if(ok) {
+        ok = start_upload(job.upload, *tm.io, tm.session, tm.sftp, job.local_path.c_str(),
+                          job.temp_path.c_str(), offset, requests_per_job(tm));
+        job.size = job.upload.size;
+        job.transferred = job.upload.transferred;
+    }
+    if(!ok && !job.journal_id.empty()) {
+        journal_release(*tm.journal, job.journal_id, job.journaled_offset);
+        job.journal_id.clear();
+    }
+    job.status = ok ? TRANSFER_RUNNING : TRANSFER_FAILED;
+    return ok;
+}
+
+// Delta only pays off if the destination already has a version of the file.
+static bool start_delta_job(TransferManager &tm, TransferJob &job) {
+    uint64_t remote_size = 0;
+    if(job.direction == TRANSFER_DOWNLOAD) {
+        struct stat st;
+        if(stat(job.local_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < DELTA_MIN_SIZE) {
+            return false;
+        }
+        job.temp_path = job.local_path + SFTP_PARTIAL_SUFFIX;
+        remote_size = job.size;
+    } else {
+        sftp_attributes attr = sftp_stat(tm.sftp, job.remote_path.c_str());
+        if(!attr) {
+            return false;
+        }
+        bool usable = attr->type == SSH_FILEXFER_TYPE_REGULAR && attr->size >= DELTA_MIN_SIZE;
+        remote_size = attr->size;
+        sftp_attributes_free(attr);
+        if(!usable) {
+            return false;
+        }
+        job.temp_path = job.remote_path + SFTP_PARTIAL_SUFFIX;
+    }
+    if(!start_delta(job.delta, tm.session, job.direction == TRANSFER_UPLOAD, job.local_path.c_str(),
+                    job.remote_path.c_str(), job.temp_path.c_str(), remote_size)) {
+        return false;
+    }
+    job.use_delta = true;
+    job.size = job.delta.size;
+    job.transferred = 0;
+    job.status = TRANSFER_RUNNING;
+    return true;
+}
+
+static bool start_job(TransferManager &tm, TransferJob &job) {
+    job.started = g_get_monotonic_time();
+    if(!job_moves_data(job)) {
+        bool ok = start_remote_copy(job.remote, tm.session, tm.sftp, job.source_path.c_str(),
+                                    job.remote_path.c_str(), job.direction == TRANSFER_REMOTE_MOVE);
+        job.size = job.remote.size;
+        job.status = ok ? TRANSFER_RUNNING : TRANSFER_FAILED;
+        return ok;
+    }
+    if(tm.delta && start_delta_job(tm, job)) {
+        return true;
+    }
+    return start_plain(tm, job);
+}
+
+static uint64_t confirmed_offset(const TransferJob &job) {
+    if(job.direction == TRANSFER_DOWNLOAD) {
+        return download_confirmed(job.download);
+    }
+    return upload_confirmed(job.upload);
+}
+
+// Moves the finished file over the real one.
+static bool commit_job(TransferManager &tm, TransferJob &job) {
+    if(job.direction == TRANSFER_DOWNLOAD) {
+        if(g_rename(job.temp_path.c_str(), job.local_path.c_str()) != 0) {
+            printf("Could not rename %s.\n", job.temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+    if(sftp_rename(tm.sftp, job.temp_path.c_str(), job.remote_path.c_str()) == SSH_OK) {
+        return true;
+    }
+    // Plain SFTPv3 rename refuses to replace existing files. This leaves
+    // a short window without the file, but never a truncated one.
+    sftp_unlink(tm.sftp, job.remote_path.c_str());
+    if(sftp_rename(tm.sftp, job.temp_path.c_str(), job.remote_path.c_str()) != SSH_OK) {
+        printf("Could not rename %s: %s\n", job.temp_path.c_str(), ssh_get_error(tm.session));
+        return false;
+    }
+    return true;
+}
+
+static void finish_job(TransferManager &tm, TransferJob &job) {
+    if(!job_moves_data(job)) {
+        // There is no temporary file, the command wrote the real one.
+        finish_remote_copy(job.remote);
+        return;
+    }
+    uint64_t confirmed = confirmed_offset(job);
+    // The file must not be closed under the sync.
+    if(job.journal_sync) {
+        wait_disk_op(*tm.io, *job.journal_sync);
+        if(job.journal_sync->result == 0) {
+            job.journaled_offset = std::max(job.sync_offset, job.journaled_offset);
+        }
+        release_disk_op(*tm.io, std::move(job.journal_sync));
+    }
+    if(job.use_delta) {
+        finish_delta(job.delta);
+    } else if(job.direction == TRANSFER_DOWNLOAD) {
+        finish_download(job.download);
+    } else {
+        finish_upload(job.upload);
+    }
+    if(job.status == TRANSFER_DONE && !commit_job(tm, job)) {
+        job.status = TRANSFER_FAILED;
+    }
+    if(job.status == TRANSFER_DONE) {
+        if(!job.journal_id.empty()) {
+            journal_remove(*tm.journal, job.journal_id);
+        }
+        return;
+    }
+    // Failed or cancelled, keep what we have for the next attempt.
+    // Downloaded data that has not been synced may not survive a crash,
+    // so those keep the offset of the last sync.
+    if(!job.journal_id.empty()) {
+        if(job.direction == TRANSFER_UPLOAD) {
+            job.journaled_offset = std::max(confirmed, job.journaled_offset);
+        }
+        journal_release(*tm.journal, job.journal_id, job.journaled_offset);
+    }
+}
+
+static void update_journal(TransferManager &tm, TransferJob &job) {
+    if(job.journal_id.empty()) {
+        return;
+    }
+    // Downloaded chunks are written out of order and may sit in the page
+    // cache for a while. An offset is recorded only once everything below
+    // it is on disk, or a power cut could leave a hole of zeros that
+    // resuming skips.
+    if(job.journal_sync) {
+        if(!job.journal_sync->done) {
+            return;
+        }
+        if(job.journal_sync->result == 0) {
+            journal_update(*tm.journal, job.journal_id, job.sync_offset);
+            job.journaled_offset = job.sync_offset;
+        } else {
+            printf("Could not sync %s: %s\n", job.temp_path.c_str(), strerror(-job.journal_sync->result));
+        }
+        release_disk_op(*tm.io, std::move(job.journal_sync));
+        return;
+    }
+    uint64_t confirmed = confirmed_offset(job);
+    if(confirmed < job.journaled_offset + SFTP_JOURNAL_INTERVAL) {
+        return;
+    }
+    if(job.direction == TRANSFER_UPLOAD) {
+        journal_update(*tm.journal, job.journal_id, confirmed);
+        job.journaled_offset = confirmed;
+        return;
+    }
+    job.journal_sync = acquire_disk_op(*tm.io, 0);
+    job.sync_offset = confirmed;
+    submit_disk_sync(*tm.io, *job.journal_sync, job.download.local_fd);
+}
+
+static TransferStatus feed_job(TransferManager &tm, TransferJob &job) {
+    if(!job_moves_data(job)) {
+        if(!feed_remote_copy(job.remote)) {
+            return TRANSFER_FAILED;
+        }
+        if(!job.remote.done) {
+            return TRANSFER_RUNNING;
+        }
+        job.transferred = job.size;
+        return TRANSFER_DONE;
+    }
+    if(job.use_delta) {
+        if(!feed_delta(job.delta)) {
+            if(!job.delta.can_fall_back) {
+                return TRANSFER_FAILED;
+            }
+            // The helper could not run, send the whole file instead.
+            finish_delta(job.delta);
+            job.use_delta = false;
+            return start_plain(tm, job) ? TRANSFER_RUNNING : TRANSFER_FAILED;
+        }
+        job.size = job.delta.size;
+        job.transferred = job.delta.transferred;
+        return job.delta.phase == DELTA_DONE ? TRANSFER_DONE : TRANSFER_RUNNING;
+    }
+    if(job.direction == TRANSFER_DOWNLOAD) {
+        job.download.max_requests = requests_per_job(tm);
+        auto status = feed_download(job.download);
+        job.size = job.download.size;
+        job.transferred = job.download.transferred;
+        return status;
+    }
+    job.upload.max_requests = requests_per_job(tm);
+    auto status = feed_upload(job.upload);
+    job.transferred = job.upload.transferred;
+    return status;
+}
+
+static bool open_walk(TransferManager &tm, DirWalk &w) {
+    if(w.direction == TRANSFER_DOWNLOAD) {
+        if(g_mkdir_with_parents(w.local_path.c_str(), 0755) != 0) {
+            printf("Could not create local directory %s.\n", w.local_path.c_str());
+            return false;
+        }
+        w.remote_dir = SftpDir(sftp_opendir(tm.sftp, w.remote_path.c_str()));
+        if(w.remote_dir == nullptr) {
+            printf("Could not open remote directory %s: %s\n", w.remote_path.c_str(), ssh_get_error(tm.session));
+            return false;
+        }
+        return true;
+    }
+    if(sftp_mkdir(tm.sftp, w.remote_path.c_str(), 0755) != SSH_OK) {
+        // Most likely it already exists, which is fine for directories.
+        sftp_attributes attr = sftp_stat(tm.sftp, w.remote_path.c_str());
+        bool is_dir = attr && attr->type == SSH_FILEXFER_TYPE_DIRECTORY;
+        if(attr) {
+            sftp_attributes_free(attr);
+        }
+        if(!is_dir) {
+            printf("Could not create remote directory %s: %s\n", w.remote_path.c_str(), ssh_get_error(tm.session));
+            return false;
+        }
+    }
+    w.local_dir = g_dir_open(w.local_path.c_str(), 0, nullptr);
+    if(!w.local_dir) {
+        printf("Could not open local directory %s.\n", w.local_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void queue_walk(TransferManager &tm, TransferDirection direction,
+                       const std::string &local_path, const std::string &remote_path) {
+    std::unique_ptr<DirWalk> w(new DirWalk());
+    w->direction = direction;
+    w->local_path = local_path;
+    w->remote_path = remote_path;
+    w->local_dir = nullptr;
+    tm.walks.push_back(std::move(w));
+}
+
+static void close_walk(DirWalk &w) {
+    w.remote_dir = SftpDir();
+    if(w.local_dir) {
+        g_dir_close(w.local_dir);
+        w.local_dir = nullptr;
+    }
+}
+
+// Returns false once the directory has been fully read. Each READDIR
+// reply carries as many names as the server cares to send, sftp_readdir
+// only goes to the network once it has handed all of them out.
+static bool step_walk(TransferManager &tm, DirWalk &w) {
+    for(int i=0; i<SFTP_WALK_BATCH; i++) {
+        if(w.direction == TRANSFER_DOWNLOAD) {
+            sftp_attributes attr = sftp_readdir(tm.sftp, w.remote_dir);
+            if(!attr) {
+                if(!sftp_dir_eof(w.remote_dir)) {
+                    printf("Could not read remote directory %s: %s\n", w.remote_path.c_str(), ssh_get_error(tm.session));
+                }
+                return false;
+            }
+            std::string name(attr->name);
+            std::string remote = w.remote_path + "/" + name;
+            std::string local = w.local_path + "/" + name;
+            if(attr->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+                if(name != "." && name != "..") {
+                    queue_walk(tm, TRANSFER_DOWNLOAD, local, remote);
+                }
+            } else if(attr->type == SSH_FILEXFER_TYPE_REGULAR) {
+                queue_download(tm, remote.c_str(), local.c_str(), attr->size);
+            } // FIXME, symlinks and special files are skipped.
+            sftp_attributes_free(attr);
+        } else {
+            const gchar *name = g_dir_read_name(w.local_dir);
+            if(!name) {
+                return false;
+            }
+            std::string remote = w.remote_path + "/" + name;
+            std::string local = w.local_path + "/" + name;
+            if(g_file_test(local.c_str(), G_FILE_TEST_IS_DIR)) {
+                queue_walk(tm, TRANSFER_UPLOAD, local, remote);
+            } else if(g_file_test(local.c_str(), G_FILE_TEST_IS_REGULAR)) {
+                queue_upload(tm, local.c_str(), remote.c_str());
+            }
+        }
+    }
+    return true;
+}
+
+// Reads a batch of entries from each of the first max_walks directories.
+static void feed_walks(TransferManager &tm) {
+    const size_t num_walks = std::min(tm.walks.size(), (size_t)tm.max_walks);
+    std::vector<DirWalk*> finished;
+    for(size_t i=0; i<num_walks && tm.queued.size() < SFTP_MAX_QUEUED; i++) {
+        DirWalk &w = *tm.walks[i];
+        bool is_open = w.remote_dir != nullptr || w.local_dir != nullptr;
+        if((!is_open && !open_walk(tm, w)) || !step_walk(tm, w)) {
+            close_walk(w);
+            finished.push_back(&w);
+        }
+    }
+    tm.walks.erase(std::remove_if(tm.walks.begin(), tm.walks.end(),
+                                  [&finished](const std::unique_ptr<DirWalk> &w) {
+                                      return std::find(finished.begin(), finished.end(), w.get()) != finished.end();
+                                  }),
+                   tm.walks.end());
+}
+
+// Walking directories, matching delta blocks and starting jobs held
+// back by the start limit must not depend on traffic on the session
+// socket, as they may generate none. A full queue is drained by socket
+// traffic, which restarts walking.
+static bool needs_idle(const TransferManager &tm) {
+    if(!tm.walks.empty() && tm.queued.size() < SFTP_MAX_QUEUED) {
+        return true;
+    }
+    // Jobs left waiting by the start limit.
+    if(!tm.queued.empty() && (int)tm.active.size() < tm.max_active) {
+        return true;
+    }
+    for(const auto &job : tm.active) {
+        if(job->use_delta && delta_busy(job->delta)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static gboolean transfer_idle(gpointer data) {
+    TransferManager &tm = *reinterpret_cast<TransferManager*>(data);
+    feed_transfers(tm);
+    if(!needs_idle(tm)) {
+        tm.idle_source = 0;
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void schedule_idle(TransferManager &tm) {
+    if(tm.idle_source == 0 && needs_idle(tm)) {
+        tm.idle_source = thread_idle_add(transfer_idle, &tm);
+    }
+}
+
+void queue_download_tree(TransferManager &tm, const char *remote_path, const char *local_path) {
+    queue_walk(tm, TRANSFER_DOWNLOAD, local_path, remote_path);
+    schedule_idle(tm);
+}
+
+void queue_upload_tree(TransferManager &tm, const char *local_path, const char *remote_path) {
+    queue_walk(tm, TRANSFER_UPLOAD, local_path, remote_path);
+    schedule_idle(tm);
+}
+
+static void start_queued_jobs(TransferManager &tm, int &starts) {
+    while((int)tm.active.size() < tm.max_active && !tm.queued.empty() && starts > 0) {
+        starts--;
+        std::unique_ptr<TransferJob> job = std::move(tm.queued.front());
+        tm.queued.pop_front();
+        tm.active.push_back(std::move(job));
+        if(!start_job(tm, *tm.active.back())) {
+            tm.files_failed++;
+            if(tm.job_changed) {
+                tm.job_changed(*tm.active.back(), tm.callback_data);
+            }
+            tm.active.pop_back();
+        }
+    }
+}
+
+// Returns true if some job finished and freed its slot.
+static bool feed_active_jobs(TransferManager &tm) {
+    const size_t num_jobs = tm.active.size();
+    if(num_jobs == 0) {
+        return false;
+    }
+    // Start from a different job each time so that the first one does not
+    // always get the channel window to itself.
+    std::vector<TransferJob*> finished;
+    for(size_t i=0; i<num_jobs; i++) {
+        TransferJob &job = *tm.active[(tm.next_to_feed + i) % num_jobs];
+        uint64_t old_transferred = job.transferred;
+        job.status = feed_job(tm, job);
+        if(job.transferred > old_transferred && job_moves_data(job)) {
+            tm.bytes_moved += job.transferred - old_transferred;
+        }
+        if(job.status != TRANSFER_RUNNING) {
+            if(job.status == TRANSFER_DONE) {
+                tm.files_done++;
+                if(job.use_delta && job.delta.size > job.delta.sent) {
+                    tm.delta_saved += job.delta.size - job.delta.sent;
+                }
+            } else {
+                tm.files_failed++;
+            }
+            finish_job(tm, job);
+            finished.push_back(&job);
+        } else {
+            update_journal(tm, job);
+        }
+        if(tm.job_changed && (job.status != TRANSFER_RUNNING || job.transferred != old_transferred)) {
+            tm.job_changed(job, tm.callback_data);
+        }
+    }
+    tm.next_to_feed = (tm.next_to_feed + 1) % num_jobs;
+    if(finished.empty()) {
+        return false;
+    }
+    tm.active.erase(std::remove_if(tm.active.begin(), tm.active.end(),
+                                   [&finished](const std::unique_ptr<TransferJob> &j) {
+                                       return std::find(finished.begin(), finished.end(), j.get()) != finished.end();
+                                   }),
+                    tm.active.end());
+    return true;
+}
+
+void feed_transfers(TransferManager &tm) {
+    feed_walks(tm);
+    // Whenever slots are freed the next jobs are started right away, up
+    // to the limit. Small files would otherwise keep the I/O thread here
+    // for as long as the queue lasts.
+    int starts = SFTP_STARTS_PER_FEED;
+    do {
+        start_queued_jobs(tm, starts);
+    } while(feed_active_jobs(tm) && starts > 0);
+    schedule_idle(tm);
+}
+
+// Dropped jobs are reported and counted as failed so that neither the
+// transfer list nor the statistics keep showing them as running.
+void cancel_transfers(TransferManager &tm) {
+    for(auto &job : tm.active) {
+        finish_job(tm, *job);
+        job->status = TRANSFER_FAILED;
+        tm.files_failed++;
+        if(tm.job_changed) {
+            tm.job_changed(*job, tm.callback_data);
+        }
+    }
+    tm.active.clear();
+    for(auto &job : tm.queued) {
+        job->status = TRANSFER_FAILED;
+        tm.files_failed++;
+        if(tm.job_changed) {
+            tm.job_changed(*job, tm.callback_data);
+        }
+    }
+    tm.queued.clear();
+    for(auto &w : tm.walks) {
+        close_walk(*w);
+    }
+    tm.walks.clear();
+    if(tm.idle_source) {
+        thread_source_remove(tm.idle_source);
+        tm.idle_source = 0;
+    }
+}
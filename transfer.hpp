@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<ssh_util.hpp>
+#include<journal.hpp>
+#include<delta.hpp>
+#include<diskio.hpp>
+#include<remotecopy.hpp>
+#include<gio/gio.h>
+#include<deque>
+#include<vector>
+#include<memory>
+#include<string>
+
+// How many requests are kept in flight unless the caller says otherwise.
+static const constexpr int SFTP_DEFAULT_MAX_REQUESTS = 32;
+// How many files are transferred at the same time.
+static const constexpr int SFTP_DEFAULT_MAX_ACTIVE = 8;
+// How many directories are being read at the same time.
+static const constexpr int SFTP_DEFAULT_MAX_WALKS = 2;
+// Directory entries processed per walk before moving on to other work.
+static const constexpr int SFTP_WALK_BATCH = 64;
+// Walking pauses while this many files are waiting to be transferred.
+static const constexpr size_t SFTP_MAX_QUEUED = 256;
+// Used if the server does not tell us its limits.
+static const constexpr uint32_t SFTP_FALLBACK_CHUNK_SIZE = 32*1024;
+// Upper bound for a single request regardless of what the server allows.
+static const constexpr uint32_t SFTP_MAX_CHUNK_SIZE = 256*1024;
+// Files are written under this suffix and renamed once complete.
+static const constexpr char SFTP_PARTIAL_SUFFIX[] = ".part";
+// Smaller files are cheaper to send again than to keep in the journal.
+static const constexpr uint64_t SFTP_JOURNAL_MIN_SIZE = 1024*1024;
+// Opening and closing files are blocking round trips. This many jobs
+// are started per feed, then other sessions get their turn.
+static const constexpr int SFTP_STARTS_PER_FEED = 2;
+// How much progress is made between journal updates.
+static const constexpr uint64_t SFTP_JOURNAL_INTERVAL = 8*1024*1024;
+
+enum TransferStatus {
+    TRANSFER_QUEUED,
+    TRANSFER_RUNNING,
+    TRANSFER_DONE,
+    TRANSFER_FAILED,
+};
+
+struct ReadRequest {
+    sftp_aio aio; // As for writes.
+    uint64_t offset;
+    uint32_t size;
+    gint64 sent; // Monotonic time.
+};
+
+struct WriteRequest {
+    sftp_aio aio; // Owns the request id until the reply has been seen.
+    uint64_t offset;
+    uint32_t size;
+    gint64 sent;
+};
+
+/*
+ * A download that keeps up to max_requests reads outstanding. Replies
+ * are consumed in the order the requests were issued and handed to the
+ * disk engine as positional writes, which may complete in any order.
+ * Chunks waiting for the disk count against max_requests so a slow disk
+ * throttles the network instead of filling memory.
+ */
+struct SftpDownload {
+    ssh_session session; // A non-owning pointer.
+    DiskIo *io;          // Ditto.
+    SftpFile remote_file;
+    int local_fd;
+    std::deque<ReadRequest> requests;
+    std::deque<std::unique_ptr<DiskOp>> writes;
+    uint32_t chunk_size;
+    int max_requests;
+    uint64_t next_offset;
+    bool eof;
+    // Smoothed time from sending a request to taking its reply, in
+    // microseconds. Replies are taken in order so a slow disk shows
+    // here too.
+    gint64 reply_time;
+
+    uint64_t size;
+    uint64_t transferred; // Bytes that have reached the disk.
+};
+
+/*
+ * An upload that keeps up to max_requests writes outstanding. The local
+ * file is read ahead by the disk engine, in file order, so that a chunk
+ * is usually ready when the channel window opens. Pipes and other
+ * streams have no size and are read one chunk at a time.
+ *
+ * Acknowledgements may be collected in any order, transferred only
+ * counts bytes the server has confirmed. Since they can arrive out of
+ * order, upload_confirmed tells how much of the file is known to be
+ * complete.
+ */
+struct SftpUpload {
+    ssh_session session; // A non-owning pointer.
+    sftp_session sftp;   // Ditto.
+    DiskIo *io;          // Ditto.
+    SftpFile remote_file;
+    int local_fd;
+    bool streaming;
+    std::deque<WriteRequest> requests;
+    std::deque<std::unique_ptr<DiskOp>> reads;
+    uint32_t chunk_size;
+    int max_requests;
+    uint64_t next_offset;
+    uint64_t read_offset;
+    bool read_eof;
+    gint64 reply_time; // As for downloads.
+
+    uint64_t size;
+    uint64_t transferred;
+};
+
+uint32_t negotiate_read_size(sftp_session sftp);
+uint32_t negotiate_write_size(sftp_session sftp);
+
+// Transfers start from offset, anything the destination has after it is overwritten.
+bool start_download(SftpDownload &dl, DiskIo &io, ssh_session session, sftp_session sftp,
+                    const char *remote_path, const char *local_path,
+                    uint64_t size, uint64_t offset, int max_requests);
+TransferStatus feed_download(SftpDownload &dl);
+uint64_t download_confirmed(const SftpDownload &dl);
+void finish_download(SftpDownload &dl);
+
+bool start_upload(SftpUpload &ul, DiskIo &io, ssh_session session, sftp_session sftp,
+                  const char *local_path, const char *remote_path,
+                  uint64_t offset, int max_requests);
+TransferStatus feed_upload(SftpUpload &ul);
+uint64_t upload_confirmed(const SftpUpload &ul);
+void finish_upload(SftpUpload &ul);
+
+enum TransferDirection {
+    TRANSFER_DOWNLOAD,
+    TRANSFER_UPLOAD,
+    TRANSFER_REMOTE_COPY, // From remote_path to remote_path on the server.
+    TRANSFER_REMOTE_MOVE,
+};
+
+struct TransferJob {
+    int id;
+    TransferDirection direction;
+    std::string local_path;
+    std::string remote_path;
+    std::string source_path; // Remote copies and moves.
+    std::string temp_path;
+    std::string journal_id; // Empty if the job is not journaled.
+    uint64_t journaled_offset;
+    std::unique_ptr<DiskOp> journal_sync; // Downloads, flushing up to sync_offset.
+    uint64_t sync_offset;
+    TransferStatus status;
+    bool use_delta;
+    SftpDownload download;
+    SftpUpload upload;
+    DeltaTransfer delta;
+    RemoteCopy remote;
+
+    uint64_t size;
+    uint64_t transferred;
+    gint64 started; // Monotonic time.
+};
+
+typedef void (*TransferCallback)(const TransferJob &job, void *data);
+
+/*
+ * A directory that is being copied. Subdirectories become new walks and
+ * files become jobs in the manager's queue.
+ */
+struct DirWalk {
+    TransferDirection direction;
+    std::string local_path;
+    std::string remote_path;
+    SftpDir remote_dir; // Downloads.
+    GDir *local_dir;    // Uploads.
+};
+
+/*
+ * Runs queued jobs max_active at a time over one SFTP session. The
+ * max_requests budget is split evenly between the running jobs and they
+ * are fed round robin so that none of them can hog the channel window.
+ *
+ * Files are written under a temporary name and renamed when complete.
+ * Progress of large files is kept in the journal so that jobs which did
+ * not finish continue where they left off, also after a restart.
+ * Copies and moves within the server take a slot like any other job
+ * but are not journaled.
+ */
+struct TransferManager {
+    ssh_session session; // A non-owning pointer.
+    sftp_session sftp;   // Ditto.
+    int max_active;
+    int max_requests;
+    int max_walks;
+    bool delta; // Send only changed blocks of files the other side has.
+    int next_id;
+    size_t next_to_feed;
+    std::deque<std::unique_ptr<TransferJob>> queued;
+    std::vector<std::unique_ptr<TransferJob>> active;
+    std::deque<std::unique_ptr<DirWalk>> walks;
+    guint idle_source;
+    TransferJournal *journal; // Shared by all sessions, not owned. Null if nothing is journaled.
+    std::string session_key;  // user@host:port, for the journal.
+    // Totals for the statistics.
+    uint64_t bytes_moved;
+    uint64_t files_done;
+    uint64_t files_failed;
+    uint64_t delta_saved; // File data that delta transfers did not send.
+    DiskIo *io; // Shared by all sessions, not owned.
+
+    // Called whenever the status or progress of a job changes.
+    TransferCallback job_changed;
+    void *callback_data;
+};
+
+// Also queues the unfinished jobs that the journal has for this session.
+void init_transfer_manager(TransferManager &tm, DiskIo &io, TransferJournal *journal,
+                           ssh_session session, sftp_session sftp,
+                           TransferCallback job_changed, void *callback_data);
+int queue_download(TransferManager &tm, const char *remote_path, const char *local_path, uint64_t size);
+int queue_upload(TransferManager &tm, const char *local_path, const char *remote_path);
+void queue_download_tree(TransferManager &tm, const char *remote_path, const char *local_path);
+void queue_upload_tree(TransferManager &tm, const char *local_path, const char *remote_path);
+// Done by the server, file data does not cross the network.
+int queue_remote_copy(TransferManager &tm, const char *from, const char *to);
+int queue_remote_move(TransferManager &tm, const char *from, const char *to);
+bool job_moves_data(const TransferJob &job);
+const char* transfer_direction_name(TransferDirection direction);
+bool transfers_pending(const TransferManager &tm);
+void feed_transfers(TransferManager &tm);
+void cancel_transfers(TransferManager &tm);
@@ -48,7 +48,38 @@ bool fd_has_data(int fd) {
     tv.tv_sec = 0;
     tv.tv_usec = 0;
 
-    retval = select(1, &rfds, NULL, NULL, &tv);
+    retval = select(fd + 1, &rfds, NULL, NULL, &tv);
 
     return retval > 0;
 }
+
+static guint attach_to_thread(GSource *source) {
+    guint id = g_source_attach(source, g_main_context_get_thread_default());
+    g_source_unref(source);
+    return id;
+}
+
+guint thread_idle_add(GSourceFunc func, gpointer data) {
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, func, data, nullptr);
+    return attach_to_thread(source);
+}
+
+guint thread_timeout_add(guint interval, GSourceFunc func, gpointer data) {
+    GSource *source = g_timeout_source_new(interval);
+    g_source_set_callback(source, func, data, nullptr);
+    return attach_to_thread(source);
+}
+
+guint thread_io_add_watch(GIOChannel *channel, GIOCondition condition, GIOFunc func, gpointer data) {
+    GSource *source = g_io_create_watch(channel, condition);
+    g_source_set_callback(source, (GSourceFunc) func, data, nullptr);
+    return attach_to_thread(source);
+}
+
+void thread_source_remove(guint id) {
+    GSource *source = g_main_context_find_source_by_id(g_main_context_get_thread_default(), id);
+    if(source) {
+        g_source_destroy(source);
+    }
+}
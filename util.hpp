@@ -17,9 +17,17 @@
 
 #pragma once
 
+#include<glib.h>
 #include<string>
 
 std::string data_file_name(const char *basename);
 std::string split_filename(const char *fname);
 
 bool fd_has_data(int fd);
+
+// Like their g_ counterparts, but attach to the thread default context
+// so that code running on the I/O thread stays on it.
+guint thread_idle_add(GSourceFunc func, gpointer data);
+guint thread_timeout_add(guint interval, GSourceFunc func, gpointer data);
+guint thread_io_add_watch(GIOChannel *channel, GIOCondition condition, GIOFunc func, gpointer data);
+void thread_source_remove(guint id);